@@ -0,0 +1,59 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+# Measures the cost of scoping a state to a block (e.g. around every database or cache call), comparing `State#apply` with saving and restoring the previous state in Ruby, with and without inheritance by new fibers and threads (which stores every newly applied state in fiber storage).
+#
+# Build the extension and run:
+#
+# 	ruby -Ilib -Iext benchmark/apply.rb [iterations]
+
+require "ruby/profiler"
+
+ITERATIONS = Integer(ARGV.fetch(0, 1_000_000))
+
+def measure(name)
+	# Warm up:
+	yield
+	
+	start = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+	
+	ITERATIONS.times do
+		yield
+	end
+	
+	duration = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) - start
+	
+	puts "#{name}: #{(duration / ITERATIONS * 1e9).round(1)}ns per block"
+end
+
+Ruby::Profiler::State.new(request_id: "abc123").apply!
+state = Ruby::Profiler::State.new(request_id: "abc123", operation: "query")
+
+[true, false].each do |inherit|
+	Ruby::Profiler::State.inherit = inherit
+	suffix = inherit ? "" : " (without inheritance)"
+	
+	measure("State#apply!#{suffix}") do
+		state.apply!
+	end
+	
+	measure("ensure#{suffix}") do
+		previous = Fiber.current.ruby_profiler_state
+		
+		begin
+			state.apply!
+		ensure
+			previous.apply!
+		end
+	end
+	
+	measure("State#apply#{suffix}") do
+		state.apply{}
+	end
+	
+	measure("State.with#{suffix}") do
+		Ruby::Profiler::State.with(operation: "query"){}
+	end
+end
@@ -0,0 +1,51 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+# Measures the cost of creating and running a fiber (e.g. for every `Async{}` task), with and without a state to inherit.
+#
+# Build the extension and run:
+#
+# 	ruby -Ilib -Iext benchmark/fiber_creation.rb [iterations]
+
+require "ruby/profiler"
+
+ITERATIONS = Integer(ARGV.fetch(0, 200_000))
+
+def measure(name)
+	# Warm up:
+	yield
+	
+	start = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+	
+	ITERATIONS.times do
+		yield
+	end
+	
+	duration = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) - start
+	
+	puts "#{name}: #{(duration / ITERATIONS * 1e9).round(1)}ns per fiber"
+end
+
+# Compare with the fiber switch hook installed, which is otherwise installed by the first state applied:
+Ruby::Profiler.enable!
+
+Fiber.new do
+	measure("No state") do
+		Fiber.new{}.resume
+	end
+	
+	Ruby::Profiler::State.new(request_id: "abc123").apply!
+	
+	measure("Inherited state") do
+		Fiber.new{}.resume
+	end
+	
+	Ruby::Profiler::State.inherit = false
+	Ruby::Profiler::State.new(request_id: "abc123").apply!
+	
+	measure("Inheritance disabled") do
+		Fiber.new{}.resume
+	end
+end.resume
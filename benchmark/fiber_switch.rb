@@ -0,0 +1,43 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+# Measures the cost of fiber switches with many fibers, each with an applied state, since the fiber switch hook looks up the state of every fiber it switches to, with and without charging CPU time to states (see `State.cpu_time=`).
+#
+# Build the extension and run:
+#
+# 	ruby -Ilib -Iext benchmark/fiber_switch.rb [fibers] [rounds]
+
+require "ruby/profiler"
+
+FIBERS = Integer(ARGV.fetch(0, 10_000))
+ROUNDS = Integer(ARGV.fetch(1, 100))
+
+fibers = FIBERS.times.map do |index|
+	Fiber.new do
+		Ruby::Profiler::State.new(index: index).apply!
+		
+		loop{Fiber.yield}
+	end
+end
+
+# Warm up (and apply the states):
+fibers.each(&:resume)
+
+[false, true].each do |cpu_time|
+	Ruby::Profiler::State.cpu_time = cpu_time
+	
+	start = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+	
+	ROUNDS.times do
+		fibers.each(&:resume)
+	end
+	
+	duration = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) - start
+	
+	# Each resume switches into the fiber and back again:
+	switches = FIBERS * ROUNDS * 2
+	
+	puts "#{FIBERS} fibers (cpu_time=#{cpu_time}): #{(duration / switches * 1e9).round(1)}ns per switch (#{GC.count} GCs)"
+end
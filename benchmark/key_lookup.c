@@ -0,0 +1,128 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+// Compares key lookups in large states using linear probing of the pairs against the vectorized key index.
+//
+// Build and run (the key index requires AVX2):
+//
+// 	cc -O2 -mavx2 -I$(ruby -e 'print RbConfig::CONFIG["rubyhdrdir"]') -I$(ruby -e 'print RbConfig::CONFIG["rubyarchhdrdir"]') benchmark/key_lookup.c -o key_lookup && ./key_lookup
+
+#include "../ext/ruby/profiler/state.h"
+#include "../ext/ruby/profiler/key_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef RUBY_PROFILER_KEY_INDEX
+#error "The key index requires AVX2, try building with -mavx2."
+#endif
+
+#define ITERATIONS 2000000
+
+struct table {
+	size_t capacity;
+	struct Ruby_Profiler_Pair pairs[64];
+	ID keys[64];
+};
+
+static void insert(struct table *table, ID key) {
+	size_t mask = table->capacity - 1;
+	size_t idx = Ruby_Profiler_State_hash(key) & mask;
+	
+	for (size_t i = 0; i < table->capacity; i++) {
+		size_t pos = (idx + i) & mask;
+		
+		if (table->pairs[pos].key == 0) {
+			table->pairs[pos].key = key;
+			table->pairs[pos].value = key;
+			table->keys[pos] = key;
+			return;
+		}
+	}
+}
+
+// The same probe as Ruby_Profiler_State_find_pair without a key index:
+static struct Ruby_Profiler_Pair *find_probe(struct table *table, ID key) {
+	size_t mask = table->capacity - 1;
+	size_t idx = Ruby_Profiler_State_hash(key) & mask;
+	
+	for (size_t i = 0; i < table->capacity; i++) {
+		size_t pos = (idx + i) & mask;
+		
+		if (table->pairs[pos].key == key) {
+			return &table->pairs[pos];
+		}
+		if (table->pairs[pos].key == 0) {
+			return NULL;
+		}
+	}
+	
+	return NULL;
+}
+
+static struct Ruby_Profiler_Pair *find_index(struct table *table, ID key) {
+	size_t pos = Ruby_Profiler_Key_Index_find(table->keys, table->capacity, Ruby_Profiler_State_hash(key), key);
+	return pos < table->capacity ? &table->pairs[pos] : NULL;
+}
+
+typedef struct Ruby_Profiler_Pair *(*find_function)(struct table *table, ID key);
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Look up every key plus one missing key, returning nanoseconds per lookup:
+static double measure(find_function find, struct table *table, ID *keys, size_t count) {
+	volatile VALUE sink = 0;
+	double start = now();
+	
+	for (size_t iteration = 0; iteration < ITERATIONS; iteration++) {
+		for (size_t i = 0; i <= count; i++) {
+			struct Ruby_Profiler_Pair *pair = find(table, keys[i]);
+			if (pair) sink += pair->value;
+		}
+	}
+	
+	(void)sink;
+	
+	return (now() - start) * 1e9 / ((double)ITERATIONS * (count + 1));
+}
+
+int main(void) {
+	static const size_t counts[] = {16, 33, 64};
+	
+	printf("%8s %12s %12s\n", "pairs", "probe (ns)", "index (ns)");
+	
+	srand(1);
+	
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		size_t count = counts[c];
+		struct table table = {0};
+		ID keys[65];
+		
+		table.capacity = 1;
+		while (table.capacity < count) table.capacity <<= 1;
+		
+		// Realistic local symbol IDs (see probe_length.c):
+		ID serial = 10000 + (rand() % 50000);
+		for (size_t i = 0; i <= count; i++) {
+			serial += 1 + (rand() % 8);
+			keys[i] = serial << 4;
+		}
+		
+		// The last key is never inserted, to measure misses:
+		for (size_t i = 0; i < count; i++) {
+			insert(&table, keys[i]);
+		}
+		
+		printf("%8zu %12.2f %12.2f\n", count,
+			measure(find_probe, &table, keys, count),
+			measure(find_index, &table, keys, count)
+		);
+	}
+	
+	return 0;
+}
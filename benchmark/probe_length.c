@@ -0,0 +1,123 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+// Measures linear probe lengths for realistic sets of Ruby IDs, comparing the original `key & mask` slot selection with `Ruby_Profiler_State_hash`.
+//
+// Build and run:
+//
+// 	cc -O2 -I$(ruby -e 'print RbConfig::CONFIG["rubyhdrdir"]') -I$(ruby -e 'print RbConfig::CONFIG["rubyarchhdrdir"]') benchmark/probe_length.c -o probe_length && ./probe_length
+
+#include "../ext/ruby/profiler/state.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Ruby IDs are `serial << RUBY_ID_SCOPE_SHIFT | scope` (see Ruby's symbol.h):
+#define RUBY_ID_SCOPE_SHIFT 4
+#define ID_LOCAL 0x00
+#define ID_INSTANCE 0x01
+#define ID_ATTRSET 0x08
+
+#define MAXIMUM_CAPACITY 64
+#define SAMPLES 10000
+
+typedef size_t (*hash_function)(ID key);
+
+static size_t legacy_hash(ID key) {
+	return (size_t)key;
+}
+
+static size_t mixed_hash(ID key) {
+	return Ruby_Profiler_State_hash(key);
+}
+
+struct statistics {
+	size_t lookups;
+	size_t probes;
+	size_t maximum;
+};
+
+// Insert all keys, then look each one up and count the slots visited:
+static void measure(hash_function hash, ID *keys, size_t count, size_t capacity, struct statistics *statistics) {
+	ID table[MAXIMUM_CAPACITY] = {0};
+	size_t mask = capacity - 1;
+	
+	for (size_t i = 0; i < count; i++) {
+		size_t idx = hash(keys[i]) & mask;
+		
+		for (size_t j = 0; j < capacity; j++) {
+			size_t pos = (idx + j) & mask;
+			
+			if (table[pos] == 0) {
+				table[pos] = keys[i];
+				break;
+			}
+		}
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		size_t idx = hash(keys[i]) & mask;
+		
+		for (size_t j = 0; j < capacity; j++) {
+			if (table[(idx + j) & mask] == keys[i]) {
+				statistics->lookups++;
+				statistics->probes += j + 1;
+				if (j + 1 > statistics->maximum) statistics->maximum = j + 1;
+				break;
+			}
+		}
+	}
+}
+
+static size_t round_capacity(size_t count) {
+	size_t capacity = 1;
+	while (capacity < count) capacity <<= 1;
+	return capacity;
+}
+
+// Symbols used together tend to be interned together (e.g. when the file using them is parsed), so serials are close but not contiguous:
+static void generate_keys(ID *keys, size_t count, int scope) {
+	ID serial = 10000 + (rand() % 50000);
+	
+	for (size_t i = 0; i < count; i++) {
+		serial += 1 + (rand() % 8);
+		keys[i] = (serial << RUBY_ID_SCOPE_SHIFT) | scope;
+	}
+}
+
+static void report(const char *name, int scope) {
+	static const size_t counts[] = {2, 4, 8, 16, 33, 64};
+	
+	printf("%s:\n", name);
+	printf("%8s %10s %10s %10s %10s\n", "pairs", "legacy", "(max)", "mixed", "(max)");
+	
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		size_t count = counts[c];
+		size_t capacity = round_capacity(count);
+		struct statistics legacy = {0}, mixed = {0};
+		ID keys[MAXIMUM_CAPACITY];
+		
+		for (size_t sample = 0; sample < SAMPLES; sample++) {
+			generate_keys(keys, count, scope);
+			measure(legacy_hash, keys, count, capacity, &legacy);
+			measure(mixed_hash, keys, count, capacity, &mixed);
+		}
+		
+		printf("%8zu %10.2f %10zu %10.2f %10zu\n", count,
+			(double)legacy.probes / legacy.lookups, legacy.maximum,
+			(double)mixed.probes / mixed.lookups, mixed.maximum
+		);
+	}
+	
+	printf("\n");
+}
+
+int main(void) {
+	srand(1);
+	
+	report("Local symbols (e.g. :request_id)", ID_LOCAL);
+	report("Instance variable symbols (e.g. :@request_id)", ID_INSTANCE);
+	report("Attribute assignment symbols (e.g. :request_id=)", ID_ATTRSET);
+	
+	return 0;
+}
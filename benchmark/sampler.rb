@@ -0,0 +1,51 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+# Measures the overhead of `Ruby::Profiler::Sampler` on CPU bound work, comparing the CPU time of the same work with and without sampling.
+#
+# Build the extension and run:
+#
+# 	ruby -Ilib -Iext benchmark/sampler.rb [frequency] [rounds]
+
+require "ruby/profiler"
+
+FREQUENCY = Float(ARGV.fetch(0, 99))
+ROUNDS = Integer(ARGV.fetch(1, 5))
+
+def work
+	# Alternate between states, so that samples are counted against several values:
+	%w[/users /posts /comments].each do |endpoint|
+		Ruby::Profiler::State.with(endpoint: endpoint) do
+			200_000.times.sum{|i| i * i}
+		end
+	end
+end
+
+def measure
+	start = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+	yield
+	Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) - start
+end
+
+sampler = Ruby::Profiler::Sampler.new(:endpoint, frequency: FREQUENCY)
+
+# Warm up:
+work
+
+baseline = []
+sampled = []
+
+# Alternate between the two, taking the best of each, to reduce the effect of noise:
+ROUNDS.times do
+	baseline << measure{10.times{work}}
+	
+	sampler.start
+	sampled << measure{10.times{work}}
+	sampler.stop
+end
+
+puts "Without sampling: #{(baseline.min * 1000).round(1)}ms"
+puts "Sampling at #{FREQUENCY}Hz: #{(sampled.min * 1000).round(1)}ms (#{((sampled.min / baseline.min - 1) * 100).round(2)}%)"
+puts "Samples: #{sampler.samples.inspect}"
@@ -0,0 +1,9 @@
+#ifndef EXTCONF_H
+#define EXTCONF_H
+#define HAVE_RB_FIBER_CURRENT 1
+#define HAVE_RB_EXT_RACTOR_SAFE 1
+#define HAVE_CONST_RUBY_TYPED_EMBEDDABLE 1
+#define HAVE_RB_INTERNAL_THREAD_ADD_EVENT_HOOK 1
+#define HAVE_RB_INTERNAL_THREAD_SPECIFIC_GET 1
+#define HAVE_TIMER_CREATE 1
+#endif
@@ -9,7 +9,7 @@ require "mkmf"
 gem_name = File.basename(__dir__)
 extension_name = "Ruby_Profiler"
 
-append_cflags(["-Wall", "-Wno-unknown-pragmas", "-std=c99"])
+append_cflags(["-Wall", "-Wno-unknown-pragmas", "-std=c11"])
 
 if ENV.key?("RUBY_DEBUG")
 	$stderr.puts "Enabling debug mode..."
@@ -17,13 +17,29 @@ if ENV.key?("RUBY_DEBUG")
 	append_cflags(["-DRUBY_DEBUG", "-O0"])
 end
 
-$srcs = ["ruby/profiler/profiler.c", "ruby/profiler/state.c"]
+if ENV.key?("RUBY_PROFILER_NATIVE")
+	$stderr.puts "Enabling native CPU features..."
+	
+	# Enables AVX2 key index lookups where supported:
+	append_cflags(["-march=native"])
+end
+
+$srcs = ["ruby/profiler/profiler.c", "ruby/profiler/state.c", "ruby/profiler/shape.c", "ruby/profiler/slab.c", "ruby/profiler/symbols.c", "ruby/profiler/registry.c", "ruby/profiler/timeline.c", "ruby/profiler/cache.c", "ruby/profiler/fiber.c", "ruby/profiler/thread.c", "ruby/profiler/sampler.c"]
 $VPATH << "$(srcdir)/ruby/profiler"
 
 have_func("rb_fiber_current")
 have_func("rb_ext_ractor_safe")
-have_func("rb_fiber_storage_get")
-have_func("rb_fiber_storage_set")
+have_const("RUBY_TYPED_EMBEDDABLE", "ruby.h")
+
+# Enables tracking of thread lifecycles, and of threads under the M:N thread scheduler (see thread.h):
+have_func("rb_internal_thread_add_event_hook", "ruby/thread.h")
+have_func("rb_internal_thread_specific_get", "ruby/thread.h")
+
+# Enables the sampler on Linux (see sampler.h), where older versions of glibc provide timers in librt:
+have_func("timer_create", "time.h") || (have_library("rt", "timer_create", "time.h") && have_func("timer_create", "time.h"))
+
+# Enables USDT probes (see probes.h):
+have_header("sys/sdt.h")
 
 if ENV.key?("RUBY_SANITIZE")
 	$stderr.puts "Enabling sanitizers..."
@@ -0,0 +1,144 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "cache.h"
+
+#include <ruby/debug.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Starts at 1, so that a zeroed cache is invalid until it is first used:
+_Atomic uint64_t ruby_profiler_cache_epoch = 1;
+
+_Thread_local struct Ruby_Profiler_Cache ruby_profiler_cache;
+
+static VALUE ruby_profiler_cache_tracepoint = Qnil;
+
+// Whether the tracepoint is enabled, without which entries can't be stored:
+static int ruby_profiler_cache_enabled = 0;
+
+static pthread_once_t ruby_profiler_cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ruby_profiler_cache_key;
+
+// Free the entries of a thread's cache when it exits:
+static void Ruby_Profiler_Cache_release(void *argument) {
+	struct Ruby_Profiler_Cache *cache = (struct Ruby_Profiler_Cache*)argument;
+	
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->capacity = 0;
+	cache->count = 0;
+}
+
+static void Ruby_Profiler_Cache_key_create(void) {
+	pthread_key_create(&ruby_profiler_cache_key, Ruby_Profiler_Cache_release);
+}
+
+static struct Ruby_Profiler_Cache_Entry *Ruby_Profiler_Cache_find(struct Ruby_Profiler_Cache_Entry *entries, size_t capacity, uint64_t generation, VALUE fiber) {
+	size_t mask = capacity - 1;
+	
+	for (size_t i = Ruby_Profiler_State_hash((ID)fiber) & mask;; i = (i + 1) & mask) {
+		if (entries[i].generation != generation || entries[i].fiber == fiber) {
+			return &entries[i];
+		}
+	}
+}
+
+// Make room for another entry, returning 0 if the cache can't be used:
+static int Ruby_Profiler_Cache_reserve(struct Ruby_Profiler_Cache *cache) {
+	if (!cache->entries) {
+		cache->entries = calloc(RUBY_PROFILER_CACHE_INITIAL_CAPACITY, sizeof(struct Ruby_Profiler_Cache_Entry));
+		if (!cache->entries) return 0;
+		
+		cache->capacity = RUBY_PROFILER_CACHE_INITIAL_CAPACITY;
+		
+		pthread_once(&ruby_profiler_cache_key_once, Ruby_Profiler_Cache_key_create);
+		pthread_setspecific(ruby_profiler_cache_key, cache);
+	}
+	
+	// Keep the load factor at most 1/2, so that probe sequences stay short (and always end):
+	if ((cache->count + 1) * 2 <= cache->capacity) {
+		return 1;
+	}
+	
+	if (cache->capacity >= RUBY_PROFILER_CACHE_MAXIMUM_CAPACITY) {
+		Ruby_Profiler_Cache_reset();
+		
+		return 1;
+	}
+	
+	size_t capacity = cache->capacity * 2;
+	struct Ruby_Profiler_Cache_Entry *entries = calloc(capacity, sizeof(struct Ruby_Profiler_Cache_Entry));
+	if (!entries) return 0;
+	
+	for (size_t i = 0; i < cache->capacity; i++) {
+		if (cache->entries[i].generation == cache->generation) {
+			*Ruby_Profiler_Cache_find(entries, capacity, cache->generation, cache->entries[i].fiber) = cache->entries[i];
+		}
+	}
+	
+	free(cache->entries);
+	cache->entries = entries;
+	cache->capacity = capacity;
+	
+	return 1;
+}
+
+void Ruby_Profiler_Cache_store(VALUE fiber, VALUE data) {
+	// Without the tracepoint, entries wouldn't be invalidated when fibers are freed or moved:
+	if (!ruby_profiler_cache_enabled) return;
+	
+	struct Ruby_Profiler_Cache *cache = &ruby_profiler_cache;
+	uint64_t epoch = atomic_load_explicit(&ruby_profiler_cache_epoch, memory_order_relaxed);
+	
+	// Entries stored before the current epoch are invalid:
+	if (cache->epoch != epoch) {
+		cache->epoch = epoch;
+		Ruby_Profiler_Cache_reset();
+	}
+	
+	if (!Ruby_Profiler_Cache_reserve(cache)) {
+		return;
+	}
+	
+	struct Ruby_Profiler_Cache_Entry *entry = Ruby_Profiler_Cache_find(cache->entries, cache->capacity, cache->generation, fiber);
+	
+	if (entry->generation != cache->generation) {
+		entry->fiber = fiber;
+		entry->generation = cache->generation;
+		cache->count++;
+	}
+	
+	entry->data = data;
+}
+
+// Invalidate every cache at the start of garbage collection, since fibers and their data may be freed or moved:
+static void Ruby_Profiler_Cache_invalidate(VALUE tracepoint, void *data) {
+	Ruby_Profiler_Cache_clear();
+}
+
+void Ruby_Profiler_Cache_enable(void) {
+	if (ruby_profiler_cache_enabled) return;
+	
+	// Entries stored before the tracepoint was disabled may refer to fibers freed since, but were invalidated by `Ruby_Profiler_Cache_disable`:
+	rb_tracepoint_enable(ruby_profiler_cache_tracepoint);
+	ruby_profiler_cache_enabled = 1;
+}
+
+void Ruby_Profiler_Cache_disable(void) {
+	if (!ruby_profiler_cache_enabled) return;
+	
+	rb_tracepoint_disable(ruby_profiler_cache_tracepoint);
+	ruby_profiler_cache_enabled = 0;
+	
+	// Invalidate every entry, since they won't be invalidated by garbage collection until the tracepoint is enabled again:
+	Ruby_Profiler_Cache_clear();
+}
+
+void Init_Ruby_Profiler_Cache(void) {
+	rb_global_variable(&ruby_profiler_cache_tracepoint);
+	
+	// The tracepoint is enabled along with the fiber switch hook (see `Ruby_Profiler_activate`):
+	ruby_profiler_cache_tracepoint = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_START, Ruby_Profiler_Cache_invalidate, NULL);
+}
@@ -0,0 +1,94 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+#include <stdatomic.h>
+
+#include "state.h"
+
+// A per-thread cache of the profiler data of each fiber (see fiber.h), keyed by the fiber's address, so that fiber switches and applying states don't need to look up the fiber's instance variable (which, for a Fiber, is a lookup in a global table). The cache holds weak references: every entry is invalidated at the start of each garbage collection (which is the only time a fiber or its data can be freed or moved), by incrementing a global epoch, so a fiber or data seen in the cache is always alive and at the same address. Entries are then refilled as fibers are switched to. Entries are tagged with the cache's generation, which is incremented whenever the cache is invalidated, so invalidation doesn't need to touch the entries. The garbage collection hook is only installed while the profiler is active (see `Ruby_Profiler_activate`), and nothing is stored in the caches otherwise.
+//
+// Like `ruby_profiler_state`, the cache belongs to the native thread, which runs all the fibers of one Ruby thread.
+
+// Initial number of entries in each thread's cache (must be a power of 2):
+#define RUBY_PROFILER_CACHE_INITIAL_CAPACITY 64
+
+// Maximum number of entries in each thread's cache, beyond which the cache is cleared rather than grown:
+#define RUBY_PROFILER_CACHE_MAXIMUM_CAPACITY (64 * 1024)
+
+struct Ruby_Profiler_Cache_Entry {
+	VALUE fiber;
+	
+	// The profiler data of the fiber, or the state it inherited if it has none (Qnil for neither):
+	VALUE data;
+	
+	// The generation in which the entry was stored (entries from other generations are empty):
+	uint64_t generation;
+};
+
+struct Ruby_Profiler_Cache {
+	// The global epoch when the cache was last used:
+	uint64_t epoch;
+	
+	// The current generation, which is never 0 once the cache is used:
+	uint64_t generation;
+	
+	// Number of entries stored in this generation:
+	size_t count;
+	
+	size_t capacity;
+	struct Ruby_Profiler_Cache_Entry *entries;
+};
+
+extern _Atomic uint64_t ruby_profiler_cache_epoch;
+extern _Thread_local struct Ruby_Profiler_Cache ruby_profiler_cache;
+
+// Look up the profiler data of a fiber, returning Qundef if the fiber is not in the cache.
+static inline VALUE Ruby_Profiler_Cache_lookup(VALUE fiber) {
+	struct Ruby_Profiler_Cache *cache = &ruby_profiler_cache;
+	uint64_t epoch = atomic_load_explicit(&ruby_profiler_cache_epoch, memory_order_relaxed);
+	
+	// The cache may not have been allocated:
+	if (cache->epoch != epoch || cache->capacity == 0) {
+		return Qundef;
+	}
+	
+	size_t mask = cache->capacity - 1;
+	
+	// Object addresses are aligned, so mix the bits before masking, the same way as state keys:
+	for (size_t i = Ruby_Profiler_State_hash((ID)fiber) & mask;; i = (i + 1) & mask) {
+		struct Ruby_Profiler_Cache_Entry *entry = &cache->entries[i];
+		
+		if (entry->generation != cache->generation) {
+			return Qundef;
+		}
+		
+		if (entry->fiber == fiber) {
+			return entry->data;
+		}
+	}
+}
+
+// Store the profiler data of a fiber, or the state it inherited (Qnil for neither). The fiber must belong to the current thread.
+void Ruby_Profiler_Cache_store(VALUE fiber, VALUE data);
+
+// Invalidate the caches of all threads (e.g. when profiler data is added to a fiber which may belong to another thread).
+static inline void Ruby_Profiler_Cache_clear(void) {
+	atomic_fetch_add_explicit(&ruby_profiler_cache_epoch, 1, memory_order_relaxed);
+}
+
+// Invalidate the current thread's cache.
+static inline void Ruby_Profiler_Cache_reset(void) {
+	ruby_profiler_cache.generation++;
+	ruby_profiler_cache.count = 0;
+}
+
+// Start using the caches, installing the garbage collection hook which invalidates them.
+void Ruby_Profiler_Cache_enable(void);
+
+// Stop using the caches, removing the garbage collection hook.
+void Ruby_Profiler_Cache_disable(void);
+
+void Init_Ruby_Profiler_Cache(void);
@@ -0,0 +1,345 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "fiber.h"
+#include "state.h"
+#include "cache.h"
+
+// Not prefixed with "@", so that it's hidden from Ruby code:
+static ID id_ruby_profiler_fiber;
+
+// Whether fibers and threads inherit the state of the fiber which created them:
+static int ruby_profiler_fiber_inherit = 1;
+
+_Thread_local VALUE ruby_profiler_fiber_source = Qnil;
+
+// The key of the applied state in inheritable fiber storage:
+static VALUE ruby_profiler_fiber_storage_key = Qnil;
+
+static VALUE ruby_profiler_fiber_class = Qnil;
+static ID id_aref, id_aset;
+
+// Fiber storage isn't exposed to C extensions, so use `Fiber[]` and `Fiber[]=`:
+static VALUE Ruby_Profiler_Fiber_storage_get(VALUE key) {
+	return rb_funcall(ruby_profiler_fiber_class, id_aref, 1, key);
+}
+
+static VALUE Ruby_Profiler_Fiber_storage_set(VALUE key, VALUE value) {
+	return rb_funcall(ruby_profiler_fiber_class, id_aset, 2, key, value);
+}
+
+static VALUE Ruby_Profiler_Fiber_current(void) {
+#ifdef HAVE_RB_FIBER_CURRENT
+	return rb_fiber_current();
+#else
+	return rb_funcall(rb_cFiber, rb_intern("current"), 0);
+#endif
+}
+
+static void Ruby_Profiler_Fiber_mark(void *data) {
+	struct Ruby_Profiler_Fiber *profiler_fiber = (struct Ruby_Profiler_Fiber*)data;
+	
+	rb_gc_mark(profiler_fiber->self);
+	rb_gc_mark_movable(profiler_fiber->state);
+	rb_gc_mark_movable(profiler_fiber->inherited);
+	
+	for (size_t i = 0; i < RUBY_PROFILER_STACK_CAPACITY; i++) {
+		rb_gc_mark_movable(profiler_fiber->enclosing[i]);
+	}
+}
+
+static void Ruby_Profiler_Fiber_compact(void *data) {
+	struct Ruby_Profiler_Fiber *profiler_fiber = (struct Ruby_Profiler_Fiber*)data;
+	
+	// Only the objects may move, not the tables of states (see `Ruby_Profiler_State_mark`):
+	profiler_fiber->state = rb_gc_location(profiler_fiber->state);
+	profiler_fiber->inherited = rb_gc_location(profiler_fiber->inherited);
+	
+	for (size_t i = 0; i < RUBY_PROFILER_STACK_CAPACITY; i++) {
+		profiler_fiber->enclosing[i] = rb_gc_location(profiler_fiber->enclosing[i]);
+	}
+}
+
+static void Ruby_Profiler_Fiber_free(void *data) {
+	struct Ruby_Profiler_Fiber *profiler_fiber = (struct Ruby_Profiler_Fiber*)data;
+	
+	// Stop publishing the stack before it's freed:
+	if (ruby_profiler_stack == &profiler_fiber->stack) {
+		Ruby_Profiler_State_publish(ruby_profiler_state, NULL, 0);
+	}
+	
+	if (ruby_profiler_fiber_source == profiler_fiber->self) {
+		ruby_profiler_fiber_source = Qnil;
+	}
+	
+	xfree(profiler_fiber);
+}
+
+static size_t Ruby_Profiler_Fiber_memsize(const void *data) {
+	return sizeof(struct Ruby_Profiler_Fiber);
+}
+
+static const rb_data_type_t Ruby_Profiler_Fiber_Type = {
+	.wrap_struct_name = "Ruby::Profiler::Fiber",
+	.function = {
+		.dmark = Ruby_Profiler_Fiber_mark,
+		.dcompact = Ruby_Profiler_Fiber_compact,
+		.dfree = Ruby_Profiler_Fiber_free,
+		.dsize = Ruby_Profiler_Fiber_memsize,
+	},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+// Find the profiler data of any fiber (Qnil for none), without using the cache:
+static VALUE Ruby_Profiler_Fiber_find(VALUE fiber) {
+	VALUE data = rb_ivar_get(fiber, id_ruby_profiler_fiber);
+	
+	if (!RB_NIL_P(data) && !rb_typeddata_is_kind_of(data, &Ruby_Profiler_Fiber_Type)) {
+		return Qnil;
+	}
+	
+	return data;
+}
+
+static VALUE Ruby_Profiler_Fiber_create(VALUE fiber) {
+	struct Ruby_Profiler_Fiber *profiler_fiber;
+	
+	// A hidden object (with no class), since it's only used internally:
+	VALUE data = TypedData_Make_Struct(0, struct Ruby_Profiler_Fiber, &Ruby_Profiler_Fiber_Type, profiler_fiber);
+	
+	profiler_fiber->self = data;
+	profiler_fiber->state = Qnil;
+	
+	// The storage is copied from the fiber which created this one, so what it holds isn't known until the first write:
+	profiler_fiber->inherited = Qundef;
+	
+	for (size_t i = 0; i < RUBY_PROFILER_STACK_CAPACITY; i++) {
+		profiler_fiber->enclosing[i] = Qnil;
+	}
+	
+	rb_ivar_set(fiber, id_ruby_profiler_fiber, data);
+	
+	return data;
+}
+
+// Get the state the current fiber inherited from the fiber (or thread) which created it, if any (Qnil otherwise):
+static VALUE Ruby_Profiler_Fiber_inherited(void) {
+	if (!ruby_profiler_fiber_inherit) return Qnil;
+	
+	VALUE state = Ruby_Profiler_Fiber_storage_get(ruby_profiler_fiber_storage_key);
+	
+	if (RB_NIL_P(state) || !rb_typeddata_is_kind_of(state, &Ruby_Profiler_State_Type)) {
+		return Qnil;
+	}
+	
+	// The fiber publishes the state directly (see `ruby_profiler_fiber_source`), so only states which are actually adopted are pinned:
+	Ruby_Profiler_State_pin(state);
+	
+	return state;
+}
+
+// Get the profiler data of the current fiber, or the state it inherited if it has none (Qnil for neither):
+static VALUE Ruby_Profiler_Fiber_lookup(VALUE fiber) {
+	// This is called on every fiber switch, so avoid looking up the instance variable if possible:
+	VALUE data = Ruby_Profiler_Cache_lookup(fiber);
+	
+	if (data == Qundef) {
+		data = Ruby_Profiler_Fiber_find(fiber);
+		
+		// Creating profiler data for every new fiber would make creating fibers noticeably slower, so an inherited state is cached directly until the fiber applies a state of its own:
+		if (RB_NIL_P(data)) {
+			data = Ruby_Profiler_Fiber_inherited();
+		}
+		
+		Ruby_Profiler_Cache_store(fiber, data);
+	}
+	
+	return data;
+}
+
+static inline int Ruby_Profiler_Fiber_data_p(VALUE data) {
+	return RTYPEDDATA_TYPE(data) == &Ruby_Profiler_Fiber_Type;
+}
+
+struct Ruby_Profiler_Fiber *Ruby_Profiler_Fiber_acquire(VALUE fiber) {
+	VALUE data = Ruby_Profiler_Fiber_lookup(fiber);
+	
+	if (!RB_NIL_P(data) && Ruby_Profiler_Fiber_data_p(data)) {
+		return RTYPEDDATA_DATA(data);
+	}
+	
+	VALUE inherited = data;
+	
+	data = Ruby_Profiler_Fiber_create(fiber);
+	Ruby_Profiler_Cache_store(fiber, data);
+	
+	struct Ruby_Profiler_Fiber *profiler_fiber = RTYPEDDATA_DATA(data);
+	Ruby_Profiler_Fiber_write(profiler_fiber, inherited);
+	
+	return profiler_fiber;
+}
+
+VALUE Ruby_Profiler_Fiber_state(VALUE fiber) {
+	VALUE data = Ruby_Profiler_Fiber_lookup(fiber);
+	
+	if (!RB_NIL_P(data) && Ruby_Profiler_Fiber_data_p(data)) {
+		return ((struct Ruby_Profiler_Fiber*)RTYPEDDATA_DATA(data))->state;
+	}
+	
+	return data;
+}
+
+void Ruby_Profiler_Fiber_write(struct Ruby_Profiler_Fiber *profiler_fiber, VALUE state) {
+	// The table of the state is published whenever the fiber runs, so it must not move:
+	if (!RB_NIL_P(state)) Ruby_Profiler_State_pin(state);
+	
+	RB_OBJ_WRITE(profiler_fiber->self, &profiler_fiber->state, state);
+}
+
+void Ruby_Profiler_Fiber_inherit(struct Ruby_Profiler_Fiber *profiler_fiber, VALUE state) {
+	if (!ruby_profiler_fiber_inherit) return;
+	
+	// Writing fiber storage is a method call, so skip it when the state is reapplied:
+	if (profiler_fiber->inherited == state) return;
+	
+	// Fiber storage is copied to new fibers and threads, and the state is shared by reference:
+	Ruby_Profiler_Fiber_storage_set(ruby_profiler_fiber_storage_key, state);
+	RB_OBJ_WRITE(profiler_fiber->self, &profiler_fiber->inherited, state);
+}
+
+void Ruby_Profiler_Fiber_push(struct Ruby_Profiler_Fiber *profiler_fiber, uint64_t depth) {
+	// Deeper states are not recorded, but are still counted by the depth:
+	if (depth >= RUBY_PROFILER_STACK_CAPACITY) return;
+	
+	VALUE state = profiler_fiber->state;
+	
+	RB_OBJ_WRITE(profiler_fiber->self, &profiler_fiber->enclosing[depth], state);
+	profiler_fiber->stack.states[depth] = RB_NIL_P(state) ? NULL : Ruby_Profiler_State_get(state);
+}
+
+void Ruby_Profiler_Fiber_pop(struct Ruby_Profiler_Fiber *profiler_fiber, uint64_t depth) {
+	if (depth >= RUBY_PROFILER_STACK_CAPACITY) return;
+	
+	profiler_fiber->enclosing[depth] = Qnil;
+	profiler_fiber->stack.states[depth] = NULL;
+}
+
+struct Ruby_Profiler_State *Ruby_Profiler_Fiber_publish(VALUE fiber) {
+	return Ruby_Profiler_Fiber_publish_source(Ruby_Profiler_Fiber_lookup(fiber));
+}
+
+struct Ruby_Profiler_State *Ruby_Profiler_Fiber_publish_source(VALUE data) {
+	ruby_profiler_fiber_source = data;
+	
+	if (RB_NIL_P(data)) {
+		Ruby_Profiler_State_publish(NULL, NULL, 0);
+		Ruby_Profiler_State_charge(Qnil);
+		
+		return NULL;
+	}
+	
+	// An inherited state has no enclosing states:
+	if (!Ruby_Profiler_Fiber_data_p(data)) {
+		struct Ruby_Profiler_State *state = Ruby_Profiler_State_get(data);
+		Ruby_Profiler_State_publish(state, NULL, 0);
+		Ruby_Profiler_State_charge(data);
+		
+		return state;
+	}
+	
+	struct Ruby_Profiler_Fiber *profiler_fiber = RTYPEDDATA_DATA(data);
+	struct Ruby_Profiler_Stack *stack = &profiler_fiber->stack;
+	struct Ruby_Profiler_State *state = RB_NIL_P(profiler_fiber->state) ? NULL : Ruby_Profiler_State_get(profiler_fiber->state);
+	
+	// The tables of enclosing states may have been grown (see `State#update!`) while the fiber wasn't running:
+	for (uint64_t i = 0; i < stack->depth && i < RUBY_PROFILER_STACK_CAPACITY; i++) {
+		VALUE enclosing = profiler_fiber->enclosing[i];
+		
+		stack->states[i] = RB_NIL_P(enclosing) ? NULL : Ruby_Profiler_State_get(enclosing);
+	}
+	
+	Ruby_Profiler_State_publish(state, stack, stack->depth);
+	Ruby_Profiler_State_charge(profiler_fiber->state);
+	
+	return state;
+}
+
+// Fiber#ruby_profiler_state
+static VALUE Ruby_Profiler_Fiber_get_state_method(VALUE fiber) {
+	// Only the current fiber's inherited state can be read:
+	if (fiber == Ruby_Profiler_Fiber_current()) {
+		return Ruby_Profiler_Fiber_state(fiber);
+	}
+	
+	VALUE data = Ruby_Profiler_Fiber_find(fiber);
+	
+	if (RB_NIL_P(data)) {
+		return Qnil;
+	}
+	
+	return ((struct Ruby_Profiler_Fiber*)RTYPEDDATA_DATA(data))->state;
+}
+
+// Fiber#ruby_profiler_state=. This only stores the state; it is published when the fiber is next switched to.
+static VALUE Ruby_Profiler_Fiber_set_state_method(VALUE fiber, VALUE state) {
+	// Raises a TypeError unless the state is a State:
+	if (!RB_NIL_P(state)) Ruby_Profiler_State_get(state);
+	
+	if (fiber == Ruby_Profiler_Fiber_current()) {
+		if (RB_NIL_P(state) && RB_NIL_P(Ruby_Profiler_Fiber_state(fiber))) return state;
+		
+		struct Ruby_Profiler_Fiber *profiler_fiber = Ruby_Profiler_Fiber_acquire(fiber);
+		Ruby_Profiler_Fiber_write(profiler_fiber, state);
+		Ruby_Profiler_Fiber_inherit(profiler_fiber, state);
+		
+		return state;
+	}
+	
+	// The fiber may belong to another thread, so we can't use the cache of the current thread:
+	VALUE data = Ruby_Profiler_Fiber_find(fiber);
+	
+	if (RB_NIL_P(data)) {
+		if (RB_NIL_P(state)) return state;
+		
+		data = Ruby_Profiler_Fiber_create(fiber);
+		
+		// The caches of other threads may record that the fiber has no profiler data:
+		Ruby_Profiler_Cache_clear();
+	}
+	
+	Ruby_Profiler_Fiber_write(RTYPEDDATA_DATA(data), state);
+	
+	return state;
+}
+
+// Whether new fibers and threads inherit the state of the fiber which created them.
+static VALUE Ruby_Profiler_Fiber_s_inherit_p(VALUE klass) {
+	return ruby_profiler_fiber_inherit ? Qtrue : Qfalse;
+}
+
+// Enable or disable inheritance of states by new fibers and threads. This should be set before any states are applied, since fibers which haven't applied a state of their own read the state they inherited whenever they are switched to.
+static VALUE Ruby_Profiler_Fiber_s_inherit_set(VALUE klass, VALUE value) {
+	ruby_profiler_fiber_inherit = RTEST(value);
+	
+	return value;
+}
+
+void Init_Ruby_Profiler_Fiber(VALUE Ruby_Profiler_State) {
+	id_ruby_profiler_fiber = rb_intern("__ruby_profiler_fiber__");
+	
+	// A static symbol, which is never collected:
+	ruby_profiler_fiber_storage_key = ID2SYM(rb_intern("ruby_profiler_state"));
+	
+	VALUE Fiber = rb_const_get(rb_cObject, rb_intern("Fiber"));
+	
+	rb_global_variable(&ruby_profiler_fiber_class);
+	ruby_profiler_fiber_class = Fiber;
+	id_aref = rb_intern("[]");
+	id_aset = rb_intern("[]=");
+	
+	rb_define_singleton_method(Ruby_Profiler_State, "inherit?", Ruby_Profiler_Fiber_s_inherit_p, 0);
+	rb_define_singleton_method(Ruby_Profiler_State, "inherit=", Ruby_Profiler_Fiber_s_inherit_set, 1);
+	
+	rb_define_method(Fiber, "ruby_profiler_state", Ruby_Profiler_Fiber_get_state_method, 0);
+	rb_define_method(Fiber, "ruby_profiler_state=", Ruby_Profiler_Fiber_set_state_method, 1);
+}
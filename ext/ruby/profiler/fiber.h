@@ -0,0 +1,55 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+
+#include "state.h"
+
+// The profiler data of a fiber, which is created when a state is first applied to the fiber, and stored in a hidden instance variable. Setting an instance variable of a fiber is relatively expensive (fibers keep them in a global table, and adding one changes the fiber's shape), so applying a state only updates this object, which is usually found via the fiber state cache (see cache.h).
+struct Ruby_Profiler_Fiber {
+	// The object which wraps this structure (pinned, so that it can be used for write barriers):
+	VALUE self;
+	
+	// The state object applied to the fiber (Qnil for none):
+	VALUE state;
+	
+	// The state object last stored in the fiber's inheritable storage (Qundef if unknown):
+	VALUE inherited;
+	
+	// The state objects enclosing the current state, which keep the tables recorded in `stack` alive:
+	VALUE enclosing[RUBY_PROFILER_STACK_CAPACITY];
+	
+	// Published via `ruby_profiler_stack` while the fiber is running:
+	struct Ruby_Profiler_Stack stack;
+};
+
+// Get the profiler data of the current fiber, creating it if needed (with the state it inherited from the fiber which created it, if any).
+struct Ruby_Profiler_Fiber *Ruby_Profiler_Fiber_acquire(VALUE fiber);
+
+// Get the state object applied to the current fiber, or the state it inherited (Qnil for none).
+VALUE Ruby_Profiler_Fiber_state(VALUE fiber);
+
+// Set the state object applied to a fiber (Qnil for none), without publishing it. The state is pinned, since it's published whenever the fiber runs.
+void Ruby_Profiler_Fiber_write(struct Ruby_Profiler_Fiber *profiler_fiber, VALUE state);
+
+// Make the state applied to the current fiber (Qnil for none) the state inherited by fibers and threads it creates, by storing it in the fiber's inheritable storage (unless disabled by `State.inherit = false`, or already stored).
+void Ruby_Profiler_Fiber_inherit(struct Ruby_Profiler_Fiber *profiler_fiber, VALUE state);
+
+// Record the current state of a fiber as the enclosing state at the given depth (which must be the depth of its stack). It is not visible to readers until the depth is increased by publishing the next state.
+void Ruby_Profiler_Fiber_push(struct Ruby_Profiler_Fiber *profiler_fiber, uint64_t depth);
+
+// Release the enclosing state at the given depth, after the depth has been decreased by publishing the previous state.
+void Ruby_Profiler_Fiber_pop(struct Ruby_Profiler_Fiber *profiler_fiber, uint64_t depth);
+
+// The profiler data of the fiber whose states are published by the current thread, or the state it inherited (Qnil for none). Both are pinned, so the thread event hooks can save it while the thread doesn't hold the GVL (see thread.h).
+extern _Thread_local VALUE ruby_profiler_fiber_source;
+
+// Publish the state of the current fiber, and the states enclosing it, returning the state (NULL for none).
+struct Ruby_Profiler_State *Ruby_Profiler_Fiber_publish(VALUE fiber);
+
+// Publish the states of a fiber's profiler data, or the state it inherited (Qnil for neither), as found when its states were last published. The tables are looked up again, since states may have been grown or replaced in the meantime.
+struct Ruby_Profiler_State *Ruby_Profiler_Fiber_publish_source(VALUE source);
+
+void Init_Ruby_Profiler_Fiber(VALUE Ruby_Profiler_State);
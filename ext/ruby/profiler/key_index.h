@@ -0,0 +1,60 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+
+// The key index is a packed copy of the keys of a state, in slot order (i.e. `keys[i] == pairs[i].key`). Probing it touches half as much memory as probing the pairs, and lets us compare a block of 8 keys with a couple of instructions. It is only worth maintaining for larger states (see RUBY_PROFILER_STATE_KEY_INDEX_THRESHOLD), so capacity is always a power of 2 and at least 8 here.
+//
+// The key index requires AVX2 (e.g. build with `RUBY_PROFILER_NATIVE=1` on a machine that supports it). SSE2 has no 64-bit compare, and emulating it costs more than linear probing the pairs directly (see `benchmark/key_lookup.c`), so otherwise no key index is maintained and lookups fall back to scalar probing.
+#if SIZEOF_VALUE == 8 && defined(__AVX2__)
+#include <immintrin.h>
+#define RUBY_PROFILER_KEY_INDEX
+
+// Compare a block of 8 keys against `key`, returning a mask with one bit per matching key.
+static inline unsigned Ruby_Profiler_Key_Index_compare_block(const ID *keys, ID key) {
+	__m256i needle = _mm256_set1_epi64x((long long)key);
+	__m256i a = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)keys), needle);
+	__m256i b = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(keys + 4)), needle);
+	
+	return _mm256_movemask_pd(_mm256_castsi256_pd(a)) | (_mm256_movemask_pd(_mm256_castsi256_pd(b)) << 4);
+}
+
+// Find the slot of a key in the key index, returning capacity if not found.
+//
+// This follows the same probe sequence as linear probing over the pairs, starting at the key's home slot (`hash & (capacity - 1)`), but compares a whole block of 8 keys at a time.
+static inline size_t Ruby_Profiler_Key_Index_find(const ID *keys, size_t capacity, size_t hash, ID key) {
+	size_t mask = capacity - 1;
+	size_t home = hash & mask;
+	size_t offset = home & 7;
+	size_t block = home - offset;
+	
+	// Visit every block once, plus the home block again to cover the slots before the home slot:
+	size_t blocks = capacity / 8;
+	
+	for (size_t i = 0; i <= blocks; i++) {
+		// Ignore slots before the home slot in the first block, and slots after it when we wrap around to it again:
+		unsigned window = 0xFF;
+		if (i == 0) window &= ~0U << offset;
+		if (i == blocks) window &= (1U << offset) - 1;
+		
+		unsigned match = Ruby_Profiler_Key_Index_compare_block(keys + block, key) & window;
+		
+		// If the key is present there is no empty slot between its home slot and its actual slot, so a match is always the answer:
+		if (match) {
+			return block + __builtin_ctz(match);
+		}
+		
+		// Otherwise, an empty slot ends the probe sequence:
+		if (Ruby_Profiler_Key_Index_compare_block(keys + block, 0) & window) {
+			return capacity;
+		}
+		
+		block = (block + 8) & mask;
+	}
+	
+	return capacity;
+}
+
+#endif
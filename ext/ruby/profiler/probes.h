@@ -0,0 +1,14 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+// USDT probes (provider `ruby_profiler`), which give tracers a stable attachment point for state transitions. Each probe receives the state pointer (NULL for no state), the number of pairs in its table, and the fiber (nil if not applicable). When no tracer is attached, a probe costs a single NOP. They are only available if `sys/sdt.h` is present at build time (e.g. from systemtap-sdt-dev).
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define RUBY_PROFILER_PROBE(name, state, fiber) \
+	DTRACE_PROBE3(ruby_profiler, name, (state), (state) ? (state)->size : 0, (fiber))
+#else
+#define RUBY_PROFILER_PROBE(name, state, fiber) ((void)0)
+#endif
@@ -3,6 +3,13 @@
 
 #include "profiler.h"
 #include "state.h"
+#include "probes.h"
+#include "timeline.h"
+#include "thread.h"
+#include "fiber.h"
+#include "sampler.h"
+#include "cache.h"
+#include "registry.h"
 
 #include <ruby/debug.h>
 
@@ -18,14 +25,85 @@ static VALUE Ruby_Profiler_Fiber_current(void) {
 }
 #endif
 
-// Fiber switch callback - updates thread-local pointer based on fiber-local storage
+// Fiber switch callback - updates thread-local pointer based on fiber-local storage (also called when a thread begins, since its first fiber may have inherited a state)
 static void Ruby_Profiler_fiber_switch_callback(rb_event_flag_t event_flag, VALUE data, VALUE self, ID id, VALUE klass) {
 	VALUE fiber = Ruby_Profiler_Fiber_current();
 	
-	struct Ruby_Profiler_State *state = Ruby_Profiler_State_for(fiber);
+	// Update the thread-local pointers:
+	struct Ruby_Profiler_State *state = Ruby_Profiler_Fiber_publish(fiber);
 	
-	// Update thread-local pointer
-	ruby_profiler_state = state;
+	RUBY_PROFILER_PROBE(switch, state, fiber);
+	Ruby_Profiler_Timeline_record(fiber, state);
+}
+
+// Whether the fiber switch hook is installed:
+static int ruby_profiler_enabled = 0;
+
+// Whether the profiler was disabled by `Ruby::Profiler.disable!`, in which case the hook is not installed by `State#apply!`:
+static int ruby_profiler_disabled = 0;
+
+static void Ruby_Profiler_install(void) {
+	if (ruby_profiler_enabled) return;
+	
+	// This updates the thread-local pointer whenever a fiber switch occurs:
+	rb_add_event_hook(
+		Ruby_Profiler_fiber_switch_callback,
+		RUBY_EVENT_FIBER_SWITCH | RUBY_EVENT_THREAD_BEGIN,
+		Qnil  // No data needed, callback is stateless.
+	);
+	
+	// Threads may also start running on a native thread without a fiber switch:
+	Ruby_Profiler_Thread_install();
+	
+	// Fiber switches look up the state of each fiber in a cache, which is invalidated by garbage collection:
+	Ruby_Profiler_Cache_enable();
+	
+	ruby_profiler_enabled = 1;
+}
+
+int Ruby_Profiler_activate(void) {
+	if (ruby_profiler_disabled) return 0;
+	
+	Ruby_Profiler_install();
+	
+	return 1;
+}
+
+// Install the fiber switch hook (if it isn't already), and publish the state of the current fiber.
+static VALUE Ruby_Profiler_enable(VALUE module) {
+	ruby_profiler_disabled = 0;
+	Ruby_Profiler_install();
+	
+	Ruby_Profiler_Fiber_publish(Ruby_Profiler_Fiber_current());
+	
+	return Qtrue;
+}
+
+// Remove the fiber switch hook, and stop publishing states until `enable!` is called, so that there is no per-switch cost.
+static VALUE Ruby_Profiler_disable(VALUE module) {
+	ruby_profiler_disabled = 1;
+	
+	if (ruby_profiler_enabled) {
+		rb_remove_event_hook(Ruby_Profiler_fiber_switch_callback);
+		Ruby_Profiler_Thread_remove();
+		Ruby_Profiler_Cache_disable();
+		ruby_profiler_enabled = 0;
+	}
+	
+	Ruby_Profiler_State_publish(NULL, NULL, 0);
+	Ruby_Profiler_State_charge_slow(NULL);
+	ruby_profiler_fiber_source = Qnil;
+	
+	// Other threads won't publish their states again until enabled, and those states may be freed in the meantime:
+	Ruby_Profiler_Registry_clear();
+	Ruby_Profiler_Sampler_synchronize();
+	
+	return Qfalse;
+}
+
+// Whether the fiber switch hook is installed.
+static VALUE Ruby_Profiler_enabled_p(VALUE module) {
+	return ruby_profiler_enabled ? Qtrue : Qfalse;
 }
 
 void Init_Ruby_Profiler(void)
@@ -49,18 +127,13 @@ void Init_Ruby_Profiler(void)
 	VALUE Ruby_Profiler = rb_define_module_under(Ruby, "Profiler");
 	
 	Init_Ruby_Profiler_State(Ruby_Profiler);
+	Init_Ruby_Profiler_Timeline(Ruby_Profiler);
+	Init_Ruby_Profiler_Sampler(Ruby_Profiler);
 	
-	// Register fiber switch event hook automatically:
-	// This updates the thread-local pointer whenever a fiber switch occurs.
-	rb_add_event_hook(
-		Ruby_Profiler_fiber_switch_callback,
-		RUBY_EVENT_FIBER_SWITCH,
-		Qnil  // No data needed, callback is stateless.
-	);
+	rb_define_singleton_method(Ruby_Profiler, "enable!", Ruby_Profiler_enable, 0);
+	rb_define_singleton_method(Ruby_Profiler, "disable!", Ruby_Profiler_disable, 0);
+	rb_define_singleton_method(Ruby_Profiler, "enabled?", Ruby_Profiler_enabled_p, 0);
 	
-	// Also update state immediately for current fiber:
-	VALUE fiber = Ruby_Profiler_Fiber_current();
-	struct Ruby_Profiler_State *state = Ruby_Profiler_State_for(fiber);
-	ruby_profiler_state = state;
+	// The fiber switch hook is installed by the first `State#apply!` (see Ruby_Profiler_activate), so that fiber switches cost nothing until a state is used.
 }
 
@@ -5,4 +5,7 @@
 
 #include <ruby.h>
 
+// Install the fiber switch hook if it isn't already installed, returning 0 if the profiler has been disabled (in which case states must not be published).
+int Ruby_Profiler_activate(void);
+
 void Init_Ruby_Profiler(void);
@@ -0,0 +1,142 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#define _GNU_SOURCE
+
+#include "reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Prints the state of every thread of a process as JSON lines, e.g.:
+//
+//   ruby-profiler-reader [-i interval] [-n count] pid
+//   {"pid":1234,"tid":1235,"state":"0x...","pairs":{"request_id":"abc"}}
+
+struct Ruby_Profiler_Reader_Output {
+	pid_t pid;
+};
+
+static void print_string(const char *string, size_t length) {
+	putchar('"');
+	
+	for (size_t i = 0; i < length; i++) {
+		unsigned char c = (unsigned char)string[i];
+		
+		if (c == '"' || c == '\\') {
+			printf("\\%c", c);
+		} else if (c < 0x20) {
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
+	}
+	
+	putchar('"');
+}
+
+static void print_value(const struct Ruby_Profiler_Reader_Pair *pair) {
+	// See `enum Ruby_Profiler_Snapshot_Type`:
+	switch (pair->snapshot_type & 0x7F) {
+		case 1: // String
+		case 3: // Symbol
+			print_string((const char*)pair->snapshot_data, pair->snapshot_length);
+			return;
+		case 2: { // Integer
+			int64_t value;
+			memcpy(&value, pair->snapshot_data, sizeof(value));
+			printf("%lld", (long long)value);
+			return;
+		}
+	}
+	
+	// Fixnums can be decoded without a snapshot:
+	if (pair->value & 1) {
+		printf("%lld", (long long)((int64_t)pair->value >> 1));
+	} else {
+		printf("{\"value\":\"0x%llx\"}", (unsigned long long)pair->value);
+	}
+}
+
+static void print_sample(const struct Ruby_Profiler_Reader_Sample *sample, void *data) {
+	struct Ruby_Profiler_Reader_Output *output = data;
+	
+	printf("{\"pid\":%d,\"tid\":%llu,\"state\":\"0x%llx\",\"pairs\":{", (int)output->pid, (unsigned long long)sample->tid, (unsigned long long)sample->state);
+	
+	for (size_t i = 0; i < sample->count; i++) {
+		const struct Ruby_Profiler_Reader_Pair *pair = &sample->pairs[i];
+		char id[32];
+		
+		if (i > 0) putchar(',');
+		
+		if (pair->key) {
+			print_string(pair->key, strlen(pair->key));
+		} else {
+			snprintf(id, sizeof(id), "0x%llx", (unsigned long long)pair->id);
+			print_string(id, strlen(id));
+		}
+		
+		putchar(':');
+		print_value(pair);
+	}
+	
+	printf("}}\n");
+}
+
+int main(int argc, char **argv) {
+	double interval = 1.0;
+	long count = 1;
+	int option;
+	
+	while ((option = getopt(argc, argv, "i:n:")) != -1) {
+		switch (option) {
+			case 'i':
+				interval = atof(optarg);
+				break;
+			case 'n':
+				count = atol(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-i interval] [-n count] pid\n", argv[0]);
+				return 2;
+		}
+	}
+	
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-i interval] [-n count] pid\n", argv[0]);
+		return 2;
+	}
+	
+	struct Ruby_Profiler_Reader_Output output = {.pid = (pid_t)atoi(argv[optind])};
+	struct Ruby_Profiler_Reader *reader;
+	
+	int result = Ruby_Profiler_Reader_open(&reader, output.pid);
+	if (result < 0) {
+		fprintf(stderr, "%s: could not attach to %d: %s\n", argv[0], (int)output.pid, strerror(-result));
+		return 1;
+	}
+	
+	// A count of 0 samples until interrupted:
+	for (long i = 0; count == 0 || i < count; i++) {
+		if (i > 0) {
+			struct timespec delay = {(time_t)interval, (long)((interval - (time_t)interval) * 1e9)};
+			nanosleep(&delay, NULL);
+		}
+		
+		result = Ruby_Profiler_Reader_sample(reader, print_sample, &output);
+		
+		if (result < 0) {
+			fprintf(stderr, "%s: could not read %d: %s\n", argv[0], (int)output.pid, strerror(-result));
+			break;
+		}
+		
+		fflush(stdout);
+	}
+	
+	Ruby_Profiler_Reader_close(reader);
+	
+	return result < 0 ? 1 : 0;
+}
@@ -0,0 +1,783 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#define _GNU_SOURCE
+
+#include "reader.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// These layouts mirror the public interfaces in state.h, symbols.h and registry.h, using fixed width types, since the reader doesn't depend on Ruby's headers:
+#define RUBY_PROFILER_ABI_VERSION 1
+#define RUBY_PROFILER_STATE_MAGIC 0x54535052
+#define RUBY_PROFILER_SYMBOLS_MAGIC 0x59535052
+#define RUBY_PROFILER_REGISTRY_MAGIC 0x47525052
+
+#define RUBY_PROFILER_STATE_FLAG_KEY_INDEX (1 << 1)
+#define RUBY_PROFILER_STATE_FLAG_PARENT (1 << 2)
+#define RUBY_PROFILER_STATE_FLAG_SNAPSHOT (1 << 3)
+#define RUBY_PROFILER_STATE_FLAG_FINGERPRINT (1 << 4)
+
+#define RUBY_PROFILER_STATE_MAXIMUM_DEPTH 8
+
+#define RUBY_PROFILER_REGISTRY_EMPTY 0
+#define RUBY_PROFILER_REGISTRY_DELETED UINT64_MAX
+
+struct Ruby_Profiler_Reader_State_Header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t flags;
+	uint32_t generation;
+	uint64_t size;
+	uint64_t capacity;
+	
+	// Since version 2:
+	uint64_t parent;
+	uint64_t depth;
+};
+
+struct Ruby_Profiler_Reader_Symbols_Header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count;
+	uint64_t size;
+	uint64_t capacity;
+	uint64_t dropped;
+};
+
+struct Ruby_Profiler_Reader_Registry_Entry {
+	uint64_t tid;
+	uint64_t sequence;
+	uint64_t state;
+};
+
+struct Ruby_Profiler_Reader_Registry_Header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;
+	uint64_t dropped;
+};
+
+#define RUBY_PROFILER_READER_PAIR_SIZE 16
+#define RUBY_PROFILER_READER_SNAPSHOT_SIZE 64
+
+// A table being read from the target process:
+struct Ruby_Profiler_Reader_Table {
+	uint64_t address;
+	
+	// The contents of the table, of which `length` bytes have been read so far:
+	uint8_t *buffer;
+	size_t length;
+	
+	// The generation when the table was first read, and when it was checked at the end:
+	uint32_t generation;
+	uint32_t final_generation;
+};
+
+struct Ruby_Profiler_Reader_Thread {
+	uint64_t tid;
+	uint64_t sequence;
+	uint64_t final_sequence;
+	
+	// Index of the thread's registry entry:
+	size_t index;
+	
+	// The published table, followed by its ancestors:
+	struct Ruby_Profiler_Reader_Table tables[RUBY_PROFILER_STATE_MAXIMUM_DEPTH + 1];
+	size_t depth;
+	
+	int failed;
+};
+
+struct Ruby_Profiler_Reader_Symbol {
+	uint64_t id;
+	char *name;
+};
+
+struct Ruby_Profiler_Reader {
+	pid_t pid;
+	size_t page_size;
+	
+	uint64_t registry_address;
+	uint64_t symbols_address;
+	
+	// Local copy of the registry:
+	uint8_t *registry;
+	size_t registry_size;
+	uint64_t registry_capacity;
+	
+	// Symbol table, as an open addressed hash table of IDs:
+	struct Ruby_Profiler_Reader_Symbol *symbols;
+	size_t symbols_capacity;
+	size_t symbols_count;
+	
+	// Number of entries (and bytes of entries) in the target's symbol table which have been read:
+	uint64_t symbols_entries;
+	uint64_t symbols_read;
+	
+	size_t calls;
+};
+
+static uint64_t Ruby_Profiler_Reader_hash(uint64_t key) {
+	return (key * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+// Read a batch of regions, retrying after any region that couldn't be read. `failed[i]` is set for each region that couldn't be read completely.
+static void Ruby_Profiler_Reader_readv(struct Ruby_Profiler_Reader *reader, struct iovec *local, struct iovec *remote, size_t count, int *failed) {
+	size_t offset = 0;
+	
+	while (offset < count) {
+		size_t batch = count - offset;
+		if (batch > IOV_MAX) batch = IOV_MAX;
+		
+		reader->calls++;
+		ssize_t result = process_vm_readv(reader->pid, local + offset, batch, remote + offset, batch, 0);
+		
+		if (result < 0) {
+			// The first region is invalid:
+			failed[offset] = 1;
+			offset += 1;
+			continue;
+		}
+		
+		// Work out which regions were read completely:
+		size_t remaining = (size_t)result;
+		size_t i = offset;
+		
+		for (; i < offset + batch; i++) {
+			if (remaining >= local[i].iov_len) {
+				remaining -= local[i].iov_len;
+				failed[i] = 0;
+			} else {
+				break;
+			}
+		}
+		
+		// Reading stops at the first region that fails:
+		if (i < offset + batch) {
+			failed[i] = 1;
+			i += 1;
+		}
+		
+		offset = i;
+	}
+}
+
+static int Ruby_Profiler_Reader_read(struct Ruby_Profiler_Reader *reader, void *buffer, uint64_t address, size_t size) {
+	struct iovec local = {buffer, size};
+	struct iovec remote = {(void*)(uintptr_t)address, size};
+	int failed = 0;
+	
+	Ruby_Profiler_Reader_readv(reader, &local, &remote, 1, &failed);
+	
+	return failed ? -EFAULT : 0;
+}
+
+// Find the extension in the target's memory map, returning its load address and path:
+static int Ruby_Profiler_Reader_find_extension(pid_t pid, uint64_t *base, char *path, size_t path_size) {
+	char maps_path[64];
+	snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", (int)pid);
+	
+	FILE *maps = fopen(maps_path, "r");
+	if (!maps) return -errno;
+	
+	char line[PATH_MAX + 128];
+	int result = -ENOENT;
+	
+	while (fgets(line, sizeof(line), maps)) {
+		unsigned long start, end, offset;
+		char file[PATH_MAX] = "";
+		
+		if (sscanf(line, "%lx-%lx %*s %lx %*s %*s %4095s", &start, &end, &offset, file) < 3) continue;
+		
+		const char *name = strrchr(file, '/');
+		name = name ? name + 1 : file;
+		
+		if (offset == 0 && strncmp(name, "Ruby_Profiler", 13) == 0 && strstr(name, ".so")) {
+			*base = start;
+			snprintf(path, path_size, "%s", file);
+			result = 0;
+			break;
+		}
+	}
+	
+	fclose(maps);
+	
+	return result;
+}
+
+// Look up the addresses (relative to the load address) of the given symbols in the dynamic symbol table of an ELF file:
+static int Ruby_Profiler_Reader_find_symbols(const char *path, const char **names, uint64_t *values, size_t count) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -errno;
+	
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		int error = -errno;
+		close(fd);
+		return error;
+	}
+	
+	const uint8_t *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	
+	if (image == MAP_FAILED) return -errno;
+	
+	int result = -ENOENT;
+	const Elf64_Ehdr *header = (const Elf64_Ehdr*)image;
+	
+	if ((size_t)st.st_size < sizeof(*header) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64) {
+		result = -ENOEXEC;
+		goto done;
+	}
+	
+	// The load address corresponds to the lowest loaded virtual address:
+	uint64_t minimum_address = UINT64_MAX;
+	const Elf64_Phdr *segments = (const Elf64_Phdr*)(image + header->e_phoff);
+	
+	for (size_t i = 0; i < header->e_phnum; i++) {
+		if (segments[i].p_type == PT_LOAD && segments[i].p_vaddr < minimum_address) {
+			minimum_address = segments[i].p_vaddr & ~(uint64_t)(segments[i].p_align ? segments[i].p_align - 1 : 0);
+		}
+	}
+	
+	const Elf64_Shdr *sections = (const Elf64_Shdr*)(image + header->e_shoff);
+	size_t found = 0;
+	
+	for (size_t i = 0; i < header->e_shnum; i++) {
+		if (sections[i].sh_type != SHT_DYNSYM) continue;
+		
+		const Elf64_Sym *symbols = (const Elf64_Sym*)(image + sections[i].sh_offset);
+		const char *strings = (const char*)(image + sections[sections[i].sh_link].sh_offset);
+		size_t symbol_count = sections[i].sh_size / sizeof(Elf64_Sym);
+		
+		for (size_t j = 0; j < symbol_count; j++) {
+			for (size_t k = 0; k < count; k++) {
+				if (symbols[j].st_shndx != SHN_UNDEF && strcmp(strings + symbols[j].st_name, names[k]) == 0) {
+					values[k] = symbols[j].st_value - minimum_address;
+					found++;
+				}
+			}
+		}
+	}
+	
+	if (found == count) result = 0;
+
+done:
+	munmap((void*)image, st.st_size);
+	
+	return result;
+}
+
+int Ruby_Profiler_Reader_open(struct Ruby_Profiler_Reader **result, pid_t pid) {
+	uint64_t base = 0;
+	char path[PATH_MAX];
+	
+	int error = Ruby_Profiler_Reader_find_extension(pid, &base, path, sizeof(path));
+	if (error) return error;
+	
+	// Prefer the target's view of the file system (e.g. when it's in a container):
+	char root_path[PATH_MAX + 32];
+	snprintf(root_path, sizeof(root_path), "/proc/%d/root%s", (int)pid, path);
+	
+	const char *names[] = {"ruby_profiler_abi_version", "ruby_profiler_registry", "ruby_profiler_symbols"};
+	uint64_t values[3] = {0};
+	
+	error = Ruby_Profiler_Reader_find_symbols(root_path, names, values, 3);
+	if (error) error = Ruby_Profiler_Reader_find_symbols(path, names, values, 3);
+	if (error) return error;
+	
+	struct Ruby_Profiler_Reader *reader = calloc(1, sizeof(*reader));
+	if (!reader) return -ENOMEM;
+	
+	reader->pid = pid;
+	reader->page_size = (size_t)sysconf(_SC_PAGESIZE);
+	reader->registry_address = base + values[1];
+	
+	uint32_t abi_version;
+	struct Ruby_Profiler_Reader_Registry_Header registry;
+	
+	if (Ruby_Profiler_Reader_read(reader, &abi_version, base + values[0], sizeof(abi_version)) || Ruby_Profiler_Reader_read(reader, &reader->symbols_address, base + values[2], sizeof(reader->symbols_address)) || Ruby_Profiler_Reader_read(reader, &registry, reader->registry_address, sizeof(registry))) {
+		free(reader);
+		return -EFAULT;
+	}
+	
+	if (abi_version != RUBY_PROFILER_ABI_VERSION || registry.magic != RUBY_PROFILER_REGISTRY_MAGIC || registry.capacity == 0 || registry.capacity > (1 << 20)) {
+		free(reader);
+		return -EPROTO;
+	}
+	
+	reader->registry_capacity = registry.capacity;
+	reader->registry_size = sizeof(registry) + registry.capacity * sizeof(struct Ruby_Profiler_Reader_Registry_Entry);
+	reader->registry = malloc(reader->registry_size);
+	
+	if (!reader->registry) {
+		free(reader);
+		return -ENOMEM;
+	}
+	
+	*result = reader;
+	
+	return 0;
+}
+
+void Ruby_Profiler_Reader_close(struct Ruby_Profiler_Reader *reader) {
+	for (size_t i = 0; i < reader->symbols_capacity; i++) {
+		free(reader->symbols[i].name);
+	}
+	
+	free(reader->symbols);
+	free(reader->registry);
+	free(reader);
+}
+
+size_t Ruby_Profiler_Reader_calls(const struct Ruby_Profiler_Reader *reader) {
+	return reader->calls;
+}
+
+static const char *Ruby_Profiler_Reader_symbol(const struct Ruby_Profiler_Reader *reader, uint64_t id) {
+	if (reader->symbols_capacity == 0) return NULL;
+	
+	size_t mask = reader->symbols_capacity - 1;
+	
+	for (size_t i = Ruby_Profiler_Reader_hash(id) & mask;; i = (i + 1) & mask) {
+		if (reader->symbols[i].id == id) return reader->symbols[i].name;
+		if (reader->symbols[i].id == 0) return NULL;
+	}
+}
+
+static int Ruby_Profiler_Reader_add_symbol(struct Ruby_Profiler_Reader *reader, uint64_t id, const char *name, size_t length) {
+	// Keep the load factor at most 1/2:
+	if ((reader->symbols_count + 1) * 2 > reader->symbols_capacity) {
+		size_t capacity = reader->symbols_capacity ? reader->symbols_capacity * 2 : 256;
+		struct Ruby_Profiler_Reader_Symbol *symbols = calloc(capacity, sizeof(*symbols));
+		if (!symbols) return -ENOMEM;
+		
+		for (size_t i = 0; i < reader->symbols_capacity; i++) {
+			if (reader->symbols[i].id == 0) continue;
+			
+			size_t j = Ruby_Profiler_Reader_hash(reader->symbols[i].id) & (capacity - 1);
+			while (symbols[j].id != 0) j = (j + 1) & (capacity - 1);
+			symbols[j] = reader->symbols[i];
+		}
+		
+		free(reader->symbols);
+		reader->symbols = symbols;
+		reader->symbols_capacity = capacity;
+	}
+	
+	size_t mask = reader->symbols_capacity - 1;
+	size_t i = Ruby_Profiler_Reader_hash(id) & mask;
+	
+	while (reader->symbols[i].id != 0) {
+		if (reader->symbols[i].id == id) return 0;
+		i = (i + 1) & mask;
+	}
+	
+	reader->symbols[i].name = strndup(name, length);
+	if (!reader->symbols[i].name) return -ENOMEM;
+	
+	reader->symbols[i].id = id;
+	reader->symbols_count++;
+	
+	return 0;
+}
+
+// Read any entries added to the target's symbol table since the last sample:
+static void Ruby_Profiler_Reader_update_symbols(struct Ruby_Profiler_Reader *reader, const struct Ruby_Profiler_Reader_Symbols_Header *header) {
+	if (header->magic != RUBY_PROFILER_SYMBOLS_MAGIC || header->count <= reader->symbols_entries || header->size <= reader->symbols_read || header->size > header->capacity) return;
+	
+	size_t size = header->size - reader->symbols_read;
+	uint8_t *buffer = malloc(size);
+	if (!buffer) return;
+	
+	if (Ruby_Profiler_Reader_read(reader, buffer, reader->symbols_address + sizeof(*header) + reader->symbols_read, size) == 0) {
+		size_t offset = 0;
+		
+		// Each entry is {uint64_t id, uint32_t length, uint32_t reserved, char name[length + 1]}, padded to 8 bytes. Only `count` entries are complete, as `size` is updated first:
+		while (reader->symbols_entries < header->count && offset + 16 <= size) {
+			uint64_t id;
+			uint32_t length;
+			memcpy(&id, buffer + offset, sizeof(id));
+			memcpy(&length, buffer + offset + 8, sizeof(length));
+			
+			size_t entry_size = (16 + (size_t)length + 1 + 7) & ~(size_t)7;
+			if (offset + entry_size > size) break;
+			
+			Ruby_Profiler_Reader_add_symbol(reader, id, (const char*)buffer + offset + 16, length);
+			reader->symbols_entries++;
+			offset += entry_size;
+		}
+		
+		reader->symbols_read += offset;
+	}
+	
+	free(buffer);
+}
+
+static size_t Ruby_Profiler_Reader_table_size(const struct Ruby_Profiler_Reader_State_Header *header) {
+	size_t size = header->header_size + header->capacity * RUBY_PROFILER_READER_PAIR_SIZE;
+	
+	if (header->flags & RUBY_PROFILER_STATE_FLAG_KEY_INDEX) {
+		size += header->capacity * sizeof(uint64_t);
+	}
+	
+	if (header->flags & RUBY_PROFILER_STATE_FLAG_SNAPSHOT) {
+		size += header->capacity * RUBY_PROFILER_READER_SNAPSHOT_SIZE;
+	}
+	
+	if (header->flags & RUBY_PROFILER_STATE_FLAG_FINGERPRINT) {
+		size += header->capacity * sizeof(uint64_t);
+	}
+	
+	return size;
+}
+
+// Validate the header of a table that has been (at least partly) read, returning its total size (0 if invalid):
+static size_t Ruby_Profiler_Reader_validate(const struct Ruby_Profiler_Reader_Table *table, struct Ruby_Profiler_Reader_State_Header *header) {
+	if (table->length < 32) return 0;
+	
+	memset(header, 0, sizeof(*header));
+	memcpy(header, table->buffer, table->length < sizeof(*header) ? table->length : sizeof(*header));
+	
+	if (header->magic != RUBY_PROFILER_STATE_MAGIC || header->header_size < 32 || header->header_size > table->length) return 0;
+	
+	// Capacity is always a power of 2, and bounded to avoid huge allocations from a corrupt header:
+	if (header->capacity == 0 || (header->capacity & (header->capacity - 1)) || header->capacity > (1 << 20)) return 0;
+	
+	if (header->version < 2) {
+		header->parent = 0;
+		header->depth = 0;
+	}
+	
+	if (!(header->flags & RUBY_PROFILER_STATE_FLAG_PARENT)) {
+		header->parent = 0;
+	}
+	
+	return Ruby_Profiler_Reader_table_size(header);
+}
+
+struct Ruby_Profiler_Reader_Request {
+	struct Ruby_Profiler_Reader_Thread *thread;
+	struct Ruby_Profiler_Reader_Table *table;
+};
+
+// Read all pending requests in one batch. Each request either reads the first page of a table, or (if the table has been partly read) the remainder of it.
+static void Ruby_Profiler_Reader_read_tables(struct Ruby_Profiler_Reader *reader, struct Ruby_Profiler_Reader_Request *requests, size_t count) {
+	struct iovec *local = calloc(count, sizeof(struct iovec));
+	struct iovec *remote = calloc(count, sizeof(struct iovec));
+	int *failed = calloc(count, sizeof(int));
+	size_t *offsets = calloc(count, sizeof(size_t));
+	
+	if (!local || !remote || !failed || !offsets) {
+		for (size_t i = 0; i < count; i++) requests[i].thread->failed = 1;
+		goto done;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		struct Ruby_Profiler_Reader_Table *table = requests[i].table;
+		struct Ruby_Profiler_Reader_State_Header header;
+		size_t size;
+		
+		if (table->length == 0) {
+			// Read up to the end of the page (which must be mapped if the table starts on it), or at least the header:
+			size = reader->page_size - (table->address & (reader->page_size - 1));
+			if (size < sizeof(header)) size = sizeof(header);
+		} else {
+			size = Ruby_Profiler_Reader_validate(table, &header);
+		}
+		
+		uint8_t *buffer = realloc(table->buffer, size);
+		
+		if (!buffer) {
+			requests[i].thread->failed = 1;
+			continue;
+		}
+		
+		table->buffer = buffer;
+		offsets[i] = table->length;
+		
+		local[i].iov_base = buffer + table->length;
+		local[i].iov_len = size - table->length;
+		remote[i].iov_base = (void*)(uintptr_t)(table->address + table->length);
+		remote[i].iov_len = size - table->length;
+	}
+	
+	Ruby_Profiler_Reader_readv(reader, local, remote, count, failed);
+	
+	for (size_t i = 0; i < count; i++) {
+		if (failed[i] || requests[i].thread->failed) {
+			requests[i].thread->failed = 1;
+		} else {
+			requests[i].table->length = offsets[i] + local[i].iov_len;
+		}
+	}
+
+done:
+	free(local);
+	free(remote);
+	free(failed);
+	free(offsets);
+}
+
+// Merge the pairs of a chain of tables (newest first, so that newer keys shadow older ones):
+static size_t Ruby_Profiler_Reader_collect(const struct Ruby_Profiler_Reader *reader, const struct Ruby_Profiler_Reader_Thread *thread, struct Ruby_Profiler_Reader_Pair **result) {
+	size_t count = 0, capacity = 0;
+	struct Ruby_Profiler_Reader_Pair *pairs = NULL;
+	
+	for (size_t level = 0; level < thread->depth; level++) {
+		const struct Ruby_Profiler_Reader_Table *table = &thread->tables[level];
+		struct Ruby_Profiler_Reader_State_Header header;
+		Ruby_Profiler_Reader_validate(table, &header);
+		
+		const uint8_t *slots = table->buffer + header.header_size;
+		const uint8_t *section = slots + header.capacity * RUBY_PROFILER_READER_PAIR_SIZE;
+		const uint8_t *snapshots = NULL, *fingerprints = NULL;
+		
+		if (header.flags & RUBY_PROFILER_STATE_FLAG_KEY_INDEX) {
+			section += header.capacity * sizeof(uint64_t);
+		}
+		
+		if (header.flags & RUBY_PROFILER_STATE_FLAG_SNAPSHOT) {
+			snapshots = section;
+			section += header.capacity * RUBY_PROFILER_READER_SNAPSHOT_SIZE;
+		}
+		
+		if (header.flags & RUBY_PROFILER_STATE_FLAG_FINGERPRINT) {
+			fingerprints = section;
+		}
+		
+		for (size_t i = 0; i < header.capacity; i++) {
+			uint64_t id, value;
+			memcpy(&id, slots + i * RUBY_PROFILER_READER_PAIR_SIZE, sizeof(id));
+			memcpy(&value, slots + i * RUBY_PROFILER_READER_PAIR_SIZE + 8, sizeof(value));
+			
+			if (id == 0) continue;
+			
+			int shadowed = 0;
+			for (size_t j = 0; j < count && !shadowed; j++) {
+				shadowed = pairs[j].id == id;
+			}
+			
+			if (shadowed) continue;
+			
+			if (count == capacity) {
+				capacity = capacity ? capacity * 2 : 16;
+				struct Ruby_Profiler_Reader_Pair *resized = realloc(pairs, capacity * sizeof(*pairs));
+				
+				if (!resized) break;
+				
+				pairs = resized;
+			}
+			
+			struct Ruby_Profiler_Reader_Pair *pair = &pairs[count++];
+			memset(pair, 0, sizeof(*pair));
+			pair->id = id;
+			pair->key = Ruby_Profiler_Reader_symbol(reader, id);
+			pair->value = value;
+			
+			if (snapshots) {
+				const uint8_t *snapshot = snapshots + i * RUBY_PROFILER_READER_SNAPSHOT_SIZE;
+				
+				pair->snapshot_type = snapshot[0];
+				pair->snapshot_length = snapshot[1] <= RUBY_PROFILER_READER_SNAPSHOT_SIZE - 2 ? snapshot[1] : 0;
+				pair->snapshot_data = snapshot + 2;
+			}
+			
+			if (fingerprints) {
+				memcpy(&pair->fingerprint, fingerprints + i * sizeof(uint64_t), sizeof(uint64_t));
+			}
+		}
+	}
+	
+	*result = pairs;
+	
+	return count;
+}
+
+int Ruby_Profiler_Reader_sample(struct Ruby_Profiler_Reader *reader, Ruby_Profiler_Reader_Callback callback, void *data) {
+	reader->calls = 0;
+	
+	// Read the registry and the symbol table header together:
+	struct Ruby_Profiler_Reader_Symbols_Header symbols;
+	struct iovec local[2] = {{reader->registry, reader->registry_size}, {&symbols, sizeof(symbols)}};
+	struct iovec remote[2] = {{(void*)(uintptr_t)reader->registry_address, reader->registry_size}, {(void*)(uintptr_t)reader->symbols_address, sizeof(symbols)}};
+	int failed[2] = {0, 0};
+	
+	Ruby_Profiler_Reader_readv(reader, local, remote, reader->symbols_address ? 2 : 1, failed);
+	
+	if (failed[0]) return -EFAULT;
+	
+	if (reader->symbols_address && !failed[1]) {
+		Ruby_Profiler_Reader_update_symbols(reader, &symbols);
+	}
+	
+	// Find the threads which have a state (and whose state isn't being changed):
+	const struct Ruby_Profiler_Reader_Registry_Entry *entries = (const struct Ruby_Profiler_Reader_Registry_Entry*)(reader->registry + sizeof(struct Ruby_Profiler_Reader_Registry_Header));
+	size_t thread_count = 0;
+	
+	for (size_t i = 0; i < reader->registry_capacity; i++) {
+		if (entries[i].tid != RUBY_PROFILER_REGISTRY_EMPTY && entries[i].tid != RUBY_PROFILER_REGISTRY_DELETED && entries[i].state && !(entries[i].sequence & 1)) {
+			thread_count++;
+		}
+	}
+	
+	if (thread_count == 0) return 0;
+	
+	struct Ruby_Profiler_Reader_Thread *threads = calloc(thread_count, sizeof(*threads));
+	struct Ruby_Profiler_Reader_Request *requests = calloc(thread_count, sizeof(*requests));
+	
+	if (!threads || !requests) {
+		free(threads);
+		free(requests);
+		return -ENOMEM;
+	}
+	
+	size_t request_count = 0;
+	
+	for (size_t i = 0, j = 0; i < reader->registry_capacity && j < thread_count; i++) {
+		if (entries[i].tid != RUBY_PROFILER_REGISTRY_EMPTY && entries[i].tid != RUBY_PROFILER_REGISTRY_DELETED && entries[i].state && !(entries[i].sequence & 1)) {
+			struct Ruby_Profiler_Reader_Thread *thread = &threads[j++];
+			
+			thread->tid = entries[i].tid;
+			thread->sequence = entries[i].sequence;
+			thread->index = i;
+			thread->tables[0].address = entries[i].state;
+			thread->depth = 1;
+			
+			requests[request_count++] = (struct Ruby_Profiler_Reader_Request){thread, &thread->tables[0]};
+		}
+	}
+	
+	// Read tables in batches until every table (and every parent) has been read completely:
+	while (request_count > 0) {
+		Ruby_Profiler_Reader_read_tables(reader, requests, request_count);
+		
+		size_t pending = 0;
+		
+		for (size_t i = 0; i < request_count; i++) {
+			struct Ruby_Profiler_Reader_Thread *thread = requests[i].thread;
+			struct Ruby_Profiler_Reader_Table *table = requests[i].table;
+			struct Ruby_Profiler_Reader_State_Header header;
+			
+			if (thread->failed) continue;
+			
+			size_t size = Ruby_Profiler_Reader_validate(table, &header);
+			
+			if (size == 0) {
+				thread->failed = 1;
+			} else if (table->length < size) {
+				// Read the remainder of the table:
+				requests[pending++] = requests[i];
+			} else {
+				table->generation = header.generation;
+				
+				// Read the parent of a derived state:
+				if (header.parent) {
+					if (thread->depth > RUBY_PROFILER_STATE_MAXIMUM_DEPTH) {
+						thread->failed = 1;
+					} else {
+						struct Ruby_Profiler_Reader_Table *parent = &thread->tables[thread->depth++];
+						parent->address = header.parent;
+						requests[pending++] = (struct Ruby_Profiler_Reader_Request){thread, parent};
+					}
+				}
+			}
+		}
+		
+		request_count = pending;
+	}
+	
+	// Finally, read the sequence number of each thread and the generation of each table again, in one batch, to detect changes while reading:
+	size_t check_count = 0;
+	for (size_t i = 0; i < thread_count; i++) {
+		if (!threads[i].failed) check_count += 1 + threads[i].depth;
+	}
+	
+	struct iovec *check_local = calloc(check_count ? check_count : 1, sizeof(struct iovec));
+	struct iovec *check_remote = calloc(check_count ? check_count : 1, sizeof(struct iovec));
+	int *check_failed = calloc(check_count ? check_count : 1, sizeof(int));
+	int sampled = 0;
+	
+	if (check_local && check_remote && check_failed) {
+		size_t k = 0;
+		
+		for (size_t i = 0; i < thread_count; i++) {
+			struct Ruby_Profiler_Reader_Thread *thread = &threads[i];
+			if (thread->failed) continue;
+			
+			uint64_t entry_address = reader->registry_address + sizeof(struct Ruby_Profiler_Reader_Registry_Header) + thread->index * sizeof(struct Ruby_Profiler_Reader_Registry_Entry);
+			
+			check_local[k] = (struct iovec){&thread->final_sequence, sizeof(uint64_t)};
+			check_remote[k++] = (struct iovec){(void*)(uintptr_t)(entry_address + offsetof(struct Ruby_Profiler_Reader_Registry_Entry, sequence)), sizeof(uint64_t)};
+			
+			for (size_t level = 0; level < thread->depth; level++) {
+				struct Ruby_Profiler_Reader_Table *table = &thread->tables[level];
+				
+				check_local[k] = (struct iovec){&table->final_generation, sizeof(uint32_t)};
+				check_remote[k++] = (struct iovec){(void*)(uintptr_t)(table->address + offsetof(struct Ruby_Profiler_Reader_State_Header, generation)), sizeof(uint32_t)};
+			}
+		}
+		
+		Ruby_Profiler_Reader_readv(reader, check_local, check_remote, check_count, check_failed);
+		
+		k = 0;
+		
+		for (size_t i = 0; i < thread_count; i++) {
+			struct Ruby_Profiler_Reader_Thread *thread = &threads[i];
+			if (thread->failed) continue;
+			
+			int consistent = !check_failed[k] && thread->final_sequence == thread->sequence;
+			k++;
+			
+			for (size_t level = 0; level < thread->depth; level++, k++) {
+				struct Ruby_Profiler_Reader_Table *table = &thread->tables[level];
+				
+				if (check_failed[k] || (table->generation & 1) || table->final_generation != table->generation) {
+					consistent = 0;
+				}
+			}
+			
+			if (!consistent) continue;
+			
+			struct Ruby_Profiler_Reader_Pair *pairs = NULL;
+			struct Ruby_Profiler_Reader_Sample sample = {
+				.tid = thread->tid,
+				.state = thread->tables[0].address,
+			};
+			
+			sample.count = Ruby_Profiler_Reader_collect(reader, thread, &pairs);
+			sample.pairs = pairs;
+			
+			callback(&sample, data);
+			sampled++;
+			
+			free(pairs);
+		}
+	}
+	
+	for (size_t i = 0; i < thread_count; i++) {
+		for (size_t level = 0; level <= RUBY_PROFILER_STATE_MAXIMUM_DEPTH; level++) {
+			free(threads[i].tables[level].buffer);
+		}
+	}
+	
+	free(check_local);
+	free(check_remote);
+	free(check_failed);
+	free(threads);
+	free(requests);
+	
+	return sampled;
+}
@@ -0,0 +1,56 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+// An out-of-process reader for the state of a Ruby process using `ruby-profiler`, for environments where BPF isn't available. It uses `process_vm_readv` (Linux only), so it needs the same permissions as `ptrace` (e.g. the same user, or CAP_SYS_PTRACE).
+//
+// Rather than resolving the `ruby_profiler_state` thread-local variable of each thread (which requires the thread pointer of every thread, and so stopping them with ptrace), the reader uses the exported thread registry (`ruby_profiler_registry`) which mirrors it. Each sample reads the registry and the symbol table header in one call, and then the tables of all threads in batches (one call per batch, regardless of the number of threads): typically the first page of each table, then the remainder of any larger tables, then any parents of derived states, and finally the sequence numbers and generations, to discard threads whose state changed while being read.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct Ruby_Profiler_Reader;
+
+struct Ruby_Profiler_Reader_Pair {
+	// The ID of the key, and its name (NULL if it isn't in the symbol table):
+	uint64_t id;
+	const char *key;
+	
+	// The raw VALUE:
+	uint64_t value;
+	
+	// The snapshot of the value (type 0 if the state has no snapshots, or the value has no snapshot), see `struct Ruby_Profiler_Snapshot`:
+	uint8_t snapshot_type;
+	uint8_t snapshot_length;
+	const uint8_t *snapshot_data;
+	
+	// The fingerprint of the value (0 if the state has no fingerprints, or the value has no fingerprint):
+	uint64_t fingerprint;
+};
+
+struct Ruby_Profiler_Reader_Sample {
+	// Thread ID:
+	uint64_t tid;
+	
+	// Address of the state in the target process:
+	uint64_t state;
+	
+	// The pairs of the state, including those inherited from parents of a derived state:
+	size_t count;
+	const struct Ruby_Profiler_Reader_Pair *pairs;
+};
+
+typedef void (*Ruby_Profiler_Reader_Callback)(const struct Ruby_Profiler_Reader_Sample *sample, void *data);
+
+// Attach to a process, locating the exported symbols of the extension. Returns 0 on success, or a negative errno value.
+int Ruby_Profiler_Reader_open(struct Ruby_Profiler_Reader **reader, pid_t pid);
+
+void Ruby_Profiler_Reader_close(struct Ruby_Profiler_Reader *reader);
+
+// Read the current state of every thread which has one, invoking the callback for each. Returns the number of threads sampled, or a negative errno value.
+int Ruby_Profiler_Reader_sample(struct Ruby_Profiler_Reader *reader, Ruby_Profiler_Reader_Callback callback, void *data);
+
+// Number of process_vm_readv calls made by the last sample:
+size_t Ruby_Profiler_Reader_calls(const struct Ruby_Profiler_Reader *reader);
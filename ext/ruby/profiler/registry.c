@@ -0,0 +1,256 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "registry.h"
+#include "state.h"
+#include "fiber.h"
+
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+struct Ruby_Profiler_Registry ruby_profiler_registry = {
+	.magic = RUBY_PROFILER_REGISTRY_MAGIC,
+	.version = RUBY_PROFILER_REGISTRY_VERSION,
+	.capacity = RUBY_PROFILER_REGISTRY_CAPACITY,
+};
+
+_Thread_local struct Ruby_Profiler_Registry_Entry *ruby_profiler_registry_entry = NULL;
+
+// Whether this thread has tried to register (so that we don't retry if the registry is full):
+static _Thread_local int ruby_profiler_registry_attempted = 0;
+
+// The thread-local variables of a registered thread, so that other threads can clear them (see `Ruby_Profiler_Registry_clear`):
+struct Ruby_Profiler_Registry_Thread {
+	struct Ruby_Profiler_Registry_Thread *previous, *next;
+	
+	// NULL if the thread couldn't be given an entry:
+	struct Ruby_Profiler_Registry_Entry *entry;
+	
+	struct Ruby_Profiler_State **state;
+	struct Ruby_Profiler_Stack **stack;
+	_Atomic uint64_t *sequence;
+	struct Ruby_Profiler_State_Counters **counters;
+	VALUE *source;
+};
+
+static _Thread_local struct Ruby_Profiler_Registry_Thread ruby_profiler_registry_thread;
+
+// Every registered thread which hasn't exited (protected by the mutex, since threads exit without the GVL):
+static struct Ruby_Profiler_Registry_Thread *ruby_profiler_registry_threads = NULL;
+static pthread_mutex_t ruby_profiler_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t ruby_profiler_registry_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ruby_profiler_registry_key;
+
+uint64_t Ruby_Profiler_Registry_tid(void) {
+#if defined(__linux__)
+	return (uint64_t)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+	uint64_t tid = 0;
+	pthread_threadid_np(NULL, &tid);
+	return tid;
+#else
+	return 0;
+#endif
+}
+
+// Remove a thread (and its entry) when it exits:
+static void Ruby_Profiler_Registry_release(void *argument) {
+	struct Ruby_Profiler_Registry_Thread *thread = (struct Ruby_Profiler_Registry_Thread*)argument;
+	
+	pthread_mutex_lock(&ruby_profiler_registry_mutex);
+	
+	if (thread->previous) thread->previous->next = thread->next;
+	else ruby_profiler_registry_threads = thread->next;
+	if (thread->next) thread->next->previous = thread->previous;
+	
+	pthread_mutex_unlock(&ruby_profiler_registry_mutex);
+	
+	struct Ruby_Profiler_Registry_Entry *entry = thread->entry;
+	
+	if (entry) {
+		atomic_store_explicit(&entry->state, NULL, memory_order_relaxed);
+		atomic_store_explicit(&entry->tid, RUBY_PROFILER_REGISTRY_DELETED, memory_order_release);
+	}
+}
+
+// Add the current thread to the list of registered threads:
+static void Ruby_Profiler_Registry_add(void) {
+	struct Ruby_Profiler_Registry_Thread *thread = &ruby_profiler_registry_thread;
+	
+	thread->state = &ruby_profiler_state;
+	thread->stack = &ruby_profiler_stack;
+	thread->sequence = &ruby_profiler_sequence;
+	thread->counters = &ruby_profiler_counters;
+	thread->source = &ruby_profiler_fiber_source;
+	
+	pthread_mutex_lock(&ruby_profiler_registry_mutex);
+	
+	thread->previous = NULL;
+	thread->next = ruby_profiler_registry_threads;
+	if (thread->next) thread->next->previous = thread;
+	ruby_profiler_registry_threads = thread;
+	
+	pthread_mutex_unlock(&ruby_profiler_registry_mutex);
+	
+	pthread_setspecific(ruby_profiler_registry_key, thread);
+}
+
+static void Ruby_Profiler_Registry_key_create(void) {
+	pthread_key_create(&ruby_profiler_registry_key, Ruby_Profiler_Registry_release);
+}
+
+// Claim an entry for the current thread (NULL if there is none):
+static struct Ruby_Profiler_Registry_Entry *Ruby_Profiler_Registry_claim(void) {
+	uint64_t tid = Ruby_Profiler_Registry_tid();
+	
+	if (tid == RUBY_PROFILER_REGISTRY_EMPTY || tid == RUBY_PROFILER_REGISTRY_DELETED) {
+		return NULL;
+	}
+	
+	size_t mask = RUBY_PROFILER_REGISTRY_CAPACITY - 1;
+	size_t index = Ruby_Profiler_State_hash((ID)tid) & mask;
+	
+	for (size_t i = 0; i < RUBY_PROFILER_REGISTRY_CAPACITY; i++) {
+		struct Ruby_Profiler_Registry_Entry *entry = &ruby_profiler_registry.entries[(index + i) & mask];
+		uint64_t current = atomic_load_explicit(&entry->tid, memory_order_relaxed);
+		
+		// Claim an empty or deleted entry (thread IDs are unique among live threads, so this thread can't already have an entry):
+		if (current == RUBY_PROFILER_REGISTRY_EMPTY || current == RUBY_PROFILER_REGISTRY_DELETED) {
+			if (atomic_compare_exchange_strong(&entry->tid, &current, tid)) {
+				// The sequence number carries on from the previous thread (if any), so readers can't mistake this thread's state for that one:
+				atomic_store_explicit(&entry->state, NULL, memory_order_relaxed);
+				
+				ruby_profiler_registry_thread.entry = entry;
+				ruby_profiler_registry_entry = entry;
+				
+				return entry;
+			}
+		}
+	}
+	
+	atomic_fetch_add_explicit(&ruby_profiler_registry.dropped, 1, memory_order_relaxed);
+	
+	return NULL;
+}
+
+struct Ruby_Profiler_Registry_Entry *Ruby_Profiler_Registry_register(void) {
+	if (ruby_profiler_registry_attempted) {
+		return NULL;
+	}
+	
+	ruby_profiler_registry_attempted = 1;
+	
+	// Threads are added even without an entry, so that their thread-local pointers can be cleared:
+	pthread_once(&ruby_profiler_registry_key_once, Ruby_Profiler_Registry_key_create);
+	Ruby_Profiler_Registry_add();
+	
+	return Ruby_Profiler_Registry_claim();
+}
+
+// Hold the mutex across fork, so that the child doesn't inherit it locked, or the list half updated:
+static void Ruby_Profiler_Registry_atfork_prepare(void) {
+	pthread_mutex_lock(&ruby_profiler_registry_mutex);
+}
+
+static void Ruby_Profiler_Registry_atfork_parent(void) {
+	pthread_mutex_unlock(&ruby_profiler_registry_mutex);
+}
+
+// Only the forking thread exists in the child, and it has a new thread ID, so start again with an empty registry containing just that thread (if it was registered):
+static void Ruby_Profiler_Registry_atfork_child(void) {
+	pthread_mutex_unlock(&ruby_profiler_registry_mutex);
+	
+	for (size_t i = 0; i < RUBY_PROFILER_REGISTRY_CAPACITY; i++) {
+		struct Ruby_Profiler_Registry_Entry *entry = &ruby_profiler_registry.entries[i];
+		
+		atomic_store_explicit(&entry->state, NULL, memory_order_relaxed);
+		atomic_store_explicit(&entry->tid, RUBY_PROFILER_REGISTRY_EMPTY, memory_order_relaxed);
+	}
+	
+	atomic_store_explicit(&ruby_profiler_registry.dropped, 0, memory_order_relaxed);
+	
+	// The thread-local variables of the other threads no longer exist:
+	ruby_profiler_registry_threads = NULL;
+	ruby_profiler_registry_thread.entry = NULL;
+	ruby_profiler_registry_entry = NULL;
+	
+	if (!ruby_profiler_registry_attempted) return;
+	
+	struct Ruby_Profiler_Registry_Thread *thread = &ruby_profiler_registry_thread;
+	
+	thread->previous = thread->next = NULL;
+	ruby_profiler_registry_threads = thread;
+	
+	struct Ruby_Profiler_Registry_Entry *entry = Ruby_Profiler_Registry_claim();
+	
+	// Mirror the state this thread is already publishing:
+	if (entry) {
+		uint64_t entry_sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+		
+		// Sequence numbers must be even when stable:
+		atomic_store_explicit(&entry->sequence, (entry_sequence | 1) + 1, memory_order_relaxed);
+		atomic_store_explicit(&entry->state, ruby_profiler_state, memory_order_release);
+	}
+}
+
+void Ruby_Profiler_Registry_clear(void) {
+	pthread_mutex_lock(&ruby_profiler_registry_mutex);
+	
+	for (struct Ruby_Profiler_Registry_Thread *thread = ruby_profiler_registry_threads; thread; thread = thread->next) {
+		// The current thread clears its own pointers with `Ruby_Profiler_State_publish`:
+		if (thread == &ruby_profiler_registry_thread) continue;
+		
+		struct Ruby_Profiler_Registry_Entry *entry = thread->entry;
+		
+		// The same protocol as `Ruby_Profiler_State_publish`, which can't be running on the thread at the same time:
+		uint64_t sequence = atomic_load_explicit(thread->sequence, memory_order_relaxed);
+		uint64_t entry_sequence = entry ? atomic_load_explicit(&entry->sequence, memory_order_relaxed) : 0;
+		
+		atomic_store_explicit(thread->sequence, sequence + 1, memory_order_relaxed);
+		if (entry) atomic_store_explicit(&entry->sequence, entry_sequence + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		
+		*thread->state = NULL;
+		*thread->stack = NULL;
+		if (entry) atomic_store_explicit(&entry->state, NULL, memory_order_relaxed);
+		
+		atomic_store_explicit(thread->sequence, sequence + 2, memory_order_release);
+		if (entry) atomic_store_explicit(&entry->sequence, entry_sequence + 2, memory_order_release);
+		
+		// Any CPU time used since the thread was last charged is lost:
+		Ruby_Profiler_State_Counters_release(*thread->counters);
+		*thread->counters = NULL;
+		*thread->source = Qnil;
+	}
+	
+	pthread_mutex_unlock(&ruby_profiler_registry_mutex);
+	
+	// Signal handlers which read the pointers after this see the changes (see `Ruby_Profiler_Sampler_synchronize`):
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+// Get the thread IDs of all registered threads:
+static VALUE Ruby_Profiler_Registry_s_registry(VALUE klass) {
+	VALUE array = rb_ary_new();
+	
+	for (size_t i = 0; i < RUBY_PROFILER_REGISTRY_CAPACITY; i++) {
+		uint64_t tid = atomic_load_explicit(&ruby_profiler_registry.entries[i].tid, memory_order_acquire);
+		
+		if (tid != RUBY_PROFILER_REGISTRY_EMPTY && tid != RUBY_PROFILER_REGISTRY_DELETED) {
+			rb_ary_push(array, ULL2NUM(tid));
+		}
+	}
+	
+	return array;
+}
+
+void Init_Ruby_Profiler_Registry(VALUE Ruby_Profiler_State) {
+	pthread_atfork(Ruby_Profiler_Registry_atfork_prepare, Ruby_Profiler_Registry_atfork_parent, Ruby_Profiler_Registry_atfork_child);
+	
+	rb_define_singleton_method(Ruby_Profiler_State, "registry", Ruby_Profiler_Registry_s_registry, 0);
+}
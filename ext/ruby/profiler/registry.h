@@ -0,0 +1,77 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+#include <stdatomic.h>
+
+struct Ruby_Profiler_State;
+
+// "RPRG" in memory order on little-endian systems:
+#define RUBY_PROFILER_REGISTRY_MAGIC 0x47525052
+
+#define RUBY_PROFILER_REGISTRY_VERSION 1
+
+// Number of entries (must be a power of 2):
+#define RUBY_PROFILER_REGISTRY_CAPACITY 4096
+
+// Entry states for `tid`:
+#define RUBY_PROFILER_REGISTRY_EMPTY 0
+#define RUBY_PROFILER_REGISTRY_DELETED UINT64_MAX
+
+struct Ruby_Profiler_Registry_Entry {
+	// Kernel thread ID (as returned by gettid), RUBY_PROFILER_REGISTRY_EMPTY, or RUBY_PROFILER_REGISTRY_DELETED:
+	_Atomic uint64_t tid;
+	
+	// Updated around every change to `state`, in the same way as `ruby_profiler_sequence`:
+	_Atomic uint64_t sequence;
+	
+	// Mirrors `ruby_profiler_state` for the thread:
+	struct Ruby_Profiler_State *_Atomic state;
+};
+
+// A process-wide open-addressed table of the state published by each thread, keyed by thread ID, so that readers can find the state of a thread without resolving thread-local storage. This is considered a public interface for BPF programs. Entries are found by linear probing from `Ruby_Profiler_State_hash(tid) & (capacity - 1)` until the thread ID or an empty entry is found. Entries of threads which have exited are marked as deleted (not empty), so they don't end the probe sequence.
+struct Ruby_Profiler_Registry {
+	// Always RUBY_PROFILER_REGISTRY_MAGIC:
+	uint32_t magic;
+	
+	// Layout version (RUBY_PROFILER_REGISTRY_VERSION):
+	uint32_t version;
+	
+	// Number of entries (RUBY_PROFILER_REGISTRY_CAPACITY):
+	uint64_t capacity;
+	
+	// Number of threads which could not be registered because the table is full:
+	_Atomic uint64_t dropped;
+	
+	struct Ruby_Profiler_Registry_Entry entries[RUBY_PROFILER_REGISTRY_CAPACITY];
+};
+
+// Process-wide registry (public symbol for BPF access)
+extern struct Ruby_Profiler_Registry ruby_profiler_registry;
+
+// The registry entry of the current thread (NULL until registered):
+extern _Thread_local struct Ruby_Profiler_Registry_Entry *ruby_profiler_registry_entry;
+
+// Get the kernel thread ID of the current thread (0 if not supported).
+uint64_t Ruby_Profiler_Registry_tid(void);
+
+// Register the current thread, returning its entry (NULL if it can't be registered).
+struct Ruby_Profiler_Registry_Entry *Ruby_Profiler_Registry_register(void);
+
+// Stop every other registered thread publishing states (clearing its thread-local pointers and registry entry), e.g. when the profiler is disabled, since the states may be freed before the thread publishes again. This must be called with the GVL, while the thread event hooks are removed, since other threads only publish states with the GVL or from those hooks.
+void Ruby_Profiler_Registry_clear(void);
+
+// Get the registry entry of the current thread, registering it on first use.
+static inline struct Ruby_Profiler_Registry_Entry *Ruby_Profiler_Registry_current(void) {
+	struct Ruby_Profiler_Registry_Entry *entry = ruby_profiler_registry_entry;
+	
+	if (RB_LIKELY(entry)) {
+		return entry;
+	}
+	
+	return Ruby_Profiler_Registry_register();
+}
+
+void Init_Ruby_Profiler_Registry(VALUE Ruby_Profiler_State);
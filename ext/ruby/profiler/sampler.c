@@ -0,0 +1,785 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "sampler.h"
+#include "state.h"
+#include "profiler.h"
+#include "registry.h"
+
+#include <ruby/encoding.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__linux__) && defined(HAVE_TIMER_CREATE)
+#define RUBY_PROFILER_SAMPLER
+
+#include <signal.h>
+#include <time.h>
+
+// Older versions of glibc don't name the thread ID of SIGEV_THREAD_ID:
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+_Atomic uint64_t ruby_profiler_sampler_generation = 0;
+_Thread_local uint64_t ruby_profiler_sampler_armed = 0;
+
+struct Ruby_Profiler_Sampler_Entry {
+	// Identifies the value (see `Ruby_Profiler_Sampler_sample`), or 0 for an empty entry:
+	_Atomic uint64_t key;
+	
+	// Set (release) once `value` and `snapshot` are stored:
+	_Atomic uint32_t ready;
+	
+	_Atomic uint64_t count;
+	
+	// The value, if it is an immediate (Qundef otherwise):
+	VALUE value;
+	
+	// A snapshot of the value, for labelling it (if the state had one):
+	struct Ruby_Profiler_Snapshot snapshot;
+};
+
+struct Ruby_Profiler_Sampler {
+	// The key of the state which samples are counted against:
+	ID key;
+	
+	double frequency;
+	
+	// Number of entries (a power of 2):
+	size_t capacity;
+	struct Ruby_Profiler_Sampler_Entry *entries;
+	
+	// Number of samples taken:
+	_Atomic uint64_t total;
+	
+	// Number of samples with no value for the key (including those with no state):
+	_Atomic uint64_t missing;
+	
+	// Number of samples whose value couldn't be identified:
+	_Atomic uint64_t unknown;
+	
+	// Number of samples which couldn't be counted, because the table was full or the state was being changed:
+	_Atomic uint64_t dropped;
+};
+
+static void Ruby_Profiler_Sampler_free(void *data) {
+	struct Ruby_Profiler_Sampler *sampler = (struct Ruby_Profiler_Sampler*)data;
+	
+	free(sampler->entries);
+	free(sampler);
+}
+
+static size_t Ruby_Profiler_Sampler_memsize(const void *data) {
+	const struct Ruby_Profiler_Sampler *sampler = (const struct Ruby_Profiler_Sampler*)data;
+	
+	return sizeof(*sampler) + sampler->capacity * sizeof(struct Ruby_Profiler_Sampler_Entry);
+}
+
+static const rb_data_type_t Ruby_Profiler_Sampler_Type = {
+	.wrap_struct_name = "Ruby::Profiler::Sampler",
+	.function = {
+		// Entries only refer to immediate values, so there is nothing to mark:
+		.dfree = Ruby_Profiler_Sampler_free,
+		.dsize = Ruby_Profiler_Sampler_memsize,
+	},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+static VALUE Ruby_Profiler_Sampler_allocate(VALUE klass) {
+	struct Ruby_Profiler_Sampler *sampler = calloc(1, sizeof(struct Ruby_Profiler_Sampler));
+	
+	if (!sampler) {
+		rb_raise(rb_eNoMemError, "Failed to allocate sampler!");
+	}
+	
+	return TypedData_Wrap_Struct(klass, &Ruby_Profiler_Sampler_Type, sampler);
+}
+
+static struct Ruby_Profiler_Sampler *Ruby_Profiler_Sampler_get(VALUE self) {
+	struct Ruby_Profiler_Sampler *sampler;
+	TypedData_Get_Struct(self, struct Ruby_Profiler_Sampler, &Ruby_Profiler_Sampler_Type, sampler);
+	
+	if (!sampler->entries) {
+		rb_raise(rb_eRuntimeError, "Sampler not initialized!");
+	}
+	
+	return sampler;
+}
+
+// The running sampler, which is kept alive (and so not freed) until it is stopped:
+static VALUE ruby_profiler_sampler_current = Qnil;
+
+#if defined(RUBY_PROFILER_SAMPLER)
+
+// The value of the running sampler's key in the state published by a thread, computed when it was published:
+struct Ruby_Profiler_Sampler_Label {
+	// The state (NULL while the label is being computed), and the generations of the state and the sampler, which must all match for the label to be used:
+	struct Ruby_Profiler_State *state;
+	uint32_t state_generation;
+	uint64_t sampler_generation;
+	
+	// Whether the state has no value for the key:
+	int missing;
+	
+	// Identifies the value (0 if it can't be identified), the same as `Ruby_Profiler_Sampler_Entry`:
+	uint64_t key;
+	VALUE value;
+	struct Ruby_Profiler_Snapshot snapshot;
+};
+
+static _Thread_local struct Ruby_Profiler_Sampler_Label ruby_profiler_sampler_label;
+
+// The running sampler, as seen by the signal handler (NULL when none is running):
+static struct Ruby_Profiler_Sampler *_Atomic ruby_profiler_sampler_running = NULL;
+
+// Number of signal handlers using the running sampler, so that stopping it can wait for them to finish:
+static _Atomic uint64_t ruby_profiler_sampler_handlers = 0;
+
+static int ruby_profiler_sampler_handler_installed = 0;
+
+struct Ruby_Profiler_Sampler_Timer {
+	timer_t timer;
+	
+	// The thread whose CPU time is measured:
+	uint64_t tid;
+	
+	// The generation the timer was created in, or 0 if the entry is free:
+	uint64_t generation;
+};
+
+// Timers can be deleted by any thread, so all of them can be deleted when the sampler stops (protected by the mutex):
+static struct Ruby_Profiler_Sampler_Timer ruby_profiler_sampler_timers[RUBY_PROFILER_SAMPLER_MAXIMUM_TIMERS];
+static pthread_mutex_t ruby_profiler_sampler_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t ruby_profiler_sampler_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ruby_profiler_sampler_key;
+
+// Delete the timer of a thread when it exits:
+static void Ruby_Profiler_Sampler_release(void *argument) {
+	struct Ruby_Profiler_Sampler_Timer *timer = (struct Ruby_Profiler_Sampler_Timer*)argument;
+	
+	pthread_mutex_lock(&ruby_profiler_sampler_mutex);
+	
+	// The timer may have been deleted by stopping the sampler, and the entry reused by another thread:
+	if (timer->generation && timer->tid == Ruby_Profiler_Registry_tid()) {
+		timer_delete(timer->timer);
+		timer->generation = 0;
+	}
+	
+	pthread_mutex_unlock(&ruby_profiler_sampler_mutex);
+}
+
+static void Ruby_Profiler_Sampler_key_create(void) {
+	pthread_key_create(&ruby_profiler_sampler_key, Ruby_Profiler_Sampler_release);
+}
+
+// Count a sample against a value:
+static void Ruby_Profiler_Sampler_count(struct Ruby_Profiler_Sampler *sampler, uint64_t key, VALUE value, const struct Ruby_Profiler_Snapshot *snapshot) {
+	size_t mask = sampler->capacity - 1;
+	size_t index = Ruby_Profiler_State_hash((ID)key) & mask;
+	
+	for (size_t i = 0; i < sampler->capacity; i++) {
+		struct Ruby_Profiler_Sampler_Entry *entry = &sampler->entries[(index + i) & mask];
+		uint64_t current = atomic_load_explicit(&entry->key, memory_order_acquire);
+		
+		// Claim an empty entry, unless another thread claims it first:
+		if (current == 0) {
+			if (atomic_compare_exchange_strong(&entry->key, &current, key)) {
+				entry->value = value;
+				if (snapshot) entry->snapshot = *snapshot;
+				atomic_store_explicit(&entry->ready, 1, memory_order_release);
+				
+				current = key;
+			}
+		}
+		
+		if (current == key) {
+			atomic_fetch_add_explicit(&entry->count, 1, memory_order_relaxed);
+			return;
+		}
+	}
+	
+	atomic_fetch_add_explicit(&sampler->dropped, 1, memory_order_relaxed);
+}
+
+// Count a sample of the current thread. This runs in a signal handler, so it must not allocate, lock, or dereference Ruby objects:
+static void Ruby_Profiler_Sampler_sample(struct Ruby_Profiler_Sampler *sampler) {
+	atomic_fetch_add_explicit(&sampler->total, 1, memory_order_relaxed);
+	
+	// The pointer is only changed by this thread, which is interrupted, and the state it points to is freed after it is changed:
+	struct Ruby_Profiler_State *state = ruby_profiler_state;
+	
+	if (!state) {
+		atomic_fetch_add_explicit(&sampler->missing, 1, memory_order_relaxed);
+		return;
+	}
+	
+	// The state may be being changed in place (see `State#update!`), possibly by the code which was interrupted:
+	uint32_t generation = atomic_load_explicit(&state->generation, memory_order_acquire);
+	
+	if (generation & 1) {
+		atomic_fetch_add_explicit(&sampler->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	
+	// Use the label computed when the state was published, unless it's being computed (by the code which was interrupted) or is stale:
+	const struct Ruby_Profiler_Sampler_Label *label = &ruby_profiler_sampler_label;
+	
+	if (label->state == state && label->state_generation == generation && label->sampler_generation == atomic_load_explicit(&ruby_profiler_sampler_generation, memory_order_relaxed)) {
+		if (label->missing) {
+			atomic_fetch_add_explicit(&sampler->missing, 1, memory_order_relaxed);
+		} else if (!label->key) {
+			atomic_fetch_add_explicit(&sampler->unknown, 1, memory_order_relaxed);
+		} else {
+			Ruby_Profiler_Sampler_count(sampler, label->key, label->value, label->snapshot.type == RUBY_PROFILER_SNAPSHOT_NONE ? NULL : &label->snapshot);
+		}
+		
+		return;
+	}
+	
+	// Find the table which holds the value, following the parents of a derived state:
+	struct Ruby_Profiler_State *table = state;
+	struct Ruby_Profiler_Pair *pair = NULL;
+	
+	for (; table; table = (struct Ruby_Profiler_State*)table->parent) {
+		if ((pair = Ruby_Profiler_State_find_pair(table, sampler->key))) break;
+	}
+	
+	if (!pair) {
+		atomic_fetch_add_explicit(&sampler->missing, 1, memory_order_relaxed);
+		return;
+	}
+	
+	size_t slot = pair - table->pairs;
+	VALUE value = pair->value;
+	const struct Ruby_Profiler_Snapshot *snapshot = NULL;
+	uint64_t key = 0;
+	
+	if (table->flags & RUBY_PROFILER_STATE_FLAG_SNAPSHOT) {
+		snapshot = &Ruby_Profiler_State_snapshots(table)[slot];
+		if (snapshot->type == RUBY_PROFILER_SNAPSHOT_NONE) snapshot = NULL;
+	}
+	
+	// Identify the value by its fingerprint, or compute one from its snapshot or (for an Integer) the value itself, which is the same as its fingerprint unless the snapshot is truncated:
+	if (table->flags & RUBY_PROFILER_STATE_FLAG_FINGERPRINT) {
+		key = Ruby_Profiler_State_fingerprints(table)[slot];
+	}
+	
+	if (!key && snapshot) {
+		key = Ruby_Profiler_Fingerprint_update(RUBY_PROFILER_FINGERPRINT_OFFSET, &snapshot->type, 1);
+		key = Ruby_Profiler_Fingerprint_update(key, snapshot->data, snapshot->length);
+		if (!key) key = 1;
+	}
+	
+	if (RB_FIXNUM_P(value)) {
+		if (!key) {
+			uint8_t type = RUBY_PROFILER_SNAPSHOT_INTEGER;
+			int64_t integer = (int64_t)RB_FIX2LONG(value);
+			
+			key = Ruby_Profiler_Fingerprint_update(RUBY_PROFILER_FINGERPRINT_OFFSET, &type, 1);
+			key = Ruby_Profiler_Fingerprint_update(key, &integer, sizeof(integer));
+			if (!key) key = 1;
+		}
+	} else if (RB_SPECIAL_CONST_P(value)) {
+		// Other immediates (e.g. static Symbols, true, false and nil) are identified by themselves, tagged so that they are never 0:
+		if (!key) key = (uint64_t)value | (1ULL << 63);
+	} else {
+		// Heap objects may be moved or freed, so they are only used for labelling Integers:
+		value = Qundef;
+	}
+	
+	if (!key) {
+		atomic_fetch_add_explicit(&sampler->unknown, 1, memory_order_relaxed);
+		return;
+	}
+	
+	// The value may have been changed while it was read (if another thread changed the state in place):
+	if (atomic_load_explicit(&state->generation, memory_order_acquire) != generation) {
+		atomic_fetch_add_explicit(&sampler->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	
+	Ruby_Profiler_Sampler_count(sampler, key, value, snapshot);
+}
+
+static void Ruby_Profiler_Sampler_handler(int signal, siginfo_t *information, void *context) {
+	int saved_errno = errno;
+	
+	atomic_fetch_add(&ruby_profiler_sampler_handlers, 1);
+	
+	struct Ruby_Profiler_Sampler *sampler = atomic_load(&ruby_profiler_sampler_running);
+	
+	if (sampler) {
+		Ruby_Profiler_Sampler_sample(sampler);
+	}
+	
+	atomic_fetch_sub(&ruby_profiler_sampler_handlers, 1);
+	
+	errno = saved_errno;
+}
+
+void Ruby_Profiler_Sampler_label_slow(struct Ruby_Profiler_State *state) {
+	struct Ruby_Profiler_Sampler_Label *label = &ruby_profiler_sampler_label;
+	struct Ruby_Profiler_Sampler *sampler = atomic_load_explicit(&ruby_profiler_sampler_running, memory_order_relaxed);
+	uint64_t sampler_generation = atomic_load_explicit(&ruby_profiler_sampler_generation, memory_order_relaxed);
+	uint32_t state_generation = atomic_load_explicit(&state->generation, memory_order_acquire);
+	
+	if (!sampler || (state_generation & 1)) return;
+	
+	if (label->state == state && label->state_generation == state_generation && label->sampler_generation == sampler_generation) return;
+	
+	// Values may be being freed while the garbage collector is running (e.g. when a fiber is freed), in which case the signal handler identifies the value from the table:
+	if (rb_during_gc()) return;
+	
+	// The signal handler runs on this thread, so it only needs to see that the label is being changed before it is:
+	label->state = NULL;
+	atomic_signal_fence(memory_order_seq_cst);
+	
+	struct Ruby_Profiler_Pair *pair = NULL;
+	
+	for (struct Ruby_Profiler_State *table = state; table && !pair; table = (struct Ruby_Profiler_State*)table->parent) {
+		pair = Ruby_Profiler_State_find_pair(table, sampler->key);
+	}
+	
+	label->missing = !pair;
+	label->key = 0;
+	label->value = Qundef;
+	label->snapshot.type = RUBY_PROFILER_SNAPSHOT_NONE;
+	
+	if (pair) {
+		VALUE value = pair->value;
+		
+		label->key = Ruby_Profiler_Fingerprint_compute(value);
+		Ruby_Profiler_Snapshot_render(&label->snapshot, value);
+		
+		if (RB_SPECIAL_CONST_P(value)) {
+			label->value = value;
+			
+			// Other immediates (e.g. true, false and nil) are identified by themselves, as in `Ruby_Profiler_Sampler_sample`:
+			if (!label->key) label->key = (uint64_t)value | (1ULL << 63);
+		}
+	}
+	
+	label->state_generation = state_generation;
+	label->sampler_generation = sampler_generation;
+	
+	atomic_signal_fence(memory_order_seq_cst);
+	label->state = state;
+}
+
+// Install the signal handler, which stays installed once the first sampler starts, since signals may still be pending after a sampler stops:
+static void Ruby_Profiler_Sampler_install(void) {
+	if (ruby_profiler_sampler_handler_installed) return;
+	
+	struct sigaction action, previous;
+	
+	if (sigaction(SIGPROF, NULL, &previous) == -1) {
+		rb_sys_fail("sigaction");
+	}
+	
+	if ((previous.sa_flags & SA_SIGINFO) || (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN)) {
+		rb_raise(rb_eRuntimeError, "SIGPROF is already handled by another profiler!");
+	}
+	
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = Ruby_Profiler_Sampler_handler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	
+	if (sigaction(SIGPROF, &action, NULL) == -1) {
+		rb_sys_fail("sigaction");
+	}
+	
+	ruby_profiler_sampler_handler_installed = 1;
+}
+
+// Create a timer which signals the current thread after each period of its CPU time, returning -1 (setting errno) on failure:
+static int Ruby_Profiler_Sampler_create_timer(uint64_t generation, double frequency) {
+	struct Ruby_Profiler_Sampler_Timer *timer = NULL;
+	uint64_t tid = Ruby_Profiler_Registry_tid();
+	
+	for (size_t i = 0; i < RUBY_PROFILER_SAMPLER_MAXIMUM_TIMERS && !timer; i++) {
+		if (!ruby_profiler_sampler_timers[i].generation) {
+			timer = &ruby_profiler_sampler_timers[i];
+		}
+	}
+	
+	if (!timer) {
+		errno = EAGAIN;
+		return -1;
+	}
+	
+	// The signal handler reads thread-local variables, which may be allocated on first use, which isn't async-signal-safe, so make sure they are allocated first:
+	*(struct Ruby_Profiler_State * volatile *)&ruby_profiler_state;
+	
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event.sigev_notify_thread_id = (pid_t)tid;
+	
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer->timer) == -1) {
+		return -1;
+	}
+	
+	long interval = (long)(1e9 / frequency);
+	struct itimerspec specification = {
+		.it_interval = {interval / 1000000000L, interval % 1000000000L},
+		.it_value = {interval / 1000000000L, interval % 1000000000L},
+	};
+	
+	if (timer_settime(timer->timer, 0, &specification, NULL) == -1) {
+		int error = errno;
+		timer_delete(timer->timer);
+		errno = error;
+		
+		return -1;
+	}
+	
+	timer->tid = tid;
+	timer->generation = generation;
+	
+	pthread_once(&ruby_profiler_sampler_key_once, Ruby_Profiler_Sampler_key_create);
+	pthread_setspecific(ruby_profiler_sampler_key, timer);
+	
+	return 0;
+}
+
+// Arm the current thread's timer, returning -1 (setting errno) on failure:
+static int Ruby_Profiler_Sampler_arm_current(void) {
+	int result = 0;
+	
+	pthread_mutex_lock(&ruby_profiler_sampler_mutex);
+	
+	uint64_t generation = atomic_load_explicit(&ruby_profiler_sampler_generation, memory_order_relaxed);
+	struct Ruby_Profiler_Sampler *sampler = atomic_load_explicit(&ruby_profiler_sampler_running, memory_order_relaxed);
+	
+	if ((generation & 1) && sampler && ruby_profiler_sampler_armed != generation) {
+		// Don't retry on failure, since this is called whenever the thread resumes:
+		ruby_profiler_sampler_armed = generation;
+		result = Ruby_Profiler_Sampler_create_timer(generation, sampler->frequency);
+	}
+	
+	pthread_mutex_unlock(&ruby_profiler_sampler_mutex);
+	
+	return result;
+}
+
+void Ruby_Profiler_Sampler_arm_slow(void) {
+	Ruby_Profiler_Sampler_arm_current();
+}
+
+// Stop the running sampler, deleting every timer, and waiting for signal handlers using it to finish:
+static void Ruby_Profiler_Sampler_disarm(void) {
+	pthread_mutex_lock(&ruby_profiler_sampler_mutex);
+	
+	atomic_store(&ruby_profiler_sampler_running, NULL);
+	atomic_fetch_add_explicit(&ruby_profiler_sampler_generation, 1, memory_order_relaxed);
+	
+	for (size_t i = 0; i < RUBY_PROFILER_SAMPLER_MAXIMUM_TIMERS; i++) {
+		struct Ruby_Profiler_Sampler_Timer *timer = &ruby_profiler_sampler_timers[i];
+		
+		if (timer->generation) {
+			timer_delete(timer->timer);
+			timer->generation = 0;
+		}
+	}
+	
+	pthread_mutex_unlock(&ruby_profiler_sampler_mutex);
+	
+	Ruby_Profiler_Sampler_synchronize();
+}
+
+void Ruby_Profiler_Sampler_synchronize(void) {
+	while (atomic_load(&ruby_profiler_sampler_handlers)) {
+		sched_yield();
+	}
+}
+
+// Hold the mutex across fork, so that the child doesn't inherit it locked, or the timers half updated:
+static void Ruby_Profiler_Sampler_atfork_prepare(void) {
+	pthread_mutex_lock(&ruby_profiler_sampler_mutex);
+}
+
+static void Ruby_Profiler_Sampler_atfork_parent(void) {
+	pthread_mutex_unlock(&ruby_profiler_sampler_mutex);
+}
+
+// Timers aren't inherited by the child, and only the forking thread exists in it, so forget the timers of the parent (without deleting them, since their IDs may be reused by the child), and arm the forking thread again if a sampler is running:
+static void Ruby_Profiler_Sampler_atfork_child(void) {
+	for (size_t i = 0; i < RUBY_PROFILER_SAMPLER_MAXIMUM_TIMERS; i++) {
+		ruby_profiler_sampler_timers[i].generation = 0;
+	}
+	
+	// Signal handlers which were running on other threads no longer exist:
+	atomic_store(&ruby_profiler_sampler_handlers, 0);
+	ruby_profiler_sampler_armed = 0;
+	
+	pthread_mutex_unlock(&ruby_profiler_sampler_mutex);
+	
+	// Other threads are armed when they are created and first acquire the GVL:
+	Ruby_Profiler_Sampler_arm_current();
+}
+
+#else
+
+void Ruby_Profiler_Sampler_arm_slow(void) {
+}
+
+void Ruby_Profiler_Sampler_label_slow(struct Ruby_Profiler_State *state) {
+}
+
+void Ruby_Profiler_Sampler_synchronize(void) {
+}
+
+#endif
+
+// Create a sampler which counts samples against the values of the given key, e.g. `Sampler.new(:endpoint, frequency: 99, capacity: 1024)`. The capacity is the number of distinct values which can be counted (rounded up to a power of 2).
+static VALUE Ruby_Profiler_Sampler_initialize(int argc, VALUE *argv, VALUE self) {
+	struct Ruby_Profiler_Sampler *sampler;
+	TypedData_Get_Struct(self, struct Ruby_Profiler_Sampler, &Ruby_Profiler_Sampler_Type, sampler);
+	
+	if (sampler->entries) {
+		rb_raise(rb_eRuntimeError, "Sampler already initialized!");
+	}
+	
+	VALUE key, options = Qnil;
+	rb_scan_args(argc, argv, "1:", &key, &options);
+	
+	if (!RB_SYMBOL_P(key)) {
+		rb_raise(rb_eTypeError, "State keys must be symbols, got %s", rb_obj_classname(key));
+	}
+	
+	ID keywords[2] = {rb_intern("frequency"), rb_intern("capacity")};
+	VALUE values[2] = {Qundef, Qundef};
+	
+	if (!RB_NIL_P(options)) {
+		rb_get_kwargs(options, keywords, 0, 2, values);
+	}
+	
+	double frequency = values[0] == Qundef ? 99.0 : NUM2DBL(values[0]);
+	long capacity = values[1] == Qundef ? RUBY_PROFILER_SAMPLER_DEFAULT_CAPACITY : NUM2LONG(values[1]);
+	
+	if (!(frequency > 0 && frequency <= 1e6)) {
+		rb_raise(rb_eArgError, "Sampler frequency must be between 0 and 1000000 Hz!");
+	}
+	
+	if (capacity < 1) {
+		rb_raise(rb_eArgError, "Sampler capacity must be positive!");
+	}
+	
+	sampler->key = rb_sym2id(key);
+	sampler->frequency = frequency;
+	sampler->capacity = Ruby_Profiler_State_round_capacity((size_t)capacity);
+	sampler->entries = calloc(sampler->capacity, sizeof(struct Ruby_Profiler_Sampler_Entry));
+	
+	if (!sampler->entries) {
+		rb_raise(rb_eNoMemError, "Failed to allocate sampler!");
+	}
+	
+	return self;
+}
+
+// Start sampling every thread which runs Ruby code. Threads other than the current one are sampled from when they next acquire the GVL, and their values are labelled from when they next publish a state (until then, only values which can be identified from the table are counted, see `sampler.h`).
+static VALUE Ruby_Profiler_Sampler_start(VALUE self) {
+#if defined(RUBY_PROFILER_SAMPLER)
+	struct Ruby_Profiler_Sampler *sampler = Ruby_Profiler_Sampler_get(self);
+	
+	if (ruby_profiler_sampler_current == self) {
+		return self;
+	}
+	
+	if (!RB_NIL_P(ruby_profiler_sampler_current)) {
+		rb_raise(rb_eRuntimeError, "Another sampler is already running!");
+	}
+	
+	Ruby_Profiler_Sampler_install();
+	
+	// Install the thread event hooks, which arm the timers of other threads:
+	Ruby_Profiler_activate();
+	
+	ruby_profiler_sampler_current = self;
+	
+	pthread_mutex_lock(&ruby_profiler_sampler_mutex);
+	atomic_store(&ruby_profiler_sampler_running, sampler);
+	atomic_fetch_add_explicit(&ruby_profiler_sampler_generation, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&ruby_profiler_sampler_mutex);
+	
+	if (Ruby_Profiler_Sampler_arm_current() == -1) {
+		int error = errno;
+		
+		Ruby_Profiler_Sampler_disarm();
+		ruby_profiler_sampler_current = Qnil;
+		
+		errno = error;
+		rb_sys_fail("timer_create");
+	}
+	
+	Ruby_Profiler_Sampler_label(ruby_profiler_state);
+	
+	return self;
+#else
+	rb_raise(rb_eNotImpError, "Sampling requires Linux!");
+#endif
+}
+
+// Stop sampling. The samples counted so far are kept.
+static VALUE Ruby_Profiler_Sampler_stop(VALUE self) {
+	Ruby_Profiler_Sampler_get(self);
+	
+#if defined(RUBY_PROFILER_SAMPLER)
+	if (ruby_profiler_sampler_current == self) {
+		Ruby_Profiler_Sampler_disarm();
+		ruby_profiler_sampler_current = Qnil;
+	}
+#endif
+	
+	return self;
+}
+
+static VALUE Ruby_Profiler_Sampler_running_p(VALUE self) {
+	return ruby_profiler_sampler_current == self ? Qtrue : Qfalse;
+}
+
+static VALUE Ruby_Profiler_Sampler_key(VALUE self) {
+	return ID2SYM(Ruby_Profiler_Sampler_get(self)->key);
+}
+
+static VALUE Ruby_Profiler_Sampler_frequency(VALUE self) {
+	return DBL2NUM(Ruby_Profiler_Sampler_get(self)->frequency);
+}
+
+static VALUE Ruby_Profiler_Sampler_capacity(VALUE self) {
+	return SIZET2NUM(Ruby_Profiler_Sampler_get(self)->capacity);
+}
+
+// Get the label of an entry (Qundef if it has none):
+static VALUE Ruby_Profiler_Sampler_Entry_label(struct Ruby_Profiler_Sampler_Entry *entry) {
+	if (entry->value != Qundef) {
+		return entry->value;
+	}
+	
+	const struct Ruby_Profiler_Snapshot *snapshot = &entry->snapshot;
+	int64_t integer;
+	ID id;
+	
+	switch (snapshot->type & ~RUBY_PROFILER_SNAPSHOT_TRUNCATED) {
+		case RUBY_PROFILER_SNAPSHOT_STRING:
+			return rb_utf8_str_new((const char*)snapshot->data, snapshot->length);
+		case RUBY_PROFILER_SNAPSHOT_SYMBOL:
+			// Only use existing symbols, since interning every distinct (possibly truncated) name would create symbols which are never collected:
+			if (!(snapshot->type & RUBY_PROFILER_SNAPSHOT_TRUNCATED) && (id = rb_check_id_cstr((const char*)snapshot->data, snapshot->length, rb_utf8_encoding()))) {
+				return ID2SYM(id);
+			}
+			
+			return rb_str_freeze(rb_utf8_str_new((const char*)snapshot->data, snapshot->length));
+		case RUBY_PROFILER_SNAPSHOT_INTEGER:
+			memcpy(&integer, snapshot->data, sizeof(integer));
+			return LL2NUM(integer);
+	}
+	
+	return Qundef;
+}
+
+// Count the samples of a sampler which have a label, by label, adding the others to `unknown` (if given):
+static VALUE Ruby_Profiler_Sampler_count_labels(struct Ruby_Profiler_Sampler *sampler, uint64_t *unknown) {
+	VALUE samples = rb_hash_new();
+	
+	for (size_t i = 0; i < sampler->capacity; i++) {
+		struct Ruby_Profiler_Sampler_Entry *entry = &sampler->entries[i];
+		
+		// Entries which are still being stored by a signal handler are counted next time:
+		if (!atomic_load_explicit(&entry->ready, memory_order_acquire)) continue;
+		
+		uint64_t count = atomic_load_explicit(&entry->count, memory_order_relaxed);
+		VALUE label = Ruby_Profiler_Sampler_Entry_label(entry);
+		
+		if (label == Qundef) {
+			if (unknown) *unknown += count;
+			continue;
+		}
+		
+		// Values with truncated snapshots may share a label:
+		VALUE total = rb_hash_lookup2(samples, label, INT2FIX(0));
+		rb_hash_aset(samples, label, rb_funcall(total, '+', 1, ULL2NUM(count)));
+	}
+	
+	return samples;
+}
+
+// Get the number of samples counted against each value of the key, with samples that had no value (or no state) counted against nil, e.g. `{"/users" => 12, nil => 3}`.
+static VALUE Ruby_Profiler_Sampler_samples(VALUE self) {
+	struct Ruby_Profiler_Sampler *sampler = Ruby_Profiler_Sampler_get(self);
+	
+	VALUE samples = Ruby_Profiler_Sampler_count_labels(sampler, NULL);
+	uint64_t missing = atomic_load_explicit(&sampler->missing, memory_order_relaxed);
+	
+	if (missing) {
+		VALUE total = rb_hash_lookup2(samples, Qnil, INT2FIX(0));
+		rb_hash_aset(samples, Qnil, rb_funcall(total, '+', 1, ULL2NUM(missing)));
+	}
+	
+	return samples;
+}
+
+// The total number of samples taken.
+static VALUE Ruby_Profiler_Sampler_total(VALUE self) {
+	return ULL2NUM(atomic_load_explicit(&Ruby_Profiler_Sampler_get(self)->total, memory_order_relaxed));
+}
+
+// The number of samples whose value couldn't be identified (e.g. a String in a state created without a fingerprint or snapshot).
+static VALUE Ruby_Profiler_Sampler_unknown(VALUE self) {
+	struct Ruby_Profiler_Sampler *sampler = Ruby_Profiler_Sampler_get(self);
+	uint64_t unknown = atomic_load_explicit(&sampler->unknown, memory_order_relaxed);
+	
+	Ruby_Profiler_Sampler_count_labels(sampler, &unknown);
+	
+	return ULL2NUM(unknown);
+}
+
+// The number of samples which couldn't be counted, because there were more distinct values than the capacity, or the state was being changed in place.
+static VALUE Ruby_Profiler_Sampler_dropped(VALUE self) {
+	return ULL2NUM(atomic_load_explicit(&Ruby_Profiler_Sampler_get(self)->dropped, memory_order_relaxed));
+}
+
+// Whether sampling is supported on this platform.
+static VALUE Ruby_Profiler_Sampler_s_supported_p(VALUE klass) {
+#if defined(RUBY_PROFILER_SAMPLER)
+	return Qtrue;
+#else
+	return Qfalse;
+#endif
+}
+
+void Init_Ruby_Profiler_Sampler(VALUE Ruby_Profiler) {
+	rb_global_variable(&ruby_profiler_sampler_current);
+	
+#if defined(RUBY_PROFILER_SAMPLER)
+	pthread_atfork(Ruby_Profiler_Sampler_atfork_prepare, Ruby_Profiler_Sampler_atfork_parent, Ruby_Profiler_Sampler_atfork_child);
+#endif
+	
+	VALUE Ruby_Profiler_Sampler = rb_define_class_under(Ruby_Profiler, "Sampler", rb_cObject);
+	rb_define_alloc_func(Ruby_Profiler_Sampler, Ruby_Profiler_Sampler_allocate);
+	
+	rb_define_const(Ruby_Profiler_Sampler, "DEFAULT_CAPACITY", INT2NUM(RUBY_PROFILER_SAMPLER_DEFAULT_CAPACITY));
+	
+	rb_define_singleton_method(Ruby_Profiler_Sampler, "supported?", Ruby_Profiler_Sampler_s_supported_p, 0);
+	
+	rb_define_method(Ruby_Profiler_Sampler, "initialize", Ruby_Profiler_Sampler_initialize, -1);
+	rb_define_method(Ruby_Profiler_Sampler, "start", Ruby_Profiler_Sampler_start, 0);
+	rb_define_method(Ruby_Profiler_Sampler, "stop", Ruby_Profiler_Sampler_stop, 0);
+	rb_define_method(Ruby_Profiler_Sampler, "running?", Ruby_Profiler_Sampler_running_p, 0);
+	rb_define_method(Ruby_Profiler_Sampler, "key", Ruby_Profiler_Sampler_key, 0);
+	rb_define_method(Ruby_Profiler_Sampler, "frequency", Ruby_Profiler_Sampler_frequency, 0);
+	rb_define_method(Ruby_Profiler_Sampler, "capacity", Ruby_Profiler_Sampler_capacity, 0);
+	rb_define_method(Ruby_Profiler_Sampler, "samples", Ruby_Profiler_Sampler_samples, 0);
+	rb_define_method(Ruby_Profiler_Sampler, "total", Ruby_Profiler_Sampler_total, 0);
+	rb_define_method(Ruby_Profiler_Sampler, "unknown", Ruby_Profiler_Sampler_unknown, 0);
+	rb_define_method(Ruby_Profiler_Sampler, "dropped", Ruby_Profiler_Sampler_dropped, 0);
+}
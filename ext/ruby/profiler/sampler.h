@@ -0,0 +1,50 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+#include <stdatomic.h>
+
+struct Ruby_Profiler_State;
+
+// A sampling profiler which doesn't need BPF: every thread which runs Ruby code has a timer measuring its CPU time (`timer_create(CLOCK_THREAD_CPUTIME_ID)`), which sends it `SIGPROF` at the sampler's frequency. The signal handler runs on the thread being sampled, so it reads `ruby_profiler_state` directly, looks up the sampler's key, and counts the sample against the value in a preallocated table, without allocating, locking or calling into Ruby.
+//
+// Values are identified without dereferencing Ruby objects: whenever a thread publishes a state while a sampler is running, the fingerprint and snapshot of the value of the sampler's key are computed into a thread-local label (see `Ruby_Profiler_Sampler_label`), which the signal handler uses while the state is unchanged. Otherwise, the value is identified from the table: by its fingerprint (see `State.fingerprint=`), otherwise by a fingerprint of its snapshot (see `State.snapshot=`), otherwise by the value itself if it is an immediate (e.g. an Integer or a static Symbol). Other values are counted as unknown.
+//
+// Only supported on Linux. Only one sampler can run at a time, since `SIGPROF` is process-wide.
+
+// Number of entries in the table of a sampler, by default (must be a power of 2):
+#define RUBY_PROFILER_SAMPLER_DEFAULT_CAPACITY 1024
+
+// Maximum number of native threads with timers at the same time:
+#define RUBY_PROFILER_SAMPLER_MAXIMUM_TIMERS 1024
+
+extern _Atomic uint64_t ruby_profiler_sampler_generation;
+extern _Thread_local uint64_t ruby_profiler_sampler_armed;
+
+void Ruby_Profiler_Sampler_arm_slow(void);
+
+// Start sampling the current thread, if a sampler is running and the thread isn't already being sampled. Called whenever a Ruby thread starts running on a native thread (see thread.h).
+static inline void Ruby_Profiler_Sampler_arm(void) {
+	// The generation is odd while a sampler is running:
+	uint64_t generation = atomic_load_explicit(&ruby_profiler_sampler_generation, memory_order_relaxed);
+	
+	if (RB_UNLIKELY((generation & 1) && ruby_profiler_sampler_armed != generation)) {
+		Ruby_Profiler_Sampler_arm_slow();
+	}
+}
+
+void Ruby_Profiler_Sampler_label_slow(struct Ruby_Profiler_State *state);
+
+// Label the value of the running sampler's key in a state which the current thread is publishing (NULL for none), unless it is already labelled. This must be called with the GVL unless the state is NULL, and does nothing unless a sampler is running.
+static inline void Ruby_Profiler_Sampler_label(struct Ruby_Profiler_State *state) {
+	if (RB_UNLIKELY(state && (atomic_load_explicit(&ruby_profiler_sampler_generation, memory_order_relaxed) & 1))) {
+		Ruby_Profiler_Sampler_label_slow(state);
+	}
+}
+
+// Wait for signal handlers which may be reading the states of other threads to finish, e.g. after they stopped publishing states which are about to be freed.
+void Ruby_Profiler_Sampler_synchronize(void);
+
+void Init_Ruby_Profiler_Sampler(VALUE Ruby_Profiler);
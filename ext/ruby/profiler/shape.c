@@ -0,0 +1,179 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "shape.h"
+#include "state.h"
+
+#include <stdlib.h>
+
+static VALUE Ruby_Profiler_State_Shape = Qnil;
+
+// The class of states created by shapes:
+static VALUE Ruby_Profiler_State_Shape_state_class = Qnil;
+
+// A shape fixes the key layout of a state ahead of time. The template table has every key inserted at its final slot (with nil values, and including the key index if any), and `slots` maps each key (in declaration order) to that slot. Creating a state from a shape is then a copy of the template followed by a store of each value, with no hashing or probing.
+struct Ruby_Profiler_Shape {
+	// Template table with keys placed and nil values:
+	struct Ruby_Profiler_State *template;
+	
+	// Number of keys:
+	size_t count;
+	
+	// Slot index for each key, in declaration order:
+	size_t slots[];
+};
+
+static void Ruby_Profiler_Shape_free(void *ptr) {
+	struct Ruby_Profiler_Shape *shape = (struct Ruby_Profiler_Shape*)ptr;
+	
+	// Handle NULL (deferred allocation):
+	if (!shape) {
+		return;
+	}
+	
+	Ruby_Profiler_State_free_table(shape->template);
+	free(shape);
+}
+
+static size_t Ruby_Profiler_Shape_memsize(const void *ptr) {
+	const struct Ruby_Profiler_Shape *shape = (const struct Ruby_Profiler_Shape*)ptr;
+	
+	// Handle NULL (deferred allocation)
+	if (!shape) {
+		return 0;
+	}
+	
+	return sizeof(*shape) + (shape->count * sizeof(size_t)) + Ruby_Profiler_State_table_size(shape->template);
+}
+
+static const rb_data_type_t Ruby_Profiler_Shape_Type = {
+	.wrap_struct_name = "Ruby::Profiler::State::Shape",
+	.function = {
+		// Keys are IDs and values are nil, so there is nothing to mark:
+		.dfree = Ruby_Profiler_Shape_free,
+		.dsize = Ruby_Profiler_Shape_memsize,
+	},
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+};
+
+static struct Ruby_Profiler_Shape *Ruby_Profiler_Shape_get(VALUE self) {
+	struct Ruby_Profiler_Shape *shape;
+	TypedData_Get_Struct(self, struct Ruby_Profiler_Shape, &Ruby_Profiler_Shape_Type, shape);
+	
+	if (!shape) {
+		rb_raise(rb_eRuntimeError, "Shape not initialized!");
+	}
+	
+	return shape;
+}
+
+static VALUE Ruby_Profiler_Shape_allocate(VALUE klass) {
+	// Defer allocation until initialize when we know the number of keys
+	return TypedData_Wrap_Struct(klass, &Ruby_Profiler_Shape_Type, NULL);
+}
+
+static VALUE Ruby_Profiler_Shape_initialize(int argc, VALUE *argv, VALUE self) {
+	struct Ruby_Profiler_Shape *shape;
+	TypedData_Get_Struct(self, struct Ruby_Profiler_Shape, &Ruby_Profiler_Shape_Type, shape);
+	
+	if (shape) {
+		rb_raise(rb_eRuntimeError, "Shape already initialized!");
+	}
+	
+	size_t count = (size_t)argc;
+	size_t capacity = Ruby_Profiler_State_round_capacity(count);
+	
+	shape = (struct Ruby_Profiler_Shape*)calloc(1, sizeof(struct Ruby_Profiler_Shape) + (count * sizeof(size_t)));
+	
+	if (!shape) {
+		rb_raise(rb_eNoMemError, "Failed to allocate shape!");
+	}
+	
+	shape->template = Ruby_Profiler_State_allocate_table(capacity);
+	
+	if (!shape->template) {
+		free(shape);
+		rb_raise(rb_eNoMemError, "Failed to allocate shape!");
+	}
+	
+	// Update TypedData pointer (so the shape is freed if we raise below):
+	DATA_PTR(self) = shape;
+	
+	for (size_t i = 0; i < count; i++) {
+		VALUE key = argv[i];
+		
+		// Keys must be symbols - raise TypeError if not
+		if (!RB_TYPE_P(key, T_SYMBOL)) {
+			rb_raise(rb_eTypeError, "State keys must be symbols, got %s", rb_obj_classname(key));
+		}
+		
+		ID id = rb_sym2id(key);
+		
+		if (Ruby_Profiler_State_find_pair(shape->template, id)) {
+			rb_raise(rb_eArgError, "Duplicate key in shape: %"PRIsVALUE, key);
+		}
+		
+		Ruby_Profiler_State_insert_pair(shape->template, id, Qnil);
+		
+		// Record where the key ended up:
+		shape->slots[i] = Ruby_Profiler_State_find_pair(shape->template, id) - shape->template->pairs;
+		shape->count++;
+	}
+	
+	return self;
+}
+
+// Create a new state from values given in the same order as the shape's keys.
+static VALUE Ruby_Profiler_Shape_new(int argc, VALUE *argv, VALUE self) {
+	struct Ruby_Profiler_Shape *shape = Ruby_Profiler_Shape_get(self);
+	
+	if ((size_t)argc != shape->count) {
+		rb_raise(rb_eArgError, "wrong number of values (given %d, expected %zu)", argc, shape->count);
+	}
+	
+	struct Ruby_Profiler_State *template = shape->template;
+	
+	if (shape->count == 0) {
+		return rb_class_new_instance(0, NULL, Ruby_Profiler_State_Shape_state_class);
+	}
+	
+	struct Ruby_Profiler_State *state;
+	VALUE state_value = Ruby_Profiler_State_make(Ruby_Profiler_State_Shape_state_class, template->capacity, &state);
+	
+	Ruby_Profiler_State_copy_table(state, template);
+	
+	for (size_t i = 0; i < shape->count; i++) {
+		Ruby_Profiler_State_set_value(state, shape->slots[i], argv[i]);
+	}
+	
+	return state_value;
+}
+
+static VALUE Ruby_Profiler_Shape_keys(VALUE self) {
+	struct Ruby_Profiler_Shape *shape = Ruby_Profiler_Shape_get(self);
+	VALUE keys = rb_ary_new_capa((long)shape->count);
+	
+	for (size_t i = 0; i < shape->count; i++) {
+		rb_ary_push(keys, ID2SYM(shape->template->pairs[shape->slots[i]].key));
+	}
+	
+	return keys;
+}
+
+static VALUE Ruby_Profiler_Shape_size(VALUE self) {
+	struct Ruby_Profiler_Shape *shape = Ruby_Profiler_Shape_get(self);
+	
+	return SIZET2NUM(shape->count);
+}
+
+void Init_Ruby_Profiler_Shape(VALUE Ruby_Profiler_State) {
+	Ruby_Profiler_State_Shape_state_class = Ruby_Profiler_State;
+	
+	Ruby_Profiler_State_Shape = rb_define_class_under(Ruby_Profiler_State, "Shape", rb_cObject);
+	rb_define_alloc_func(Ruby_Profiler_State_Shape, Ruby_Profiler_Shape_allocate);
+	
+	rb_define_method(Ruby_Profiler_State_Shape, "initialize", Ruby_Profiler_Shape_initialize, -1);
+	rb_define_method(Ruby_Profiler_State_Shape, "new", Ruby_Profiler_Shape_new, -1);
+	rb_define_method(Ruby_Profiler_State_Shape, "keys", Ruby_Profiler_Shape_keys, 0);
+	rb_define_method(Ruby_Profiler_State_Shape, "size", Ruby_Profiler_Shape_size, 0);
+}
@@ -0,0 +1,190 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// A free block, linked through its first word:
+struct Ruby_Profiler_Slab_Block {
+	struct Ruby_Profiler_Slab_Block *next;
+};
+
+struct Ruby_Profiler_Slab_Class {
+	// Size of each block in bytes (fixed by the first allocation):
+	size_t size;
+	
+	// Global free list:
+	struct Ruby_Profiler_Slab_Block *free;
+	
+	// Number of slabs allocated for this class:
+	size_t slabs;
+	
+	// Number of blocks carved from those slabs:
+	size_t blocks;
+	
+	// Number of blocks currently allocated (updated without the lock):
+	_Atomic size_t allocated;
+};
+
+struct Ruby_Profiler_Slab_Cache {
+	struct Ruby_Profiler_Slab_Block *free[RUBY_PROFILER_SLAB_CLASSES];
+	size_t count[RUBY_PROFILER_SLAB_CLASSES];
+	
+	// Whether the cache will be flushed when the thread exits:
+	int registered;
+};
+
+static struct Ruby_Profiler_Slab_Class ruby_profiler_slab_classes[RUBY_PROFILER_SLAB_CLASSES];
+static pthread_mutex_t ruby_profiler_slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local struct Ruby_Profiler_Slab_Cache ruby_profiler_slab_cache;
+
+static pthread_once_t ruby_profiler_slab_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ruby_profiler_slab_key;
+
+// Move up to `count` blocks from the cache to the global free list. Must be called with the lock held.
+static void Ruby_Profiler_Slab_flush_locked(struct Ruby_Profiler_Slab_Cache *cache, size_t size_class, size_t count) {
+	struct Ruby_Profiler_Slab_Class *slab_class = &ruby_profiler_slab_classes[size_class];
+	
+	while (count-- > 0 && cache->free[size_class]) {
+		struct Ruby_Profiler_Slab_Block *block = cache->free[size_class];
+		cache->free[size_class] = block->next;
+		cache->count[size_class]--;
+		
+		block->next = slab_class->free;
+		slab_class->free = block;
+	}
+}
+
+// Return all cached blocks to the global free lists when a thread exits, so they can be reused by other threads:
+static void Ruby_Profiler_Slab_Cache_release(void *argument) {
+	struct Ruby_Profiler_Slab_Cache *cache = (struct Ruby_Profiler_Slab_Cache*)argument;
+	
+	pthread_mutex_lock(&ruby_profiler_slab_mutex);
+	for (size_t size_class = 0; size_class < RUBY_PROFILER_SLAB_CLASSES; size_class++) {
+		Ruby_Profiler_Slab_flush_locked(cache, size_class, cache->count[size_class]);
+	}
+	pthread_mutex_unlock(&ruby_profiler_slab_mutex);
+}
+
+static void Ruby_Profiler_Slab_key_create(void) {
+	pthread_key_create(&ruby_profiler_slab_key, Ruby_Profiler_Slab_Cache_release);
+}
+
+static void Ruby_Profiler_Slab_Cache_register(struct Ruby_Profiler_Slab_Cache *cache) {
+	if (cache->registered) return;
+	
+	pthread_once(&ruby_profiler_slab_key_once, Ruby_Profiler_Slab_key_create);
+	
+	// The destructor only runs for non-NULL values:
+	if (pthread_setspecific(ruby_profiler_slab_key, cache) == 0) {
+		cache->registered = 1;
+	}
+}
+
+// Refill the cache from the global free list, allocating a new slab if needed:
+static void Ruby_Profiler_Slab_refill(struct Ruby_Profiler_Slab_Cache *cache, size_t size_class, size_t size) {
+	struct Ruby_Profiler_Slab_Class *slab_class = &ruby_profiler_slab_classes[size_class];
+	
+	Ruby_Profiler_Slab_Cache_register(cache);
+	
+	pthread_mutex_lock(&ruby_profiler_slab_mutex);
+	
+	if (slab_class->size == 0) {
+		slab_class->size = size;
+	}
+	
+	if (!slab_class->free) {
+		// Carve a new slab into blocks:
+		size_t count = RUBY_PROFILER_SLAB_SIZE / size;
+		if (count == 0) count = 1;
+		
+		char *slab = malloc(count * size);
+		
+		if (slab) {
+			for (size_t i = count; i-- > 0;) {
+				struct Ruby_Profiler_Slab_Block *block = (struct Ruby_Profiler_Slab_Block*)(slab + (i * size));
+				block->next = slab_class->free;
+				slab_class->free = block;
+			}
+			
+			slab_class->slabs += 1;
+			slab_class->blocks += count;
+		}
+	}
+	
+	// Take half a cache worth of blocks, so that alternating allocations and frees don't hit the lock every time:
+	for (size_t i = 0; i < RUBY_PROFILER_SLAB_CACHE_LIMIT / 2 && slab_class->free; i++) {
+		struct Ruby_Profiler_Slab_Block *block = slab_class->free;
+		slab_class->free = block->next;
+		
+		block->next = cache->free[size_class];
+		cache->free[size_class] = block;
+		cache->count[size_class]++;
+	}
+	
+	pthread_mutex_unlock(&ruby_profiler_slab_mutex);
+}
+
+void *Ruby_Profiler_Slab_allocate(size_t size_class, size_t size) {
+	struct Ruby_Profiler_Slab_Cache *cache = &ruby_profiler_slab_cache;
+	
+	if (!cache->free[size_class]) {
+		Ruby_Profiler_Slab_refill(cache, size_class, size);
+		
+		if (!cache->free[size_class]) {
+			return NULL;
+		}
+	}
+	
+	struct Ruby_Profiler_Slab_Block *block = cache->free[size_class];
+	cache->free[size_class] = block->next;
+	cache->count[size_class]--;
+	
+	atomic_fetch_add_explicit(&ruby_profiler_slab_classes[size_class].allocated, 1, memory_order_relaxed);
+	
+	memset(block, 0, size);
+	
+	return block;
+}
+
+void Ruby_Profiler_Slab_free(size_t size_class, void *pointer) {
+	struct Ruby_Profiler_Slab_Cache *cache = &ruby_profiler_slab_cache;
+	struct Ruby_Profiler_Slab_Block *block = (struct Ruby_Profiler_Slab_Block*)pointer;
+	
+	// Blocks may be freed on a thread that never allocated any (e.g. by the garbage collector):
+	Ruby_Profiler_Slab_Cache_register(cache);
+	
+	block->next = cache->free[size_class];
+	cache->free[size_class] = block;
+	cache->count[size_class]++;
+	
+	atomic_fetch_sub_explicit(&ruby_profiler_slab_classes[size_class].allocated, 1, memory_order_relaxed);
+	
+	// Return half the cache to the global free list if it is full:
+	if (cache->count[size_class] > RUBY_PROFILER_SLAB_CACHE_LIMIT) {
+		pthread_mutex_lock(&ruby_profiler_slab_mutex);
+		Ruby_Profiler_Slab_flush_locked(cache, size_class, RUBY_PROFILER_SLAB_CACHE_LIMIT / 2);
+		pthread_mutex_unlock(&ruby_profiler_slab_mutex);
+	}
+}
+
+void Ruby_Profiler_Slab_statistics(struct Ruby_Profiler_Slab_Statistics *statistics) {
+	memset(statistics, 0, sizeof(*statistics));
+	
+	pthread_mutex_lock(&ruby_profiler_slab_mutex);
+	for (size_t size_class = 0; size_class < RUBY_PROFILER_SLAB_CLASSES; size_class++) {
+		struct Ruby_Profiler_Slab_Class *slab_class = &ruby_profiler_slab_classes[size_class];
+		size_t allocated = atomic_load_explicit(&slab_class->allocated, memory_order_relaxed);
+		
+		statistics->slabs += slab_class->slabs;
+		statistics->size += slab_class->blocks * slab_class->size;
+		statistics->allocated += allocated;
+		statistics->free += slab_class->blocks - allocated;
+	}
+	pthread_mutex_unlock(&ruby_profiler_slab_mutex);
+}
@@ -0,0 +1,40 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+
+// A slab allocator for fixed size blocks, organised into size classes. Each class has a global free list (protected by a mutex) which is refilled by carving up slabs, and each thread has a small cache of free blocks per class, so that allocating and freeing blocks usually takes no locks at all. Blocks from the same class are packed together in slabs, and slabs are never returned to the system.
+
+// Number of size classes:
+#define RUBY_PROFILER_SLAB_CLASSES 44
+
+// Size of each slab in bytes:
+#define RUBY_PROFILER_SLAB_SIZE (64 * 1024)
+
+// Maximum number of free blocks per class in each thread's cache:
+#define RUBY_PROFILER_SLAB_CACHE_LIMIT 32
+
+struct Ruby_Profiler_Slab_Statistics {
+	// Number of slabs allocated:
+	size_t slabs;
+	
+	// Total size of all slabs in bytes:
+	size_t size;
+	
+	// Number of blocks currently allocated:
+	size_t allocated;
+	
+	// Number of blocks currently free (including those in thread caches):
+	size_t free;
+};
+
+// Allocate a zeroed block of the given size from the given class (which must always be used with the same size), returning NULL on failure.
+void *Ruby_Profiler_Slab_allocate(size_t size_class, size_t size);
+
+// Return a block to the given class.
+void Ruby_Profiler_Slab_free(size_t size_class, void *block);
+
+// Get the statistics of all classes combined.
+void Ruby_Profiler_Slab_statistics(struct Ruby_Profiler_Slab_Statistics *statistics);
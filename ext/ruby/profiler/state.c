@@ -3,27 +3,146 @@
 
 #include "profiler.h"
 #include "state.h"
+#include "shape.h"
+#include "key_index.h"
+#include "slab.h"
+#include "symbols.h"
+#include "registry.h"
+#include "probes.h"
+#include "timeline.h"
+#include "cache.h"
+#include "fiber.h"
+#include "sampler.h"
 
 #include <ruby/internal/core/rhash.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 // Thread-local pointer to current state (public symbol for BPF access)
 _Thread_local struct Ruby_Profiler_State *ruby_profiler_state = NULL;
 
+// Thread-local sequence number for ruby_profiler_state (public symbol for BPF access)
+_Thread_local _Atomic uint64_t ruby_profiler_sequence = 0;
+
+// Thread-local pointer to the stack of the current fiber (public symbol for BPF access)
+_Thread_local struct Ruby_Profiler_Stack *ruby_profiler_stack = NULL;
+
+// ABI version (public symbol for BPF access)
+const uint32_t ruby_profiler_abi_version = RUBY_PROFILER_ABI_VERSION;
+
+// Whether CPU time is charged to states (see `State.cpu_time=`):
+int ruby_profiler_state_cpu_time = 0;
+
+_Thread_local struct Ruby_Profiler_State_Counters *ruby_profiler_counters = NULL;
+
+// The CPU time of the current thread when it was last charged:
+static _Thread_local uint64_t ruby_profiler_counters_time = 0;
+
+void Ruby_Profiler_State_publish(struct Ruby_Profiler_State *state, struct Ruby_Profiler_Stack *stack, uint64_t depth) {
+	// The label may be stale even if the state isn't (e.g. if a sampler started since the state was published):
+	Ruby_Profiler_Sampler_label(state);
+	
+	if (ruby_profiler_state == state && ruby_profiler_stack == stack && (!stack || stack->depth == depth)) {
+		return;
+	}
+	
+	// The registry mirrors the pointer for readers that can't resolve thread-local storage:
+	struct Ruby_Profiler_Registry_Entry *entry = Ruby_Profiler_Registry_current();
+	
+	// Only this thread writes the sequence numbers, so relaxed loads are sufficient:
+	uint64_t sequence = atomic_load_explicit(&ruby_profiler_sequence, memory_order_relaxed);
+	uint64_t entry_sequence = entry ? atomic_load_explicit(&entry->sequence, memory_order_relaxed) : 0;
+	
+	// Mark the pointer as changing (odd), and ensure that is visible before the pointer itself changes:
+	atomic_store_explicit(&ruby_profiler_sequence, sequence + 1, memory_order_relaxed);
+	if (entry) atomic_store_explicit(&entry->sequence, entry_sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	
+	ruby_profiler_state = state;
+	ruby_profiler_stack = stack;
+	if (stack) stack->depth = depth;
+	if (entry) atomic_store_explicit(&entry->state, state, memory_order_relaxed);
+	
+	// Mark the pointer as stable again (even), releasing the new pointer:
+	atomic_store_explicit(&ruby_profiler_sequence, sequence + 2, memory_order_release);
+	if (entry) atomic_store_explicit(&entry->sequence, entry_sequence + 2, memory_order_release);
+}
+
+// Replace a table in a stack (if any), e.g. when the table of a state is grown:
+static void Ruby_Profiler_Stack_replace(struct Ruby_Profiler_Stack *stack, struct Ruby_Profiler_State *old_state, struct Ruby_Profiler_State *state) {
+	if (!stack) return;
+	
+	for (uint64_t i = 0; i < stack->depth && i < RUBY_PROFILER_STACK_CAPACITY; i++) {
+		if (stack->states[i] == old_state) {
+			stack->states[i] = state;
+		}
+	}
+}
+
 VALUE Ruby_Profiler_State = Qnil;
 
-// Cached ID for @ruby_profiler_state instance variable
-ID id_ruby_profiler_state;
+// States with up to this many pairs are stored inline when created via `State.new`:
+#define RUBY_PROFILER_STATE_INLINE_CAPACITY 4
+
+// Tables up to this size (in bytes) are stored inline when the capacity is known at allocation (e.g. `State#with`), which keeps the object within the largest GC slot size:
+#define RUBY_PROFILER_STATE_INLINE_MAXIMUM 512
+
+// Each State object owns a handle which points to its table. Small tables are stored inline in the handle, and where supported (Ruby 3.3+) the handle itself is embedded in the object, so a small state occupies a single GC slot with no separate allocation. Larger tables are allocated separately.
+struct Ruby_Profiler_State_Handle {
+	// The table (NULL for an empty state), which may point to `storage`:
+	struct Ruby_Profiler_State *state;
+	
+	// The object which owns this handle:
+	VALUE self;
+	
+	// The object which owns `state->parent` (or Qfalse), which must outlive this state:
+	VALUE parent;
+	
+	// Whether the handle is embedded in the object (otherwise it was allocated separately by Ruby):
+	int embedded;
+	
+	// Whether other states have been derived from this one, in which case it can no longer be modified in place:
+	int derived;
+	
+	// Whether the address of the table has escaped (e.g. it was published by applying the state, or another state was derived from it), in which case the object must not be moved by compaction, since an inline table moves with an embedded handle (see `Ruby_Profiler_State_pin`):
+	int pinned;
+	
+	// Allocated the first time the state is charged for CPU time (NULL until then), so that it doesn't move with the object:
+	struct Ruby_Profiler_State_Counters *counters;
+	
+	// Tables replaced by growing this state in place, which may still be referenced by other threads, and are freed along with the state:
+	struct Ruby_Profiler_State **retired;
+	size_t retired_count;
+	
+	// Size of the inline storage in bytes:
+	size_t storage_size;
+	
+	// Inline storage for the table:
+	VALUE storage[];
+};
+
+static inline int Ruby_Profiler_State_Handle_inline_p(const struct Ruby_Profiler_State_Handle *handle) {
+	return handle->state == (const struct Ruby_Profiler_State*)handle->storage;
+}
 
 static void Ruby_Profiler_State_mark(void *ptr) {
-	struct Ruby_Profiler_State *state = (struct Ruby_Profiler_State*)ptr;
+	struct Ruby_Profiler_State_Handle *handle = (struct Ruby_Profiler_State_Handle*)ptr;
+	struct Ruby_Profiler_State *state = handle->state;
+	
+	if (handle->pinned) {
+		rb_gc_mark(handle->self);
+	}
 	
-	// Handle NULL (deferred allocation)
+	// Handle NULL (empty state)
 	if (!state) {
 		return;
 	}
 	
+	// A derived state refers to its parent's table by address, which is stable since the parent is pinned (see `derive`):
+	rb_gc_mark_movable(handle->parent);
+	
 	// Mark all VALUEs in pairs (iterate through capacity to find all non-empty slots)
 	for (size_t i = 0; i < state->capacity; i++) {
 		if (state->pairs[i].key != 0) {
@@ -33,13 +152,27 @@ static void Ruby_Profiler_State_mark(void *ptr) {
 }
 
 static void Ruby_Profiler_State_compact(void *ptr) {
-	struct Ruby_Profiler_State *state = (struct Ruby_Profiler_State*)ptr;
+	struct Ruby_Profiler_State_Handle *handle = (struct Ruby_Profiler_State_Handle*)ptr;
+	struct Ruby_Profiler_State *state = handle->state;
 	
-	// Handle NULL (deferred allocation)
+	// The object itself moves unless it was pinned (see above):
+	VALUE self = rb_gc_location(handle->self);
+	
+	// An inline table moves with an embedded handle, which is only possible if its address never escaped, so it can simply be followed:
+	if (handle->embedded && self != handle->self && (uintptr_t)state == (uintptr_t)handle->storage - self + handle->self) {
+		state = handle->state = (struct Ruby_Profiler_State*)handle->storage;
+	}
+	
+	handle->self = self;
+	
+	// Handle NULL (empty state)
 	if (!state) {
 		return;
 	}
 	
+	// Only the parent object may move, not its table (see above):
+	handle->parent = rb_gc_location(handle->parent);
+	
 	// Update all VALUE locations after GC compaction (iterate through capacity)
 	for (size_t i = 0; i < state->capacity; i++) {
 		if (state->pairs[i].key != 0) {
@@ -49,30 +182,62 @@ static void Ruby_Profiler_State_compact(void *ptr) {
 }
 
 static void Ruby_Profiler_State_free(void *ptr) {
-	struct Ruby_Profiler_State *state = (struct Ruby_Profiler_State*)ptr;
+	struct Ruby_Profiler_State_Handle *handle = (struct Ruby_Profiler_State_Handle*)ptr;
+	struct Ruby_Profiler_State *state = handle->state;
 	
-	// Handle NULL (deferred allocation):
-	if (!state) {
-		return;
+	if (state) {
+		// If this state is currently active, clear the thread-local pointer (before it's freed, so that readers can detect the change), keeping the enclosing states, which are still referenced by the fiber:
+		if (ruby_profiler_state == state) {
+			Ruby_Profiler_State_publish(NULL, ruby_profiler_stack, ruby_profiler_stack ? ruby_profiler_stack->depth : 0);
+		}
+		
+		RUBY_PROFILER_PROBE(free, state, Qnil);
+		
+		if (!Ruby_Profiler_State_Handle_inline_p(handle)) {
+			Ruby_Profiler_State_free_table(state);
+		}
 	}
 	
-	// If this state is currently active, clear the thread-local pointer
-	if (ruby_profiler_state == state) {
-		ruby_profiler_state = NULL;
+	if (ruby_profiler_fiber_source == handle->self) {
+		ruby_profiler_fiber_source = Qnil;
 	}
 	
-	free(state);
+	for (size_t i = 0; i < handle->retired_count; i++) {
+		Ruby_Profiler_State_free_table(handle->retired[i]);
+	}
+	free(handle->retired);
+	
+	// Threads which are still charging the counters (e.g. after the state was replaced on a running fiber) keep them alive until they next switch states:
+	Ruby_Profiler_State_Counters_release(handle->counters);
+	
+	// An embedded handle is freed along with the object:
+	if (!handle->embedded) {
+		ruby_xfree(handle);
+	}
 }
 
 static size_t Ruby_Profiler_State_memsize(const void *ptr) {
-	const struct Ruby_Profiler_State *state = (const struct Ruby_Profiler_State*)ptr;
+	const struct Ruby_Profiler_State_Handle *handle = (const struct Ruby_Profiler_State_Handle*)ptr;
+	size_t size = 0;
 	
-	// Handle NULL (deferred allocation)
-	if (!state) {
-		return 0;
+	// An embedded handle is accounted for as part of the object:
+	if (!handle->embedded) {
+		size += sizeof(*handle) + handle->storage_size;
+	}
+	
+	if (handle->state && !Ruby_Profiler_State_Handle_inline_p(handle)) {
+		size += Ruby_Profiler_State_table_size(handle->state);
+	}
+	
+	for (size_t i = 0; i < handle->retired_count; i++) {
+		size += Ruby_Profiler_State_table_size(handle->retired[i]);
+	}
+	
+	if (handle->counters) {
+		size += sizeof(*handle->counters);
 	}
 	
-	return sizeof(*state) + (state->capacity * sizeof(struct Ruby_Profiler_Pair));
+	return size;
 }
 
 const rb_data_type_t Ruby_Profiler_State_Type = {
@@ -83,17 +248,77 @@ const rb_data_type_t Ruby_Profiler_State_Type = {
 		.dfree = Ruby_Profiler_State_free,
 		.dsize = Ruby_Profiler_State_memsize,
 	},
+#ifdef HAVE_CONST_RUBY_TYPED_EMBEDDABLE
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_EMBEDDABLE,
+#else
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED,
+#endif
 };
 
+static struct Ruby_Profiler_State_Handle *Ruby_Profiler_State_get_handle(VALUE self) {
+	struct Ruby_Profiler_State_Handle *handle;
+	TypedData_Get_Struct(self, struct Ruby_Profiler_State_Handle, &Ruby_Profiler_State_Type, handle);
+	return handle;
+}
+
 struct Ruby_Profiler_State *Ruby_Profiler_State_get(VALUE self) {
-	struct Ruby_Profiler_State *state;
-	TypedData_Get_Struct(self, struct Ruby_Profiler_State, &Ruby_Profiler_State_Type, state);
-	return state;
+	return Ruby_Profiler_State_get_handle(self)->state;
+}
+
+void Ruby_Profiler_State_pin(VALUE self) {
+	Ruby_Profiler_State_get_handle(self)->pinned = 1;
+}
+
+struct Ruby_Profiler_State_Counters *Ruby_Profiler_State_counters(VALUE self) {
+	if (RB_NIL_P(self)) return NULL;
+	
+	struct Ruby_Profiler_State_Handle *handle = Ruby_Profiler_State_get_handle(self);
+	
+	if (!handle->counters) {
+		handle->counters = calloc(1, sizeof(struct Ruby_Profiler_State_Counters));
+		if (handle->counters) handle->counters->references = 1;
+	}
+	
+	return handle->counters;
+}
+
+void Ruby_Profiler_State_Counters_release(struct Ruby_Profiler_State_Counters *counters) {
+	if (!counters) return;
+	
+	// Charges to the counters must happen before they are freed by another thread:
+	if (atomic_fetch_sub_explicit(&counters->references, 1, memory_order_acq_rel) == 1) {
+		free(counters);
+	}
+}
+
+// Get the CPU time used by the current thread, in nanoseconds:
+static uint64_t Ruby_Profiler_State_thread_cpu_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void Ruby_Profiler_State_charge_slow(struct Ruby_Profiler_State_Counters *counters) {
+	if (!counters && !ruby_profiler_counters) return;
+	
+	uint64_t now = Ruby_Profiler_State_thread_cpu_time();
+	
+	if (ruby_profiler_counters) {
+		atomic_fetch_add_explicit(&ruby_profiler_counters->cpu_time, now - ruby_profiler_counters_time, memory_order_relaxed);
+	}
+	
+	if (ruby_profiler_counters != counters) {
+		if (counters) atomic_fetch_add_explicit(&counters->references, 1, memory_order_relaxed);
+		Ruby_Profiler_State_Counters_release(ruby_profiler_counters);
+	}
+	
+	ruby_profiler_counters = counters;
+	ruby_profiler_counters_time = now;
 }
 
 // Round up to next power of 2
-static size_t round_capacity_to_power_of_2(size_t capacity) {
+size_t Ruby_Profiler_State_round_capacity(size_t capacity) {
 	if (capacity == 0) return 1;
 	capacity--;
 	capacity |= capacity >> 1;
@@ -107,19 +332,302 @@ static size_t round_capacity_to_power_of_2(size_t capacity) {
 	return capacity + 1;
 }
 
+// Whether new tables include snapshots of their values (see `State.snapshot=`):
+static int ruby_profiler_state_snapshot = 0;
+
+// Whether new tables include fingerprints of their values (see `State.fingerprint=`):
+static int ruby_profiler_state_fingerprint = 0;
+
+static uint32_t Ruby_Profiler_State_flags_for(size_t capacity) {
+	uint32_t flags = RUBY_PROFILER_STATE_FLAG_HASH_MIXED;
+	
+	if (ruby_profiler_state_snapshot) {
+		flags |= RUBY_PROFILER_STATE_FLAG_SNAPSHOT;
+	}
+	
+	if (ruby_profiler_state_fingerprint) {
+		flags |= RUBY_PROFILER_STATE_FLAG_FINGERPRINT;
+	}
+	
+#ifdef RUBY_PROFILER_KEY_INDEX
+	if (capacity >= RUBY_PROFILER_STATE_KEY_INDEX_THRESHOLD) {
+		flags |= RUBY_PROFILER_STATE_FLAG_KEY_INDEX;
+	}
+#endif
+	
+	return flags;
+}
+
+static size_t Ruby_Profiler_State_table_size_for(size_t capacity, uint32_t flags) {
+	size_t size = sizeof(struct Ruby_Profiler_State) + (capacity * sizeof(struct Ruby_Profiler_Pair));
+	
+	if (flags & RUBY_PROFILER_STATE_FLAG_KEY_INDEX) {
+		size += capacity * sizeof(ID);
+	}
+	
+	if (flags & RUBY_PROFILER_STATE_FLAG_SNAPSHOT) {
+		size += capacity * sizeof(struct Ruby_Profiler_Snapshot);
+	}
+	
+	if (flags & RUBY_PROFILER_STATE_FLAG_FINGERPRINT) {
+		size += capacity * sizeof(uint64_t);
+	}
+	
+	return size;
+}
+
+size_t Ruby_Profiler_State_table_size(const struct Ruby_Profiler_State *state) {
+	return Ruby_Profiler_State_table_size_for(state->capacity, state->flags);
+}
+
+// Initialize the header of a table in zeroed memory:
+static struct Ruby_Profiler_State *Ruby_Profiler_State_initialize_table(void *memory, size_t capacity, uint32_t flags) {
+	struct Ruby_Profiler_State *state = (struct Ruby_Profiler_State*)memory;
+	
+	state->magic = RUBY_PROFILER_STATE_MAGIC;
+	state->version = RUBY_PROFILER_STATE_VERSION;
+	state->header_size = offsetof(struct Ruby_Profiler_State, pairs);
+	state->flags = flags;
+	state->size = 0;
+	state->capacity = capacity;
+	
+	return state;
+}
+
+// Tables are allocated from the slab allocator, with one size class per capacity (which is always a power of 2) up to 1024 pairs, for each combination of snapshots and fingerprints. Apart from those, the flags only depend on the capacity, so every table in a class has the same size. Larger tables are allocated directly.
+#define RUBY_PROFILER_STATE_SIZE_CLASSES (RUBY_PROFILER_SLAB_CLASSES / 4)
+
+static inline size_t Ruby_Profiler_State_size_class(size_t capacity, uint32_t flags) {
+	size_t size_class = 0;
+	
+	while (((size_t)1 << size_class) < capacity) {
+		size_class++;
+	}
+	
+	if (size_class >= RUBY_PROFILER_STATE_SIZE_CLASSES) {
+		return RUBY_PROFILER_SLAB_CLASSES;
+	}
+	
+	if (flags & RUBY_PROFILER_STATE_FLAG_SNAPSHOT) {
+		size_class += RUBY_PROFILER_STATE_SIZE_CLASSES;
+	}
+	
+	if (flags & RUBY_PROFILER_STATE_FLAG_FINGERPRINT) {
+		size_class += 2 * RUBY_PROFILER_STATE_SIZE_CLASSES;
+	}
+	
+	return size_class;
+}
+
+struct Ruby_Profiler_State *Ruby_Profiler_State_allocate_table(size_t capacity) {
+	uint32_t flags = Ruby_Profiler_State_flags_for(capacity);
+	size_t size = Ruby_Profiler_State_table_size_for(capacity, flags);
+	size_t size_class = Ruby_Profiler_State_size_class(capacity, flags);
+	void *memory;
+	
+	if (size_class < RUBY_PROFILER_SLAB_CLASSES) {
+		memory = Ruby_Profiler_Slab_allocate(size_class, size);
+	} else {
+		memory = calloc(1, size);
+	}
+	
+	if (!memory) {
+		return NULL;
+	}
+	
+	return Ruby_Profiler_State_initialize_table(memory, capacity, flags);
+}
+
+void Ruby_Profiler_State_free_table(struct Ruby_Profiler_State *state) {
+	size_t size_class = Ruby_Profiler_State_size_class(state->capacity, state->flags);
+	
+	if (size_class < RUBY_PROFILER_SLAB_CLASSES) {
+		Ruby_Profiler_Slab_free(size_class, state);
+	} else {
+		free(state);
+	}
+}
+
+void Ruby_Profiler_Snapshot_render(struct Ruby_Profiler_Snapshot *snapshot, VALUE value) {
+	const char *data = NULL;
+	size_t length = 0;
+	int64_t integer;
+	
+	memset(snapshot, 0, sizeof(*snapshot));
+	
+	if (RB_TYPE_P(value, T_STRING)) {
+		snapshot->type = RUBY_PROFILER_SNAPSHOT_STRING;
+		data = RSTRING_PTR(value);
+		length = RSTRING_LEN(value);
+	} else if (RB_TYPE_P(value, T_SYMBOL)) {
+		VALUE name = rb_sym2str(value);
+		
+		snapshot->type = RUBY_PROFILER_SNAPSHOT_SYMBOL;
+		data = RSTRING_PTR(name);
+		length = RSTRING_LEN(name);
+	} else if (RB_FIXNUM_P(value)) {
+		integer = (int64_t)FIX2LONG(value);
+		
+		snapshot->type = RUBY_PROFILER_SNAPSHOT_INTEGER;
+		data = (const char*)&integer;
+		length = sizeof(integer);
+	} else {
+		return;
+	}
+	
+	if (length > RUBY_PROFILER_SNAPSHOT_DATA_SIZE) {
+		snapshot->type |= RUBY_PROFILER_SNAPSHOT_TRUNCATED;
+		length = RUBY_PROFILER_SNAPSHOT_DATA_SIZE;
+	}
+	
+	memcpy(snapshot->data, data, length);
+	snapshot->length = (uint8_t)length;
+}
+
+uint64_t Ruby_Profiler_Fingerprint_compute(VALUE value) {
+	uint8_t type;
+	const char *data;
+	size_t length;
+	int64_t integer;
+	
+	if (RB_TYPE_P(value, T_STRING)) {
+		type = RUBY_PROFILER_SNAPSHOT_STRING;
+		data = RSTRING_PTR(value);
+		length = RSTRING_LEN(value);
+	} else if (RB_TYPE_P(value, T_SYMBOL)) {
+		VALUE name = rb_sym2str(value);
+		
+		type = RUBY_PROFILER_SNAPSHOT_SYMBOL;
+		data = RSTRING_PTR(name);
+		length = RSTRING_LEN(name);
+	} else if (RB_FIXNUM_P(value)) {
+		integer = (int64_t)FIX2LONG(value);
+		
+		type = RUBY_PROFILER_SNAPSHOT_INTEGER;
+		data = (const char*)&integer;
+		length = sizeof(integer);
+	} else {
+		return 0;
+	}
+	
+	uint64_t hash = Ruby_Profiler_Fingerprint_update(RUBY_PROFILER_FINGERPRINT_OFFSET, &type, 1);
+	hash = Ruby_Profiler_Fingerprint_update(hash, data, length);
+	
+	return hash ? hash : 1;
+}
+
+void Ruby_Profiler_State_set_value(struct Ruby_Profiler_State *state, size_t slot, VALUE value) {
+	state->pairs[slot].value = value;
+	
+	if (state->flags & RUBY_PROFILER_STATE_FLAG_SNAPSHOT) {
+		Ruby_Profiler_Snapshot_render(&Ruby_Profiler_State_snapshots(state)[slot], value);
+	}
+	
+	if (state->flags & RUBY_PROFILER_STATE_FLAG_FINGERPRINT) {
+		Ruby_Profiler_State_fingerprints(state)[slot] = Ruby_Profiler_Fingerprint_compute(value);
+	}
+}
+
+void Ruby_Profiler_State_copy_table(struct Ruby_Profiler_State *state, const struct Ruby_Profiler_State *source) {
+	// Slots only depend on the capacity, so the pairs can be copied verbatim, as can the key index (which is present for the same capacity):
+	memcpy(state->pairs, source->pairs, source->capacity * sizeof(struct Ruby_Profiler_Pair));
+	
+	if (state->flags & RUBY_PROFILER_STATE_FLAG_KEY_INDEX) {
+		memcpy(Ruby_Profiler_State_keys(state), Ruby_Profiler_State_keys((struct Ruby_Profiler_State*)source), source->capacity * sizeof(ID));
+	}
+	
+	// Snapshots and fingerprints may have been enabled since the source was created, in which case they are rendered again:
+	uint32_t sections = RUBY_PROFILER_STATE_FLAG_SNAPSHOT | RUBY_PROFILER_STATE_FLAG_FINGERPRINT;
+	
+	if ((state->flags & sections) == (source->flags & sections)) {
+		if (state->flags & RUBY_PROFILER_STATE_FLAG_SNAPSHOT) {
+			memcpy(Ruby_Profiler_State_snapshots(state), Ruby_Profiler_State_snapshots((struct Ruby_Profiler_State*)source), source->capacity * sizeof(struct Ruby_Profiler_Snapshot));
+		}
+		
+		if (state->flags & RUBY_PROFILER_STATE_FLAG_FINGERPRINT) {
+			memcpy(Ruby_Profiler_State_fingerprints(state), Ruby_Profiler_State_fingerprints((struct Ruby_Profiler_State*)source), source->capacity * sizeof(uint64_t));
+		}
+	} else if (state->flags & sections) {
+		for (size_t i = 0; i < state->capacity; i++) {
+			if (state->pairs[i].key != 0) {
+				Ruby_Profiler_State_set_value(state, i, state->pairs[i].value);
+			}
+		}
+	}
+	
+	state->size = source->size;
+}
+
+// Allocate a new state object with the given amount of inline storage (in bytes):
+static VALUE Ruby_Profiler_State_allocate_with_storage(VALUE klass, size_t storage_size) {
+	VALUE self = rb_data_typed_object_zalloc(klass, sizeof(struct Ruby_Profiler_State_Handle) + storage_size, &Ruby_Profiler_State_Type);
+	struct Ruby_Profiler_State_Handle *handle = Ruby_Profiler_State_get_handle(self);
+	
+	handle->self = self;
+#ifdef HAVE_CONST_RUBY_TYPED_EMBEDDABLE
+	handle->embedded = RTYPEDDATA_EMBEDDED_P(self);
+#endif
+	handle->storage_size = storage_size;
+	
+	return self;
+}
+
 static VALUE Ruby_Profiler_State_allocate(VALUE klass) {
-	// Defer allocation until initialize when we know the required capacity
-	return TypedData_Wrap_Struct(klass, &Ruby_Profiler_State_Type, NULL);
+	// The capacity isn't known until initialize, so reserve enough inline storage for a small table:
+	size_t capacity = RUBY_PROFILER_STATE_INLINE_CAPACITY;
+	
+	return Ruby_Profiler_State_allocate_with_storage(klass, Ruby_Profiler_State_table_size_for(capacity, Ruby_Profiler_State_flags_for(capacity)));
+}
+
+// Set up an empty table of the given capacity (must be a power of 2) for a handle, using the inline storage if it fits:
+static struct Ruby_Profiler_State *Ruby_Profiler_State_reserve(struct Ruby_Profiler_State_Handle *handle, size_t capacity) {
+	uint32_t flags = Ruby_Profiler_State_flags_for(capacity);
+	struct Ruby_Profiler_State *state;
+	
+	if (Ruby_Profiler_State_table_size_for(capacity, flags) <= handle->storage_size) {
+		// The inline storage is zeroed by allocation:
+		state = Ruby_Profiler_State_initialize_table(handle->storage, capacity, flags);
+	} else {
+		state = Ruby_Profiler_State_allocate_table(capacity);
+		
+		if (!state) {
+			rb_raise(rb_eNoMemError, "Failed to allocate state!");
+		}
+	}
+	
+	handle->state = state;
+	
+	return state;
+}
+
+// Allocate a new state object with an empty table of the given capacity (must be a power of 2):
+VALUE Ruby_Profiler_State_make(VALUE klass, size_t capacity, struct Ruby_Profiler_State **state) {
+	size_t size = Ruby_Profiler_State_table_size_for(capacity, Ruby_Profiler_State_flags_for(capacity));
+	
+	VALUE self = Ruby_Profiler_State_allocate_with_storage(klass, size <= RUBY_PROFILER_STATE_INLINE_MAXIMUM ? size : 0);
+	
+	*state = Ruby_Profiler_State_reserve(Ruby_Profiler_State_get_handle(self), capacity);
+	
+	return self;
 }
 
 // Find a pair by key using hash table lookup with linear probing
-static struct Ruby_Profiler_Pair *Ruby_Profiler_State_find_pair(struct Ruby_Profiler_State *state, ID key) {
+struct Ruby_Profiler_Pair *Ruby_Profiler_State_find_pair(struct Ruby_Profiler_State *state, ID key) {
 	if (key == 0 || state->capacity == 0) {
 		return NULL;
 	}
 	
+#ifdef RUBY_PROFILER_KEY_INDEX
+	if (state->flags & RUBY_PROFILER_STATE_FLAG_KEY_INDEX) {
+		// Probe the packed keys, 8 at a time, rather than the pairs:
+		size_t pos = Ruby_Profiler_Key_Index_find(Ruby_Profiler_State_keys(state), state->capacity, Ruby_Profiler_State_hash(key), key);
+		
+		return pos < state->capacity ? &state->pairs[pos] : NULL;
+	}
+#endif
+	
 	size_t mask = state->capacity - 1;  // Assumes power of 2
-	size_t idx = (size_t)key & mask;
+	size_t idx = Ruby_Profiler_State_hash(key) & mask;
 	
 	for (size_t i = 0; i < state->capacity; i++) {
 		size_t pos = (idx + i) & mask;
@@ -136,13 +644,13 @@ static struct Ruby_Profiler_Pair *Ruby_Profiler_State_find_pair(struct Ruby_Prof
 }
 
 // Insert or update a pair using hash table with linear probing
-static int Ruby_Profiler_State_insert_pair(struct Ruby_Profiler_State *state, ID key, VALUE value) {
+int Ruby_Profiler_State_insert_pair(struct Ruby_Profiler_State *state, ID key, VALUE value) {
 	if (key == 0) {
 		return 0;  // Invalid key
 	}
 	
 	size_t mask = state->capacity - 1;  // Assumes power of 2
-	size_t idx = (size_t)key & mask;
+	size_t idx = Ruby_Profiler_State_hash(key) & mask;
 	
 	// First, check if key already exists (update case)
 	for (size_t i = 0; i < state->capacity; i++) {
@@ -150,7 +658,7 @@ static int Ruby_Profiler_State_insert_pair(struct Ruby_Profiler_State *state, ID
 		
 		if (state->pairs[pos].key == key) {
 			// Update existing pair (doesn't require capacity check)
-			state->pairs[pos].value = value;
+			Ruby_Profiler_State_set_value(state, pos, value);
 			return 1;
 		}
 		if (state->pairs[pos].key == 0) {
@@ -160,8 +668,15 @@ static int Ruby_Profiler_State_insert_pair(struct Ruby_Profiler_State *state, ID
 			}
 			// Insert here
 			state->pairs[pos].key = key;
-			state->pairs[pos].value = value;
+			Ruby_Profiler_State_set_value(state, pos, value);
 			state->size++;
+			
+			// Make sure external readers can resolve the key:
+			Ruby_Profiler_Symbols_add(key);
+			
+			if (state->flags & RUBY_PROFILER_STATE_FLAG_KEY_INDEX) {
+				Ruby_Profiler_State_keys(state)[pos] = key;
+			}
 			return 1;
 		}
 	}
@@ -169,6 +684,63 @@ static int Ruby_Profiler_State_insert_pair(struct Ruby_Profiler_State *state, ID
 	return 0;  // Table full (no empty slot found)
 }
 
+// Find a pair by key, following the chain of parents
+const struct Ruby_Profiler_Pair *Ruby_Profiler_State_lookup(const struct Ruby_Profiler_State *state, ID key) {
+	for (; state; state = state->parent) {
+		struct Ruby_Profiler_Pair *pair = Ruby_Profiler_State_find_pair((struct Ruby_Profiler_State*)state, key);
+		
+		if (pair) {
+			return pair;
+		}
+	}
+	
+	return NULL;
+}
+
+// Count the distinct keys in a chain of states (a key in a derived state shadows the same key in its ancestors)
+size_t Ruby_Profiler_State_count(const struct Ruby_Profiler_State *state) {
+	if (!state->parent) {
+		return state->size;
+	}
+	
+	size_t count = 0;
+	
+	for (const struct Ruby_Profiler_State *level = state; level; level = level->parent) {
+		for (size_t i = 0; i < level->capacity; i++) {
+			ID key = level->pairs[i].key;
+			
+			if (key == 0) continue;
+			
+			// Only count the key if it isn't shadowed by a newer state:
+			const struct Ruby_Profiler_State *newer = state;
+			while (newer != level && !Ruby_Profiler_State_find_pair((struct Ruby_Profiler_State*)newer, key)) {
+				newer = newer->parent;
+			}
+			
+			if (newer == level) {
+				count++;
+			}
+		}
+	}
+	
+	return count;
+}
+
+// Insert all pairs from a chain of states into a table, oldest first so that newer values take precedence:
+static void Ruby_Profiler_State_flatten_into(struct Ruby_Profiler_State *table, const struct Ruby_Profiler_State *state) {
+	if (state->parent) {
+		Ruby_Profiler_State_flatten_into(table, state->parent);
+	}
+	
+	for (size_t i = 0; i < state->capacity; i++) {
+		if (state->pairs[i].key != 0) {
+			if (!Ruby_Profiler_State_insert_pair(table, state->pairs[i].key, state->pairs[i].value)) {
+				rb_raise(rb_eArgError, "State capacity exceeded while copying state");
+			}
+		}
+	}
+}
+
 // Callback for rb_hash_foreach to insert pairs into state
 static int Ruby_Profiler_State_foreach_insert(VALUE key, VALUE value, VALUE data) {
 	struct Ruby_Profiler_State *state = (struct Ruby_Profiler_State*)data;
@@ -188,6 +760,29 @@ static int Ruby_Profiler_State_foreach_insert(VALUE key, VALUE value, VALUE data
 	return ST_CONTINUE;
 }
 
+// Helper struct for inserting pairs without raising on overflow
+struct Ruby_Profiler_State_InsertData {
+	struct Ruby_Profiler_State *state;
+	int overflow;
+};
+
+// Callback for rb_hash_foreach to insert pairs into state, stopping (rather than raising) if the table is full
+static int Ruby_Profiler_State_foreach_try_insert(VALUE key, VALUE value, VALUE data) {
+	struct Ruby_Profiler_State_InsertData *insert_data = (struct Ruby_Profiler_State_InsertData*)data;
+	
+	// Keys must be symbols - raise TypeError if not
+	if (!RB_TYPE_P(key, T_SYMBOL)) {
+		rb_raise(rb_eTypeError, "State keys must be symbols, got %s", rb_obj_classname(key));
+	}
+	
+	if (!Ruby_Profiler_State_insert_pair(insert_data->state, rb_sym2id(key), value)) {
+		insert_data->overflow = 1;
+		return ST_STOP;
+	}
+	
+	return ST_CONTINUE;
+}
+
 // Helper struct for counting new keys
 struct Ruby_Profiler_State_CountData {
 	struct Ruby_Profiler_State *old_state;
@@ -206,7 +801,7 @@ static int Ruby_Profiler_State_foreach_count_new(VALUE key, VALUE value, VALUE d
 	ID id = rb_sym2id(key);
 	
 	// Count if key doesn't exist in old_state
-	if (!count_data->old_state || !Ruby_Profiler_State_find_pair(count_data->old_state, id)) {
+	if (!count_data->old_state || !Ruby_Profiler_State_lookup(count_data->old_state, id)) {
 		count_data->new_count++;
 	}
 	
@@ -214,10 +809,9 @@ static int Ruby_Profiler_State_foreach_count_new(VALUE key, VALUE value, VALUE d
 }
 
 static VALUE Ruby_Profiler_State_initialize(int argc, VALUE *argv, VALUE self) {
-	struct Ruby_Profiler_State *state;
-	TypedData_Get_Struct(self, struct Ruby_Profiler_State, &Ruby_Profiler_State_Type, state);
+	struct Ruby_Profiler_State_Handle *handle = Ruby_Profiler_State_get_handle(self);
 	
-	if (state) {
+	if (handle->state) {
 		rb_raise(rb_eRuntimeError, "State already initialized!");
 	}
 	
@@ -232,49 +826,56 @@ static VALUE Ruby_Profiler_State_initialize(int argc, VALUE *argv, VALUE self) {
 		size_t keys_count = RHASH_SIZE(options);
 		
 		// Calculate required capacity (next power of 2)
-		required_capacity = round_capacity_to_power_of_2(keys_count);
+		required_capacity = Ruby_Profiler_State_round_capacity(keys_count);
 	} else {
 		return self;
 	}
 	
-	// Allocate state with correct capacity (or reallocate if already allocated)
-	size_t size = sizeof(struct Ruby_Profiler_State) + (required_capacity * sizeof(struct Ruby_Profiler_Pair));
-	state = (struct Ruby_Profiler_State*)calloc(1, size);
-	
-	if (!state) {
-		rb_raise(rb_eNoMemError, "Failed to allocate state!");
-	}
-	
-	// Initialize state:
-	state->size = 0;
-	state->capacity = required_capacity;
+	// Allocate state with correct capacity (inline if it fits):
+	struct Ruby_Profiler_State *state = Ruby_Profiler_State_reserve(handle, required_capacity);
 	
-	// Update TypedData pointer:
-	DATA_PTR(self) = state;
-
 	// Now insert all pairs using rb_hash_foreach (more efficient than allocating keys array):
 	rb_hash_foreach(options, Ruby_Profiler_State_foreach_insert, (VALUE)state);
 	
 	return self;
 }
 
-static VALUE Ruby_Profiler_State_apply(VALUE self) {
-	struct Ruby_Profiler_State *state = Ruby_Profiler_State_get(self);
-	
-	// Update the thread-local pointer (NULL if state not initialized)
-	ruby_profiler_state = state;
-	
-	// Store state in fiber-local storage using Fiber#ruby_profiler_state=
-	// This is fiber-local storage that persists across fiber switches
-	VALUE fiber;
-
+static VALUE Ruby_Profiler_State_current_fiber(void) {
 #ifdef HAVE_RB_FIBER_CURRENT
-	fiber = rb_fiber_current();
+	return rb_fiber_current();
 #else
-	fiber = rb_funcall(rb_cFiber, rb_intern("current"), 0);
+	return rb_funcall(rb_cFiber, rb_intern("current"), 0);
 #endif
+}
+
+// Apply a state object (Qnil for none) to the current fiber, with the given number of enclosing states:
+static void Ruby_Profiler_State_assign(VALUE fiber, struct Ruby_Profiler_Fiber *profiler_fiber, VALUE state_value, uint64_t depth) {
+	struct Ruby_Profiler_State *state = RB_NIL_P(state_value) ? NULL : Ruby_Profiler_State_get(state_value);
+	
+	// Store state in fiber-local storage, which persists across fiber switches, and is inherited by new fibers and threads:
+	Ruby_Profiler_Fiber_write(profiler_fiber, state_value);
+	Ruby_Profiler_Fiber_inherit(profiler_fiber, state_value);
+	
+	// Install the fiber switch hook on first use, unless the profiler is disabled, in which case nothing is published:
+	if (!Ruby_Profiler_activate()) {
+		profiler_fiber->stack.depth = depth;
+		return;
+	}
 	
-	rb_ivar_set(fiber, id_ruby_profiler_state, self);
+	// Update the thread-local pointers (NULL if state not initialized)
+	Ruby_Profiler_State_publish(state, &profiler_fiber->stack, depth);
+	Ruby_Profiler_State_charge(state_value);
+	ruby_profiler_fiber_source = profiler_fiber->self;
+	
+	RUBY_PROFILER_PROBE(apply, state, fiber);
+	Ruby_Profiler_Timeline_record(fiber, state);
+}
+
+static VALUE Ruby_Profiler_State_apply(VALUE self) {
+	VALUE fiber = Ruby_Profiler_State_current_fiber();
+	struct Ruby_Profiler_Fiber *profiler_fiber = Ruby_Profiler_Fiber_acquire(fiber);
+	
+	Ruby_Profiler_State_assign(fiber, profiler_fiber, self, profiler_fiber->stack.depth);
 	
 	return self;
 }
@@ -286,12 +887,90 @@ static VALUE Ruby_Profiler_State_size(VALUE self) {
 		return SIZET2NUM(0);  // Uninitialized state has size 0
 	}
 	
-	return SIZET2NUM(state->size);
+	return SIZET2NUM(Ruby_Profiler_State_count(state));
+}
+
+static VALUE Ruby_Profiler_State_aref(VALUE self, VALUE key) {
+	struct Ruby_Profiler_State *state = Ruby_Profiler_State_get(self);
+	
+	if (!RB_TYPE_P(key, T_SYMBOL)) {
+		rb_raise(rb_eTypeError, "State keys must be symbols, got %s", rb_obj_classname(key));
+	}
+	
+	// Avoid interning symbols just to look them up:
+	ID id = rb_check_id(&key);
+	
+	if (!state || !id) {
+		return Qnil;
+	}
+	
+	const struct Ruby_Profiler_Pair *pair = Ruby_Profiler_State_lookup(state, id);
+	
+	return pair ? pair->value : Qnil;
+}
+
+// Add all pairs from a chain of states to a hash, oldest first so that newer values take precedence:
+static void Ruby_Profiler_State_to_h_into(VALUE hash, const struct Ruby_Profiler_State *state) {
+	if (state->parent) {
+		Ruby_Profiler_State_to_h_into(hash, state->parent);
+	}
+	
+	for (size_t i = 0; i < state->capacity; i++) {
+		if (state->pairs[i].key != 0) {
+			rb_hash_aset(hash, ID2SYM(state->pairs[i].key), state->pairs[i].value);
+		}
+	}
+}
+
+static VALUE Ruby_Profiler_State_to_h(VALUE self) {
+	struct Ruby_Profiler_State *state = Ruby_Profiler_State_get(self);
+	VALUE hash = rb_hash_new();
+	
+	if (state) {
+		Ruby_Profiler_State_to_h_into(hash, state);
+	}
+	
+	return hash;
+}
+
+// Get the state published for the current thread as a Hash, as seen by external readers (nil if none):
+static VALUE Ruby_Profiler_State_s_published(VALUE klass) {
+	struct Ruby_Profiler_State *state = ruby_profiler_state;
+	
+	if (!state) {
+		return Qnil;
+	}
+	
+	VALUE hash = rb_hash_new();
+	Ruby_Profiler_State_to_h_into(hash, state);
+	
+	return hash;
+}
+
+// Get the states enclosing the published state of the current thread, outermost first, as an Array of Hashes (nil where there was no state):
+static VALUE Ruby_Profiler_State_s_published_stack(VALUE klass) {
+	struct Ruby_Profiler_Stack *stack = ruby_profiler_stack;
+	VALUE array = rb_ary_new();
+	
+	if (!stack) {
+		return array;
+	}
+	
+	for (uint64_t i = 0; i < stack->depth && i < RUBY_PROFILER_STACK_CAPACITY; i++) {
+		if (stack->states[i]) {
+			VALUE hash = rb_hash_new();
+			Ruby_Profiler_State_to_h_into(hash, stack->states[i]);
+			rb_ary_push(array, hash);
+		} else {
+			rb_ary_push(array, Qnil);
+		}
+	}
+	
+	return array;
 }
 
 static VALUE Ruby_Profiler_State_with(int argc, VALUE *argv, VALUE self) {
-	struct Ruby_Profiler_State *old_state;
-	TypedData_Get_Struct(self, struct Ruby_Profiler_State, &Ruby_Profiler_State_Type, old_state);
+	struct Ruby_Profiler_State *old_state = Ruby_Profiler_State_get(self);
 	
 	VALUE options = Qnil;
 	rb_scan_args(argc, argv, ":", &options);
@@ -301,39 +980,39 @@ static VALUE Ruby_Profiler_State_with(int argc, VALUE *argv, VALUE self) {
 		return self;
 	}
 	
+	VALUE klass = rb_obj_class(self);
+	struct Ruby_Profiler_State *new_state;
+	VALUE new_state_value;
+	
+	if (old_state && !old_state->parent) {
+		// Optimistically assume the updates fit within the existing capacity (always true when only updating existing keys, e.g. for states created by a Shape). In that case the slot layout is unchanged, so the table can be copied verbatim without rehashing, and the options hash is only walked once:
+		new_state_value = Ruby_Profiler_State_make(klass, old_state->capacity, &new_state);
+		Ruby_Profiler_State_copy_table(new_state, old_state);
+		
+		struct Ruby_Profiler_State_InsertData insert_data = {new_state, 0};
+		rb_hash_foreach(options, Ruby_Profiler_State_foreach_try_insert, (VALUE)&insert_data);
+		
+		if (!insert_data.overflow) {
+			return new_state_value;
+		}
+		
+		// Otherwise, fall back to allocating a larger table and rehashing:
+	}
+	
 	// Count how many keys in options are NOT in old_state (new keys)
-	size_t old_size = old_state ? old_state->size : 0;
+	size_t old_size = old_state ? Ruby_Profiler_State_count(old_state) : 0;
 	struct Ruby_Profiler_State_CountData count_data = {old_state, 0};
 	
 	rb_hash_foreach(options, Ruby_Profiler_State_foreach_count_new, (VALUE)&count_data);
 	
-	size_t required_capacity = round_capacity_to_power_of_2(old_size + count_data.new_count);
+	size_t required_capacity = Ruby_Profiler_State_round_capacity(old_size + count_data.new_count);
 	
 	// Allocate a new state with the required capacity
-	VALUE klass = rb_obj_class(self);
-	VALUE new_state_value = Ruby_Profiler_State_allocate(klass);
-	
-	// Allocate the new state struct
-	size_t size = sizeof(struct Ruby_Profiler_State) + (required_capacity * sizeof(struct Ruby_Profiler_Pair));
-	struct Ruby_Profiler_State *new_state = (struct Ruby_Profiler_State*)calloc(1, size);
-	
-	if (!new_state) {
-		rb_raise(rb_eNoMemError, "Failed to allocate Ruby_Profiler_State");
-	}
+	new_state_value = Ruby_Profiler_State_make(klass, required_capacity, &new_state);
 	
-	new_state->size = 0;
-	new_state->capacity = required_capacity;
-	DATA_PTR(new_state_value) = new_state;
-	
-	// Copy all existing pairs from old_state to new_state (if old_state exists)
+	// Copy all existing pairs from old_state to new_state (if old_state exists), flattening any chain of derived states:
 	if (old_state) {
-		for (size_t i = 0; i < old_state->capacity; i++) {
-			if (old_state->pairs[i].key != 0) {
-				if (!Ruby_Profiler_State_insert_pair(new_state, old_state->pairs[i].key, old_state->pairs[i].value)) {
-					rb_raise(rb_eArgError, "State capacity exceeded while copying state");
-				}
-			}
-		}
+		Ruby_Profiler_State_flatten_into(new_state, old_state);
 	}
 	
 	// Apply updates from options hash using rb_hash_foreach
@@ -342,34 +1021,402 @@ static VALUE Ruby_Profiler_State_with(int argc, VALUE *argv, VALUE self) {
 	return new_state_value;
 }
 
-// Get state for fiber from fiber-local storage
-struct Ruby_Profiler_State *Ruby_Profiler_State_for(VALUE fiber) {
-	VALUE state_value = rb_ivar_get(fiber, id_ruby_profiler_state);
+// Create a new state containing only the updated pairs, which refers to this state for everything else. This costs O(updates) rather than O(size), but lookups must walk the chain of parents, so once the chain reaches RUBY_PROFILER_STATE_MAXIMUM_DEPTH it is flattened (as if by `with`):
+static VALUE Ruby_Profiler_State_derive(int argc, VALUE *argv, VALUE self) {
+	struct Ruby_Profiler_State *parent = Ruby_Profiler_State_get(self);
 	
-	if (RB_NIL_P(state_value)) {
-		return NULL;
+	VALUE options = Qnil;
+	rb_scan_args(argc, argv, ":", &options);
+	
+	if (RB_NIL_P(options)) {
+		// No updates, return self:
+		return self;
+	}
+	
+	if (!parent || parent->depth >= RUBY_PROFILER_STATE_MAXIMUM_DEPTH) {
+		return Ruby_Profiler_State_with(argc, argv, self);
 	}
 	
-	// Extract the state pointer from the VALUE
 	struct Ruby_Profiler_State *state;
-	if (!rb_typeddata_is_kind_of(state_value, &Ruby_Profiler_State_Type)) {
-		return NULL;
+	VALUE state_value = Ruby_Profiler_State_make(rb_obj_class(self), Ruby_Profiler_State_round_capacity(RHASH_SIZE(options)), &state);
+	
+	rb_hash_foreach(options, Ruby_Profiler_State_foreach_insert, (VALUE)state);
+	
+	// Link to the parent, keeping it alive (and its table in place) for as long as this state:
+	RB_OBJ_WRITE(state_value, &Ruby_Profiler_State_get_handle(state_value)->parent, self);
+	Ruby_Profiler_State_get_handle(self)->derived = 1;
+	Ruby_Profiler_State_pin(self);
+	state->parent = parent;
+	state->depth = parent->depth + 1;
+	state->flags |= RUBY_PROFILER_STATE_FLAG_PARENT;
+	
+	return state_value;
+}
+
+// Mark the start and end of an in-place change to a table, so that concurrent readers can detect it (see `generation`):
+static inline void Ruby_Profiler_State_begin_write(struct Ruby_Profiler_State *state) {
+	uint32_t generation = atomic_load_explicit(&state->generation, memory_order_relaxed);
+	
+	atomic_store_explicit(&state->generation, generation + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void Ruby_Profiler_State_end_write(struct Ruby_Profiler_State *state) {
+	uint32_t generation = atomic_load_explicit(&state->generation, memory_order_relaxed);
+	
+	atomic_store_explicit(&state->generation, generation + 1, memory_order_release);
+}
+
+// Replace the table of a state with a larger one. The old table may still be referenced by other threads (until their next fiber switch), so it's kept until the state is freed:
+static struct Ruby_Profiler_State *Ruby_Profiler_State_grow(struct Ruby_Profiler_State_Handle *handle) {
+	struct Ruby_Profiler_State *old_state = handle->state;
+	struct Ruby_Profiler_State *state = Ruby_Profiler_State_allocate_table(old_state->capacity * 2);
+	
+	if (!state) {
+		rb_raise(rb_eNoMemError, "Failed to allocate state!");
 	}
 	
-	TypedData_Get_Struct(state_value, struct Ruby_Profiler_State, &Ruby_Profiler_State_Type, state);
+	if (!Ruby_Profiler_State_Handle_inline_p(handle)) {
+		struct Ruby_Profiler_State **retired = realloc(handle->retired, (handle->retired_count + 1) * sizeof(*retired));
+		
+		if (!retired) {
+			Ruby_Profiler_State_free_table(state);
+			rb_raise(rb_eNoMemError, "Failed to allocate state!");
+		}
+		
+		handle->retired = retired;
+		handle->retired[handle->retired_count++] = old_state;
+	}
+	
+	for (size_t i = 0; i < old_state->capacity; i++) {
+		if (old_state->pairs[i].key != 0) {
+			Ruby_Profiler_State_insert_pair(state, old_state->pairs[i].key, old_state->pairs[i].value);
+		}
+	}
+	
+	state->parent = old_state->parent;
+	state->depth = old_state->depth;
+	state->flags |= old_state->flags & RUBY_PROFILER_STATE_FLAG_PARENT;
+	
+	handle->state = state;
+	
+	// Other threads pick up the new table on their next fiber switch:
+	if (ruby_profiler_state == old_state) {
+		Ruby_Profiler_State_publish(state, ruby_profiler_stack, ruby_profiler_stack ? ruby_profiler_stack->depth : 0);
+	}
+	
+	// The state may also enclose the current state, in which case readers may see either table (the old one remains valid until the state is freed):
+	Ruby_Profiler_Stack_replace(ruby_profiler_stack, old_state, state);
+	
 	return state;
 }
 
+// Set a pair in place, growing the table if the key is new and there is no room for it:
+static void Ruby_Profiler_State_set(VALUE self, ID key, VALUE value) {
+	struct Ruby_Profiler_State_Handle *handle = Ruby_Profiler_State_get_handle(self);
+	
+	if (handle->derived) {
+		rb_raise(rb_eRuntimeError, "Cannot modify a state which has derived states!");
+	}
+	
+	struct Ruby_Profiler_State *state = handle->state;
+	
+	if (!state) {
+		state = Ruby_Profiler_State_reserve(handle, 1);
+	}
+	
+	// Updating an existing key reuses its slot:
+	struct Ruby_Profiler_Pair *pair = Ruby_Profiler_State_find_pair(state, key);
+	
+	if (pair) {
+		Ruby_Profiler_State_begin_write(state);
+		Ruby_Profiler_State_set_value(state, pair - state->pairs, value);
+		Ruby_Profiler_State_end_write(state);
+		
+		RB_OBJ_WRITTEN(self, Qundef, value);
+		Ruby_Profiler_Sampler_label(ruby_profiler_state);
+		
+		return;
+	}
+	
+	if (state->size >= state->capacity) {
+		state = Ruby_Profiler_State_grow(handle);
+	}
+	
+	Ruby_Profiler_State_begin_write(state);
+	Ruby_Profiler_State_insert_pair(state, key, value);
+	Ruby_Profiler_State_end_write(state);
+	
+	RB_OBJ_WRITTEN(self, Qundef, value);
+	
+	// The label of the current thread's state may have changed (other threads update theirs when they next publish a state):
+	Ruby_Profiler_Sampler_label(ruby_profiler_state);
+}
+
+// Callback for rb_hash_foreach to set pairs in place
+static int Ruby_Profiler_State_foreach_set(VALUE key, VALUE value, VALUE self) {
+	// Keys must be symbols - raise TypeError if not
+	if (!RB_TYPE_P(key, T_SYMBOL)) {
+		rb_raise(rb_eTypeError, "State keys must be symbols, got %s", rb_obj_classname(key));
+	}
+	
+	Ruby_Profiler_State_set(self, rb_sym2id(key), value);
+	
+	return ST_CONTINUE;
+}
+
+// Update the state in place. Unlike `with`, this changes the state for everything that refers to it (e.g. fibers it has been applied to), so it should only be used on states that aren't shared:
+static VALUE Ruby_Profiler_State_update(int argc, VALUE *argv, VALUE self) {
+	VALUE options = Qnil;
+	rb_scan_args(argc, argv, ":", &options);
+	
+	rb_check_frozen(self);
+	
+	if (!RB_NIL_P(options)) {
+		rb_hash_foreach(options, Ruby_Profiler_State_foreach_set, self);
+	}
+	
+	return self;
+}
+
+static VALUE Ruby_Profiler_State_aset(VALUE self, VALUE key, VALUE value) {
+	rb_check_frozen(self);
+	
+	if (!RB_TYPE_P(key, T_SYMBOL)) {
+		rb_raise(rb_eTypeError, "State keys must be symbols, got %s", rb_obj_classname(key));
+	}
+	
+	Ruby_Profiler_State_set(self, rb_sym2id(key), value);
+	
+	return value;
+}
+
+struct Ruby_Profiler_State_Scope {
+	VALUE fiber;
+	struct Ruby_Profiler_Fiber *profiler_fiber;
+	
+	// The state object applied to the fiber before the block (Qnil for none):
+	VALUE previous;
+	
+	// The number of states enclosing the previous state:
+	uint64_t depth;
+};
+
+static VALUE Ruby_Profiler_State_scope_restore(VALUE argument) {
+	struct Ruby_Profiler_State_Scope *scope = (struct Ruby_Profiler_State_Scope*)argument;
+	
+	Ruby_Profiler_State_assign(scope->fiber, scope->profiler_fiber, scope->previous, scope->depth);
+	Ruby_Profiler_Fiber_pop(scope->profiler_fiber, scope->depth);
+	
+	return Qnil;
+}
+
+// Apply a state object to the current fiber for the duration of the block, pushing the previous state onto the fiber's stack, then restore it (even if the block raises or throws). The previous state is also kept on the C stack, since the fiber's stack only records a limited number of states:
+static VALUE Ruby_Profiler_State_scope(VALUE fiber, VALUE state_value) {
+	struct Ruby_Profiler_Fiber *profiler_fiber = Ruby_Profiler_Fiber_acquire(fiber);
+	struct Ruby_Profiler_State_Scope scope = {fiber, profiler_fiber, profiler_fiber->state, profiler_fiber->stack.depth};
+	
+	Ruby_Profiler_Fiber_push(profiler_fiber, scope.depth);
+	Ruby_Profiler_State_assign(fiber, profiler_fiber, state_value, scope.depth + 1);
+	
+	VALUE result = rb_ensure(rb_yield, state_value, Ruby_Profiler_State_scope_restore, (VALUE)&scope);
+	
+	RB_GC_GUARD(scope.previous);
+	
+	return result;
+}
+
+// Apply the state to the current fiber while executing the block, returning the result of the block:
+static VALUE Ruby_Profiler_State_apply_block(VALUE self) {
+	rb_need_block();
+	
+	return Ruby_Profiler_State_scope(Ruby_Profiler_State_current_fiber(), self);
+}
+
+// Apply the current fiber's state with the given updates (or a new state, if there is none) while executing the block, returning the result of the block:
+static VALUE Ruby_Profiler_State_s_with(int argc, VALUE *argv, VALUE klass) {
+	rb_need_block();
+	
+	VALUE fiber = Ruby_Profiler_State_current_fiber();
+	VALUE previous = Ruby_Profiler_Fiber_state(fiber);
+	VALUE state_value;
+	
+	if (RB_NIL_P(previous)) {
+		state_value = rb_class_new_instance_kw(argc, argv, klass, RB_PASS_CALLED_KEYWORDS);
+	} else {
+		state_value = Ruby_Profiler_State_with(argc, argv, previous);
+	}
+	
+	return Ruby_Profiler_State_scope(fiber, state_value);
+}
+
+// Get the snapshot of the value for a key as a binary string, as seen by external readers (nil if there is no snapshot):
+static VALUE Ruby_Profiler_State_snapshot(VALUE self, VALUE key) {
+	struct Ruby_Profiler_State *state = Ruby_Profiler_State_get(self);
+	
+	if (!RB_TYPE_P(key, T_SYMBOL)) {
+		rb_raise(rb_eTypeError, "State keys must be symbols, got %s", rb_obj_classname(key));
+	}
+	
+	ID id = rb_check_id(&key);
+	
+	// Snapshots are per table, so find the table containing the key:
+	for (; state && id; state = (struct Ruby_Profiler_State*)state->parent) {
+		struct Ruby_Profiler_Pair *pair = Ruby_Profiler_State_find_pair(state, id);
+		
+		if (pair) {
+			if (!(state->flags & RUBY_PROFILER_STATE_FLAG_SNAPSHOT)) {
+				return Qnil;
+			}
+			
+			struct Ruby_Profiler_Snapshot *snapshot = &Ruby_Profiler_State_snapshots(state)[pair - state->pairs];
+			
+			if (snapshot->type == RUBY_PROFILER_SNAPSHOT_NONE) {
+				return Qnil;
+			}
+			
+			return rb_str_new((const char*)snapshot->data, snapshot->length);
+		}
+	}
+	
+	return Qnil;
+}
+
+// Get the fingerprint of the value for a key, as seen by external readers (nil if there is no fingerprint):
+static VALUE Ruby_Profiler_State_fingerprint(VALUE self, VALUE key) {
+	struct Ruby_Profiler_State *state = Ruby_Profiler_State_get(self);
+	
+	if (!RB_TYPE_P(key, T_SYMBOL)) {
+		rb_raise(rb_eTypeError, "State keys must be symbols, got %s", rb_obj_classname(key));
+	}
+	
+	ID id = rb_check_id(&key);
+	
+	// Fingerprints are per table, so find the table containing the key:
+	for (; state && id; state = (struct Ruby_Profiler_State*)state->parent) {
+		struct Ruby_Profiler_Pair *pair = Ruby_Profiler_State_find_pair(state, id);
+		
+		if (pair) {
+			if (!(state->flags & RUBY_PROFILER_STATE_FLAG_FINGERPRINT)) {
+				return Qnil;
+			}
+			
+			uint64_t fingerprint = Ruby_Profiler_State_fingerprints(state)[pair - state->pairs];
+			
+			return fingerprint ? ULL2NUM(fingerprint) : Qnil;
+		}
+	}
+	
+	return Qnil;
+}
+
+// Whether new states include snapshots of their values:
+static VALUE Ruby_Profiler_State_s_snapshot_p(VALUE klass) {
+	return ruby_profiler_state_snapshot ? Qtrue : Qfalse;
+}
+
+// Enable or disable snapshots for new states (existing states are unchanged):
+static VALUE Ruby_Profiler_State_s_snapshot_set(VALUE klass, VALUE value) {
+	ruby_profiler_state_snapshot = RTEST(value);
+	
+	return value;
+}
+
+// Whether new states include fingerprints of their values:
+static VALUE Ruby_Profiler_State_s_fingerprint_p(VALUE klass) {
+	return ruby_profiler_state_fingerprint ? Qtrue : Qfalse;
+}
+
+// Enable or disable fingerprints for new states (existing states are unchanged):
+static VALUE Ruby_Profiler_State_s_fingerprint_set(VALUE klass, VALUE value) {
+	ruby_profiler_state_fingerprint = RTEST(value);
+	
+	return value;
+}
+
+// Whether CPU time is charged to states:
+static VALUE Ruby_Profiler_State_s_cpu_time_p(VALUE klass) {
+	return ruby_profiler_state_cpu_time ? Qtrue : Qfalse;
+}
+
+// Enable or disable charging the CPU time of each thread to the state applied on it. This reads the thread's CPU clock whenever the applied state changes (e.g. on every fiber switch), so it's disabled by default. Other threads start or stop being charged when they next switch fibers or apply a state.
+static VALUE Ruby_Profiler_State_s_cpu_time_set(VALUE klass, VALUE value) {
+	ruby_profiler_state_cpu_time = RTEST(value);
+	
+	// Time is charged when switching fibers, so the hook must be installed:
+	if (ruby_profiler_state_cpu_time && !Ruby_Profiler_activate()) {
+		// The profiler is disabled, so the current fiber's state is charged once it's enabled again:
+		return value;
+	}
+	
+	// Start (or stop) charging the current fiber's state:
+	Ruby_Profiler_State_charge(Ruby_Profiler_Fiber_state(Ruby_Profiler_State_current_fiber()));
+	
+	return value;
+}
+
+// Get the CPU time in seconds used while the state was applied, on every thread, if enabled by `State.cpu_time=`. Time is charged to a thread's state whenever the applied state changes, except for the current thread, which is also charged up to now.
+static VALUE Ruby_Profiler_State_cpu_time(VALUE self) {
+	struct Ruby_Profiler_State_Handle *handle = Ruby_Profiler_State_get_handle(self);
+	
+	if (!handle->counters) {
+		return DBL2NUM(0.0);
+	}
+	
+	if (ruby_profiler_counters == handle->counters) {
+		Ruby_Profiler_State_charge_slow(handle->counters);
+	}
+	
+	return DBL2NUM(atomic_load_explicit(&handle->counters->cpu_time, memory_order_relaxed) / 1e9);
+}
+
+// Statistics for the slab allocator used for state tables:
+static VALUE Ruby_Profiler_State_s_slab_statistics(VALUE klass) {
+	struct Ruby_Profiler_Slab_Statistics statistics;
+	Ruby_Profiler_Slab_statistics(&statistics);
+	
+	VALUE hash = rb_hash_new();
+	rb_hash_aset(hash, ID2SYM(rb_intern("slabs")), SIZET2NUM(statistics.slabs));
+	rb_hash_aset(hash, ID2SYM(rb_intern("size")), SIZET2NUM(statistics.size));
+	rb_hash_aset(hash, ID2SYM(rb_intern("allocated")), SIZET2NUM(statistics.allocated));
+	rb_hash_aset(hash, ID2SYM(rb_intern("free")), SIZET2NUM(statistics.free));
+	
+	return hash;
+}
+
 void Init_Ruby_Profiler_State(VALUE Ruby_Profiler) {
 	Ruby_Profiler_State = rb_define_class_under(Ruby_Profiler, "State", rb_cObject);
 	rb_define_alloc_func(Ruby_Profiler_State, Ruby_Profiler_State_allocate);
 	
-	// Cache the ID for @ruby_profiler_state instance variable
-	id_ruby_profiler_state = rb_intern("@ruby_profiler_state");
+	rb_define_singleton_method(Ruby_Profiler_State, "snapshot?", Ruby_Profiler_State_s_snapshot_p, 0);
+	rb_define_singleton_method(Ruby_Profiler_State, "snapshot=", Ruby_Profiler_State_s_snapshot_set, 1);
+	rb_define_singleton_method(Ruby_Profiler_State, "fingerprint?", Ruby_Profiler_State_s_fingerprint_p, 0);
+	rb_define_singleton_method(Ruby_Profiler_State, "fingerprint=", Ruby_Profiler_State_s_fingerprint_set, 1);
+	rb_define_singleton_method(Ruby_Profiler_State, "cpu_time?", Ruby_Profiler_State_s_cpu_time_p, 0);
+	rb_define_singleton_method(Ruby_Profiler_State, "cpu_time=", Ruby_Profiler_State_s_cpu_time_set, 1);
+	rb_define_singleton_method(Ruby_Profiler_State, "published", Ruby_Profiler_State_s_published, 0);
+	rb_define_singleton_method(Ruby_Profiler_State, "published_stack", Ruby_Profiler_State_s_published_stack, 0);
+	rb_define_singleton_method(Ruby_Profiler_State, "with", Ruby_Profiler_State_s_with, -1);
+	rb_define_singleton_method(Ruby_Profiler_State, "slab_statistics", Ruby_Profiler_State_s_slab_statistics, 0);
 	
 	rb_define_method(Ruby_Profiler_State, "initialize", Ruby_Profiler_State_initialize, -1);
 	rb_define_method(Ruby_Profiler_State, "apply!", Ruby_Profiler_State_apply, 0);
+	rb_define_method(Ruby_Profiler_State, "apply", Ruby_Profiler_State_apply_block, 0);
 	rb_define_method(Ruby_Profiler_State, "with", Ruby_Profiler_State_with, -1);
+	rb_define_method(Ruby_Profiler_State, "derive", Ruby_Profiler_State_derive, -1);
 	rb_define_method(Ruby_Profiler_State, "size", Ruby_Profiler_State_size, 0);
+	rb_define_method(Ruby_Profiler_State, "[]", Ruby_Profiler_State_aref, 1);
+	rb_define_method(Ruby_Profiler_State, "[]=", Ruby_Profiler_State_aset, 2);
+	rb_define_method(Ruby_Profiler_State, "snapshot", Ruby_Profiler_State_snapshot, 1);
+	rb_define_method(Ruby_Profiler_State, "fingerprint", Ruby_Profiler_State_fingerprint, 1);
+	rb_define_method(Ruby_Profiler_State, "cpu_time", Ruby_Profiler_State_cpu_time, 0);
+	rb_define_method(Ruby_Profiler_State, "update!", Ruby_Profiler_State_update, -1);
+	rb_define_method(Ruby_Profiler_State, "to_h", Ruby_Profiler_State_to_h, 0);
+	
+	Init_Ruby_Profiler_Shape(Ruby_Profiler_State);
+	Init_Ruby_Profiler_Symbols(Ruby_Profiler_State);
+	Init_Ruby_Profiler_Registry(Ruby_Profiler_State);
+	Init_Ruby_Profiler_Cache();
+	Init_Ruby_Profiler_Fiber(Ruby_Profiler_State);
 }
 
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <ruby.h>
+#include <stdatomic.h>
 
 struct Ruby_Profiler_Pair {
 	// ID 0 indicates empty slot:
@@ -11,14 +12,68 @@ struct Ruby_Profiler_Pair {
 	VALUE value;
 };
 
-// This state is considered a public interface for BPF programs to read. Therefore, we will endeavour not to change it without an extremely good reason.
+// The ABI version covers the exported symbols (`ruby_profiler_state`, `ruby_profiler_abi_version`) and the meaning of the state header. It is incremented only for changes that existing readers can't detect from the header itself:
+#define RUBY_PROFILER_ABI_VERSION 1
+
+// "RPST" in memory order on little-endian systems:
+#define RUBY_PROFILER_STATE_MAGIC 0x54535052
+
+// The layout version is incremented whenever fields are added to the header:
+#define RUBY_PROFILER_STATE_VERSION 3
+
+// Layout flags:
+enum {
+	// Slots are chosen using Ruby_Profiler_State_hash (otherwise `key & (capacity - 1)`):
+	RUBY_PROFILER_STATE_FLAG_HASH_MIXED = 1 << 0,
+	
+	// A packed copy of the keys in slot order (`ID keys[capacity]`) follows the pairs (see Ruby_Profiler_State_keys):
+	RUBY_PROFILER_STATE_FLAG_KEY_INDEX = 1 << 1,
+	
+	// The state only contains the pairs that differ from `parent`, which must be consulted for any key not found here (see Ruby_Profiler_State_lookup):
+	RUBY_PROFILER_STATE_FLAG_PARENT = 1 << 2,
+	
+	// A snapshot of each value (`struct Ruby_Profiler_Snapshot snapshots[capacity]`, in slot order) follows the pairs and key index (see Ruby_Profiler_State_snapshots):
+	RUBY_PROFILER_STATE_FLAG_SNAPSHOT = 1 << 3,
+	
+	// A fingerprint of each value (`uint64_t fingerprints[capacity]`, in slot order) follows the pairs, key index and snapshots (see Ruby_Profiler_State_fingerprints):
+	RUBY_PROFILER_STATE_FLAG_FINGERPRINT = 1 << 4,
+};
+
+// The maximum length of a chain of derived states (`depth`), beyond which `State#derive` flattens the chain into a single table:
+#define RUBY_PROFILER_STATE_MAXIMUM_DEPTH 8
+
+// States with at least this capacity maintain a key index, which allows vectorized lookups (only when built with AVX2, see key_index.h):
+#define RUBY_PROFILER_STATE_KEY_INDEX_THRESHOLD 16
+
+// This state is considered a public interface for BPF programs to read. The header is self-describing so that the layout can evolve: readers should check `magic`, read `version` and `flags` to decide which fields and features are present, and use `header_size` (not sizeof) to locate the pairs. New fields are only ever appended to the header.
 struct Ruby_Profiler_State {
+	// Always RUBY_PROFILER_STATE_MAGIC:
+	uint32_t magic;
+	
+	// Layout version (RUBY_PROFILER_STATE_VERSION):
+	uint16_t version;
+	
+	// Offset of `pairs` from the start of the state:
+	uint16_t header_size;
+	
+	// Layout flags (RUBY_PROFILER_STATE_FLAG_*):
+	uint32_t flags;
+	
+	// Incremented before and after every change to the pairs of this table (since version 3), so it is odd while the table is being modified in place (see `State#update!`). Readers which see the same even value before and after reading know that the pairs were not changed in the meantime:
+	_Atomic uint32_t generation;
+	
 	// Number of active pairs:
 	size_t size;
 
 	// Total slots (must be power of 2 for efficient hashing):
 	size_t capacity;
 	
+	// The state this state was derived from, if RUBY_PROFILER_STATE_FLAG_PARENT is set (since version 2):
+	const struct Ruby_Profiler_State *parent;
+	
+	// Number of ancestors reachable through `parent`, at most RUBY_PROFILER_STATE_MAXIMUM_DEPTH (since version 2):
+	size_t depth;
+	
 	// Array of pairs:
 	struct Ruby_Profiler_Pair pairs[];
 };
@@ -26,31 +81,212 @@ struct Ruby_Profiler_State {
 // Hash Table Design:
 //
 // For small hash tables (< 16 items) with integer keys like your Ruby profiler,
-// hash + linear probing at 100% load factor is optimal: computing key % capacity
-// (especially with power-of-2 capacity using bitwise AND) is essentially free, and
-// even in the worst case where you scan all slots, you're no worse off than a pure
-// linear scan from index 0, while on average you start closer to your target and
-// find items faster—giving you all the benefits of hashing with zero memory overhead
-// and no downside, making it strictly better than either pure linear scan or traditional
+// hash + linear probing at 100% load factor is optimal: computing the hash and
+// masking with a power-of-2 capacity is essentially free, and even in the worst
+// case where you scan all slots, you're no worse off than a pure linear scan from
+// index 0, while on average you start closer to your target and find items
+// faster—giving you all the benefits of hashing with zero memory overhead and no
+// downside, making it strictly better than either pure linear scan or traditional
 // linear probing with lower load factors.
 //
+// This only holds if the hash spreads keys evenly. Ruby IDs are a serial number
+// shifted left by RUBY_ID_SCOPE_SHIFT (4), with the scope (local, instance,
+// attrset, etc.) in the low bits, so `key & (capacity - 1)` puts every local
+// symbol (e.g. `:request_id`) in slot 0 of a table with capacity <= 16 and turns
+// lookups into a full linear scan. Instead, we multiply the key by a 64-bit odd
+// constant (Fibonacci hashing) and take the high 32 bits, so every bit of the ID
+// contributes to the slot.
+//
 // Implementation details:
 // - Capacity must be a power of 2 (enforced at allocation).
-// - Hash function: key & (capacity - 1) (fast bitwise AND).
+// - Hash function: Ruby_Profiler_State_hash(key) & (capacity - 1).
 // - Linear probing: (hash + i) & (capacity - 1) for i = 0, 1, 2, ...
 // - Empty slots: key == 0 (ID 0 is invalid in Ruby).
 // - BPF-friendly: Can enumerate by iterating capacity slots and skipping empty ones.
 
+#define RUBY_PROFILER_STATE_HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+// Compute the initial probe position for a key (before masking with capacity - 1). BPF readers must use the same function to look up keys.
+static inline size_t Ruby_Profiler_State_hash(ID key) {
+	return (size_t)(((uint64_t)key * RUBY_PROFILER_STATE_HASH_MULTIPLIER) >> 32);
+}
+
+// Get the key index of a state (only valid if RUBY_PROFILER_STATE_FLAG_KEY_INDEX is set):
+static inline ID *Ruby_Profiler_State_keys(struct Ruby_Profiler_State *state) {
+	return (ID*)(state->pairs + state->capacity);
+}
+
+// Snapshot types:
+enum {
+	// No snapshot (an empty slot, or a value of an unsupported type):
+	RUBY_PROFILER_SNAPSHOT_NONE = 0,
+	
+	// The bytes of a String:
+	RUBY_PROFILER_SNAPSHOT_STRING = 1,
+	
+	// An Integer as an `int64_t` in native byte order:
+	RUBY_PROFILER_SNAPSHOT_INTEGER = 2,
+	
+	// The name of a Symbol:
+	RUBY_PROFILER_SNAPSHOT_SYMBOL = 3,
+	
+	// Set in addition to the type if the data was truncated:
+	RUBY_PROFILER_SNAPSHOT_TRUNCATED = 0x80,
+};
+
+#define RUBY_PROFILER_SNAPSHOT_DATA_SIZE 62
+
+// A fixed size rendering of a value as bytes, so that readers can copy it without dereferencing Ruby objects. It reflects the value at the time it was stored in the state (e.g. later changes to a mutable String are not reflected):
+struct Ruby_Profiler_Snapshot {
+	// RUBY_PROFILER_SNAPSHOT_* type, possibly with RUBY_PROFILER_SNAPSHOT_TRUNCATED:
+	uint8_t type;
+	
+	// Number of bytes used in `data`:
+	uint8_t length;
+	
+	uint8_t data[RUBY_PROFILER_SNAPSHOT_DATA_SIZE];
+};
+
+// Get the snapshots of a state (only valid if RUBY_PROFILER_STATE_FLAG_SNAPSHOT is set):
+static inline struct Ruby_Profiler_Snapshot *Ruby_Profiler_State_snapshots(struct Ruby_Profiler_State *state) {
+	char *section = (char*)(state->pairs + state->capacity);
+	
+	if (state->flags & RUBY_PROFILER_STATE_FLAG_KEY_INDEX) {
+		section += state->capacity * sizeof(ID);
+	}
+	
+	return (struct Ruby_Profiler_Snapshot*)section;
+}
+
+// A fingerprint is a 64-bit FNV-1a hash of the snapshot type of a value (RUBY_PROFILER_SNAPSHOT_STRING, INTEGER or SYMBOL, as one byte) followed by its complete contents (never truncated), so it is stable across processes and can be computed by readers for known values. Values of other types have fingerprint 0 (none), and a hash of 0 is stored as 1:
+#define RUBY_PROFILER_FINGERPRINT_OFFSET 0xCBF29CE484222325ULL
+#define RUBY_PROFILER_FINGERPRINT_PRIME 0x100000001B3ULL
+
+// Add bytes to a fingerprint, starting from RUBY_PROFILER_FINGERPRINT_OFFSET:
+static inline uint64_t Ruby_Profiler_Fingerprint_update(uint64_t hash, const void *data, size_t length) {
+	const uint8_t *bytes = (const uint8_t*)data;
+	
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ bytes[i]) * RUBY_PROFILER_FINGERPRINT_PRIME;
+	}
+	
+	return hash;
+}
+
+// Render a value into a snapshot (RUBY_PROFILER_SNAPSHOT_NONE for values of other types).
+void Ruby_Profiler_Snapshot_render(struct Ruby_Profiler_Snapshot *snapshot, VALUE value);
+
+// Compute the fingerprint of a value (0 for values of other types).
+uint64_t Ruby_Profiler_Fingerprint_compute(VALUE value);
+
+// Get the fingerprints of a state (only valid if RUBY_PROFILER_STATE_FLAG_FINGERPRINT is set):
+static inline uint64_t *Ruby_Profiler_State_fingerprints(struct Ruby_Profiler_State *state) {
+	char *section = (char*)Ruby_Profiler_State_snapshots(state);
+	
+	if (state->flags & RUBY_PROFILER_STATE_FLAG_SNAPSHOT) {
+		section += state->capacity * sizeof(struct Ruby_Profiler_Snapshot);
+	}
+	
+	return (uint64_t*)section;
+}
+
 // Thread-local pointer to current state (public symbol for BPF access)
 extern _Thread_local struct Ruby_Profiler_State *ruby_profiler_state;
 
+// Thread-local sequence number for `ruby_profiler_state` (public symbol for BPF access). It is odd while the pointer is being changed, and incremented by 2 for every change, so a reader that sees the same even value before and after reading the state knows that the pointer (and therefore the state it points to) was not changed or freed in the meantime.
+extern _Thread_local _Atomic uint64_t ruby_profiler_sequence;
+
+// Maximum number of enclosing states recorded for each fiber:
+#define RUBY_PROFILER_STACK_CAPACITY 8
+
+// The states enclosing the current state of a fiber, i.e. those replaced by scoped states (e.g. `State#apply` with a block), outermost first, so that readers can attribute samples to every level of context (e.g. request, job, query). This is considered a public interface for BPF programs. Pushing and popping states doesn't allocate.
+struct Ruby_Profiler_Stack {
+	// Number of enclosing states, which may exceed RUBY_PROFILER_STACK_CAPACITY, in which case only the outermost states are recorded:
+	uint64_t depth;
+	
+	struct Ruby_Profiler_State *states[RUBY_PROFILER_STACK_CAPACITY];
+};
+
+// Thread-local pointer to the stack of the current fiber (public symbol for BPF access), or NULL if the fiber has none. It changes together with `ruby_profiler_state`, and is covered by the same sequence number (as is the depth of the stack).
+extern _Thread_local struct Ruby_Profiler_Stack *ruby_profiler_stack;
+
+// Update `ruby_profiler_state` and `ruby_profiler_stack` for the current thread, setting the depth of the stack (if any), and bumping `ruby_profiler_sequence` around the change. All writes to `ruby_profiler_state` must go through this function.
+void Ruby_Profiler_State_publish(struct Ruby_Profiler_State *state, struct Ruby_Profiler_Stack *stack, uint64_t depth);
+
+// Counters kept alongside each state object rather than in its table (which is a public interface, and may be replaced). They are updated atomically, since a state may be applied on several threads:
+struct Ruby_Profiler_State_Counters {
+	// One reference is held by the state object, and one by each thread charging its CPU time to them (see `ruby_profiler_counters`), since a thread may still be charging them when the state object is freed:
+	_Atomic uint64_t references;
+	
+	// CPU time in nanoseconds used by threads while the state was applied (see `State.cpu_time=`):
+	_Atomic uint64_t cpu_time;
+};
+
+// Prevent compaction from moving a state object, so that its address (and the address of its table, which may be stored inline) can be saved outside of the GC's view, e.g. when its table is published, or by the thread event hooks.
+void Ruby_Profiler_State_pin(VALUE state);
+
+// Whether the CPU time of each thread is charged to the state applied on it (see `State.cpu_time=`):
+extern int ruby_profiler_state_cpu_time;
+
+// The counters of the state which the current thread's CPU time is being charged to (NULL for none), holding a reference to them:
+extern _Thread_local struct Ruby_Profiler_State_Counters *ruby_profiler_counters;
+
+// Get the counters of a state object, allocating them if needed (NULL for Qnil, or if they can't be allocated).
+struct Ruby_Profiler_State_Counters *Ruby_Profiler_State_counters(VALUE state);
+
+// Release a reference to counters (if any), freeing them if it was the last one.
+void Ruby_Profiler_State_Counters_release(struct Ruby_Profiler_State_Counters *counters);
+
+// Charge the CPU time used by the current thread since it was last charged to `ruby_profiler_counters`, and charge the given counters (NULL for none) from now on.
+void Ruby_Profiler_State_charge_slow(struct Ruby_Profiler_State_Counters *counters);
+
+// Start charging the CPU time of the current thread to a state object (Qnil for none), if enabled. This must be called whenever the state applied on the thread changes, e.g. when switching fibers, and is free when disabled.
+static inline void Ruby_Profiler_State_charge(VALUE state) {
+	if (RB_UNLIKELY(ruby_profiler_state_cpu_time || ruby_profiler_counters)) {
+		Ruby_Profiler_State_charge_slow(ruby_profiler_state_cpu_time ? Ruby_Profiler_State_counters(state) : NULL);
+	}
+}
+
+// ABI version (public symbol so readers can check compatibility before attaching)
+extern const uint32_t ruby_profiler_abi_version;
+
 // Typed data type (defined in state.c)
 extern const rb_data_type_t Ruby_Profiler_State_Type;
 
-// Cached ID for @ruby_profiler_state instance variable (defined in state.c)
-extern ID id_ruby_profiler_state;
+// Get the state table for a State instance (NULL if the state is empty)
+struct Ruby_Profiler_State *Ruby_Profiler_State_get(VALUE self);
+
+// Round up to the next power of 2 (minimum 1)
+size_t Ruby_Profiler_State_round_capacity(size_t capacity);
+
+// Allocate and initialize an empty table of the given capacity (must be a power of 2), returning NULL on failure
+struct Ruby_Profiler_State *Ruby_Profiler_State_allocate_table(size_t capacity);
+
+// Free a table allocated by Ruby_Profiler_State_allocate_table
+void Ruby_Profiler_State_free_table(struct Ruby_Profiler_State *state);
+
+// Total size of a table in bytes, including the header and any trailing sections
+size_t Ruby_Profiler_State_table_size(const struct Ruby_Profiler_State *state);
+
+// Copy the contents of a table into an empty table with the same capacity
+void Ruby_Profiler_State_copy_table(struct Ruby_Profiler_State *state, const struct Ruby_Profiler_State *source);
+
+// Allocate a new State instance with an empty table of the given capacity (must be a power of 2)
+VALUE Ruby_Profiler_State_make(VALUE klass, size_t capacity, struct Ruby_Profiler_State **state);
+
+// Set the value of the pair in the given slot (which must have a key), updating its snapshot and fingerprint if enabled
+void Ruby_Profiler_State_set_value(struct Ruby_Profiler_State *state, size_t slot, VALUE value);
+
+// Find a pair by key in this table only, ignoring any parent (NULL if not found)
+struct Ruby_Profiler_Pair *Ruby_Profiler_State_find_pair(struct Ruby_Profiler_State *state, ID key);
+
+// Insert or update a pair (returns 0 if the table is full)
+int Ruby_Profiler_State_insert_pair(struct Ruby_Profiler_State *state, ID key, VALUE value);
+
+// Find a pair by key, following the chain of parents of a derived state (NULL if not found)
+const struct Ruby_Profiler_Pair *Ruby_Profiler_State_lookup(const struct Ruby_Profiler_State *state, ID key);
 
-// Get state for fiber from fiber-local storage
-struct Ruby_Profiler_State *Ruby_Profiler_State_for(VALUE fiber);
+// Count the distinct keys of a state, including those inherited from its parents
+size_t Ruby_Profiler_State_count(const struct Ruby_Profiler_State *state);
 
 void Init_Ruby_Profiler_State(VALUE Ruby_Profiler);
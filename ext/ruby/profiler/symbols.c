@@ -0,0 +1,120 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "symbols.h"
+#include "state.h"
+
+#include <ruby/st.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// Size of each thread's cache of recently added IDs (must be a power of 2):
+#define RUBY_PROFILER_SYMBOLS_CACHE_SIZE 256
+
+struct Ruby_Profiler_Symbols *ruby_profiler_symbols = NULL;
+
+// The IDs in the table (protected by the mutex):
+static st_table *ruby_profiler_symbols_ids = NULL;
+static pthread_mutex_t ruby_profiler_symbols_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Each thread remembers the IDs it has recently added, so that adding the same keys over and over (e.g. for every request) takes no locks:
+static _Thread_local ID ruby_profiler_symbols_cache[RUBY_PROFILER_SYMBOLS_CACHE_SIZE];
+
+static void Ruby_Profiler_Symbols_append(ID id, const char *name, size_t length) {
+	struct Ruby_Profiler_Symbols *symbols = ruby_profiler_symbols;
+	
+	size_t entry_size = (sizeof(struct Ruby_Profiler_Symbol) + length + 1 + 7) & ~(size_t)7;
+	uint64_t size = atomic_load_explicit(&symbols->size, memory_order_relaxed);
+	
+	if (length > UINT32_MAX || size + entry_size > symbols->capacity) {
+		atomic_fetch_add_explicit(&symbols->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	
+	struct Ruby_Profiler_Symbol *symbol = (struct Ruby_Profiler_Symbol*)(symbols->entries + size);
+	symbol->id = id;
+	symbol->length = (uint32_t)length;
+	memcpy(symbol->name, name, length);
+	symbol->name[length] = '\0';
+	
+	// Publish the entry (the count is released last, so the entry and size are visible to any reader that sees it):
+	atomic_store_explicit(&symbols->size, size + entry_size, memory_order_release);
+	atomic_store_explicit(&symbols->count, atomic_load_explicit(&symbols->count, memory_order_relaxed) + 1, memory_order_release);
+}
+
+void Ruby_Profiler_Symbols_add(ID id) {
+	if (!ruby_profiler_symbols) return;
+	
+	ID *cached = &ruby_profiler_symbols_cache[Ruby_Profiler_State_hash(id) & (RUBY_PROFILER_SYMBOLS_CACHE_SIZE - 1)];
+	
+	if (*cached == id) return;
+	
+	// Resolve the name before taking the lock:
+	VALUE name = rb_id2str(id);
+	
+	if (RB_NIL_P(name)) return;
+	
+	pthread_mutex_lock(&ruby_profiler_symbols_mutex);
+	
+	if (!st_is_member(ruby_profiler_symbols_ids, (st_data_t)id)) {
+		st_insert(ruby_profiler_symbols_ids, (st_data_t)id, 0);
+		Ruby_Profiler_Symbols_append(id, RSTRING_PTR(name), RSTRING_LEN(name));
+	}
+	
+	pthread_mutex_unlock(&ruby_profiler_symbols_mutex);
+	
+	*cached = id;
+	
+	RB_GC_GUARD(name);
+}
+
+// Get the symbols in the symbol table, in the order they were added:
+static VALUE Ruby_Profiler_Symbols_s_symbols(VALUE klass) {
+	struct Ruby_Profiler_Symbols *symbols = ruby_profiler_symbols;
+	VALUE array = rb_ary_new();
+	
+	if (!symbols) return array;
+	
+	uint64_t count = atomic_load_explicit(&symbols->count, memory_order_acquire);
+	const uint8_t *entry = symbols->entries;
+	
+	for (uint64_t i = 0; i < count; i++) {
+		const struct Ruby_Profiler_Symbol *symbol = (const struct Ruby_Profiler_Symbol*)entry;
+		
+		rb_ary_push(array, ID2SYM(symbol->id));
+		
+		entry += (sizeof(struct Ruby_Profiler_Symbol) + symbol->length + 1 + 7) & ~(size_t)7;
+	}
+	
+	return array;
+}
+
+void Init_Ruby_Profiler_Symbols(VALUE Ruby_Profiler_State) {
+	rb_define_singleton_method(Ruby_Profiler_State, "symbols", Ruby_Profiler_Symbols_s_symbols, 0);
+	
+	if (ruby_profiler_symbols) return;
+	
+	void *region = mmap(NULL, RUBY_PROFILER_SYMBOLS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	
+	if (region == MAP_FAILED) {
+		rb_warn("Ruby::Profiler: failed to allocate symbol table!");
+		return;
+	}
+	
+	struct Ruby_Profiler_Symbols *symbols = (struct Ruby_Profiler_Symbols*)region;
+	symbols->magic = RUBY_PROFILER_SYMBOLS_MAGIC;
+	symbols->version = RUBY_PROFILER_SYMBOLS_VERSION;
+	symbols->capacity = RUBY_PROFILER_SYMBOLS_SIZE - sizeof(struct Ruby_Profiler_Symbols);
+	
+	ruby_profiler_symbols_ids = st_init_numtable();
+	ruby_profiler_symbols = symbols;
+}
@@ -0,0 +1,61 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+#include <stdatomic.h>
+
+// "RPSY" in memory order on little-endian systems:
+#define RUBY_PROFILER_SYMBOLS_MAGIC 0x59535052
+
+#define RUBY_PROFILER_SYMBOLS_VERSION 1
+
+// Size of the region reserved for the symbol table (address space only, pages are allocated as they are used):
+#define RUBY_PROFILER_SYMBOLS_SIZE (16 * 1024 * 1024)
+
+// An entry in the symbol table, padded to a multiple of 8 bytes:
+struct Ruby_Profiler_Symbol {
+	ID id;
+	
+	// Length of the name in bytes (excluding the NUL terminator):
+	uint32_t length;
+	
+	// Reserved (zero), so that the name starts at offset 16:
+	uint32_t reserved;
+	
+	// Name as stored by Ruby (normally UTF-8), NUL terminated:
+	char name[];
+};
+
+// A process-wide, append-only table of every ID used as a state key and its name, in a single contiguous region, so that readers can resolve the keys of any state with one bulk read. This is considered a public interface for BPF programs. Entries are never modified or removed once they are visible.
+struct Ruby_Profiler_Symbols {
+	// Always RUBY_PROFILER_SYMBOLS_MAGIC:
+	uint32_t magic;
+	
+	// Layout version (RUBY_PROFILER_SYMBOLS_VERSION):
+	uint32_t version;
+	
+	// Number of entries, stored after the entries themselves are written (release), so a reader which loads it first can read that many entries:
+	_Atomic uint64_t count;
+	
+	// Number of bytes of `entries` in use (updated before `count`):
+	_Atomic uint64_t size;
+	
+	// Number of bytes available for `entries`:
+	uint64_t capacity;
+	
+	// Number of IDs which could not be added because the table is full:
+	_Atomic uint64_t dropped;
+	
+	// Entries (struct Ruby_Profiler_Symbol), each starting at an 8 byte aligned offset:
+	uint8_t entries[];
+};
+
+// Process-wide symbol table (public symbol for BPF access, NULL if it could not be allocated)
+extern struct Ruby_Profiler_Symbols *ruby_profiler_symbols;
+
+// Add an ID to the symbol table if it isn't already present.
+void Ruby_Profiler_Symbols_add(ID id);
+
+void Init_Ruby_Profiler_Symbols(VALUE Ruby_Profiler_State);
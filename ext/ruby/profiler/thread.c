@@ -0,0 +1,164 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "thread.h"
+#include "state.h"
+#include "cache.h"
+#include "sampler.h"
+#include "fiber.h"
+
+#include <stdlib.h>
+
+#if defined(HAVE_RB_INTERNAL_THREAD_ADD_EVENT_HOOK)
+#include <ruby/thread.h>
+
+#include "registry.h"
+
+// Thread specific data is needed to save the state of each Ruby thread between running on native threads:
+#if defined(HAVE_RB_INTERNAL_THREAD_SPECIFIC_GET)
+#define RUBY_PROFILER_THREAD_SPECIFIC
+#endif
+
+#if defined(RUBY_PROFILER_THREAD_SPECIFIC)
+#define RUBY_PROFILER_THREAD_EVENTS (RUBY_INTERNAL_THREAD_EVENT_STARTED | RUBY_INTERNAL_THREAD_EVENT_RESUMED | RUBY_INTERNAL_THREAD_EVENT_SUSPENDED | RUBY_INTERNAL_THREAD_EVENT_EXITED)
+#else
+#define RUBY_PROFILER_THREAD_EVENTS (RUBY_INTERNAL_THREAD_EVENT_RESUMED | RUBY_INTERNAL_THREAD_EVENT_EXITED)
+#endif
+
+static rb_internal_thread_event_hook_t *ruby_profiler_thread_hook = NULL;
+
+// Incremented whenever the hooks are removed, since threads may run without them, so states saved before then may be stale:
+static uint64_t ruby_profiler_thread_generation = 0;
+
+#if defined(RUBY_PROFILER_THREAD_SPECIFIC)
+
+// Per Ruby thread data, which is used without the GVL:
+struct Ruby_Profiler_Thread {
+	// The fiber data (or inherited state) whose states the thread published when it last released the GVL (see `ruby_profiler_fiber_source`), which is kept alive by its current fiber:
+	VALUE source;
+	
+	// The fiber state cache of the native thread it last ran on:
+	struct Ruby_Profiler_Cache *cache;
+	
+	// The generation of the hooks when the source was saved:
+	uint64_t generation;
+};
+
+static rb_internal_thread_specific_key_t ruby_profiler_thread_key;
+static int ruby_profiler_thread_key_created = 0;
+
+static struct Ruby_Profiler_Thread *Ruby_Profiler_Thread_record(VALUE thread) {
+	struct Ruby_Profiler_Thread *record = rb_internal_thread_specific_get(thread, ruby_profiler_thread_key);
+	
+	if (!record) {
+		record = calloc(1, sizeof(*record));
+		if (!record) return NULL;
+		
+		record->source = Qnil;
+		
+		rb_internal_thread_specific_set(thread, ruby_profiler_thread_key, record);
+	}
+	
+	return record;
+}
+
+#endif
+
+static void Ruby_Profiler_Thread_callback(rb_event_flag_t event, const rb_internal_thread_event_data_t *event_data, void *data) {
+#if defined(RUBY_PROFILER_THREAD_SPECIFIC)
+	VALUE thread = event_data->thread;
+	struct Ruby_Profiler_Thread *record = rb_internal_thread_specific_get(thread, ruby_profiler_thread_key);
+#endif
+	
+	switch (event) {
+#if defined(RUBY_PROFILER_THREAD_SPECIFIC)
+		case RUBY_INTERNAL_THREAD_EVENT_STARTED:
+			// This may run on the thread which created the new thread, so only prepare the record, which the new thread publishes when it first acquires the GVL (it has no state yet):
+			Ruby_Profiler_Thread_record(thread);
+			break;
+		
+		case RUBY_INTERNAL_THREAD_EVENT_SUSPENDED:
+			record = Ruby_Profiler_Thread_record(thread);
+			if (!record) return;
+			
+			record->source = ruby_profiler_fiber_source;
+			record->generation = ruby_profiler_thread_generation;
+			record->cache = &ruby_profiler_cache;
+			
+			// The native thread may go on to run other Ruby threads, so stop charging its CPU time to this one:
+			Ruby_Profiler_State_charge_slow(NULL);
+			break;
+#endif
+		
+		case RUBY_INTERNAL_THREAD_EVENT_RESUMED:
+			// Register the native thread as soon as it runs Ruby code, so that readers can find it before it applies a state:
+			Ruby_Profiler_Registry_current();
+			
+			// Timers measure the CPU time of a native thread, so every native thread which runs Ruby code needs one while a sampler is running:
+			Ruby_Profiler_Sampler_arm();
+			
+#if defined(RUBY_PROFILER_THREAD_SPECIFIC)
+			// The thread started before the hook was installed, and hasn't released the GVL since, so it has not run anywhere else:
+			if (!record) return;
+			
+			// The thread may have applied states to new fibers while running on another native thread, in which case the cache of this one may be stale:
+			if (record->cache != &ruby_profiler_cache) {
+				Ruby_Profiler_Cache_reset();
+				record->cache = &ruby_profiler_cache;
+			}
+			
+			// The thread may have switched fibers while the hooks were removed, in which case the saved fiber data may have been freed, so its states are published again when it next switches fibers or applies a state:
+			if (record->generation != ruby_profiler_thread_generation) {
+				record->source = Qnil;
+			}
+			
+			// While the thread didn't hold the GVL, its states may have been grown or replaced by other threads, and its previous tables freed, so look them up again:
+			Ruby_Profiler_Fiber_publish_source(record->source);
+#endif
+			break;
+		
+		case RUBY_INTERNAL_THREAD_EVENT_EXITED:
+			// The native thread may go on to run other Ruby threads (or be reused for a new one), and the states of this thread may be freed, so stop publishing them:
+			Ruby_Profiler_State_publish(NULL, NULL, 0);
+			Ruby_Profiler_State_charge_slow(NULL);
+			
+#if defined(RUBY_PROFILER_THREAD_SPECIFIC)
+			if (record) {
+				rb_internal_thread_specific_set(thread, ruby_profiler_thread_key, NULL);
+				free(record);
+			}
+#endif
+			break;
+	}
+}
+
+void Ruby_Profiler_Thread_install(void) {
+	if (ruby_profiler_thread_hook) return;
+	
+#if defined(RUBY_PROFILER_THREAD_SPECIFIC)
+	if (!ruby_profiler_thread_key_created) {
+		ruby_profiler_thread_key = rb_internal_thread_specific_key_create();
+		ruby_profiler_thread_key_created = 1;
+	}
+#endif
+	
+	ruby_profiler_thread_hook = rb_internal_thread_add_event_hook(Ruby_Profiler_Thread_callback, RUBY_PROFILER_THREAD_EVENTS, NULL);
+}
+
+void Ruby_Profiler_Thread_remove(void) {
+	if (!ruby_profiler_thread_hook) return;
+	
+	rb_internal_thread_remove_event_hook(ruby_profiler_thread_hook);
+	ruby_profiler_thread_hook = NULL;
+	ruby_profiler_thread_generation++;
+}
+
+#else
+
+void Ruby_Profiler_Thread_install(void) {
+}
+
+void Ruby_Profiler_Thread_remove(void) {
+}
+
+#endif
@@ -0,0 +1,20 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+
+// `ruby_profiler_state` belongs to the native thread, and is updated by fiber switches. A Ruby thread can also start, stop, and finish running on a native thread without a fiber switch, so we also hook the thread events of the GVL:
+//
+// - When a Ruby thread acquires the GVL, its native thread is registered (so that readers can find it before it applies a state), and the state of the Ruby thread is looked up again and published (a new thread has none until it begins, when the state it inherited, if any, is published by the fiber switch hook).
+// - When a Ruby thread releases the GVL, we save the fiber data (or inherited state) it published (and stop charging CPU time to it, see `State.cpu_time=`, until it acquires the GVL again).
+// - When a Ruby thread exits, we stop publishing its state, since the native thread may be reused, and the state may be freed.
+//
+// Under the M:N thread scheduler (`RUBY_MN_THREADS=1`) many Ruby threads share each native thread, and may migrate between them, so the saved state is published again on whichever native thread the Ruby thread runs on next. Saving states requires the thread specific data of Ruby 3.3+; on Ruby 3.2 only registration and exit are handled, which is sufficient for the 1:1 thread scheduler. Without the internal thread event hooks, the hooks are not installed.
+
+// Install the thread event hooks, if supported.
+void Ruby_Profiler_Thread_install(void);
+
+// Remove the thread event hooks.
+void Ruby_Profiler_Thread_remove(void);
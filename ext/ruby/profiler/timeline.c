@@ -0,0 +1,170 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#include "timeline.h"
+#include "registry.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+struct Ruby_Profiler_Timeline ruby_profiler_timeline = {
+	.magic = RUBY_PROFILER_TIMELINE_MAGIC,
+	.version = RUBY_PROFILER_TIMELINE_VERSION,
+};
+
+static _Thread_local struct Ruby_Profiler_Timeline_Buffer *ruby_profiler_timeline_buffer = NULL;
+static _Thread_local uint64_t ruby_profiler_timeline_tid = 0;
+
+// Whether this thread has tried to acquire a buffer (so that we don't retry if there are too many):
+static _Thread_local int ruby_profiler_timeline_attempted = 0;
+
+// Protects adding new buffers:
+static pthread_mutex_t ruby_profiler_timeline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t ruby_profiler_timeline_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ruby_profiler_timeline_key;
+
+// Release the buffer of a thread when it exits, so that it can be reused by another thread (the records remain readable until then):
+static void Ruby_Profiler_Timeline_release(void *argument) {
+	struct Ruby_Profiler_Timeline_Buffer *buffer = (struct Ruby_Profiler_Timeline_Buffer*)argument;
+	
+	atomic_store_explicit(&buffer->owned, 0, memory_order_release);
+}
+
+static void Ruby_Profiler_Timeline_key_create(void) {
+	pthread_key_create(&ruby_profiler_timeline_key, Ruby_Profiler_Timeline_release);
+}
+
+static struct Ruby_Profiler_Timeline_Buffer *Ruby_Profiler_Timeline_acquire(void) {
+	struct Ruby_Profiler_Timeline *timeline = &ruby_profiler_timeline;
+	struct Ruby_Profiler_Timeline_Buffer *buffer = NULL;
+	
+	if (ruby_profiler_timeline_attempted) {
+		return NULL;
+	}
+	
+	ruby_profiler_timeline_attempted = 1;
+	ruby_profiler_timeline_tid = Ruby_Profiler_Registry_tid();
+	
+	pthread_once(&ruby_profiler_timeline_key_once, Ruby_Profiler_Timeline_key_create);
+	
+	// Reuse the buffer of a thread which has exited:
+	uint64_t count = atomic_load_explicit(&timeline->count, memory_order_acquire);
+	
+	for (uint64_t i = 0; i < count && !buffer; i++) {
+		uint32_t owned = 0;
+		
+		if (atomic_compare_exchange_strong(&timeline->buffers[i]->owned, &owned, 1)) {
+			buffer = timeline->buffers[i];
+		}
+	}
+	
+	// Otherwise, add a new buffer:
+	if (!buffer) {
+		pthread_mutex_lock(&ruby_profiler_timeline_mutex);
+		
+		count = atomic_load_explicit(&timeline->count, memory_order_relaxed);
+		
+		if (count < RUBY_PROFILER_TIMELINE_MAXIMUM_BUFFERS) {
+			buffer = calloc(1, sizeof(struct Ruby_Profiler_Timeline_Buffer));
+			
+			if (buffer) {
+				buffer->owned = 1;
+				buffer->capacity = RUBY_PROFILER_TIMELINE_BUFFER_CAPACITY;
+				
+				timeline->buffers[count] = buffer;
+				atomic_store_explicit(&timeline->count, count + 1, memory_order_release);
+			}
+		}
+		
+		pthread_mutex_unlock(&ruby_profiler_timeline_mutex);
+	}
+	
+	if (!buffer) {
+		atomic_fetch_add_explicit(&timeline->dropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+	
+	pthread_setspecific(ruby_profiler_timeline_key, buffer);
+	ruby_profiler_timeline_buffer = buffer;
+	
+	return buffer;
+}
+
+void Ruby_Profiler_Timeline_record_slow(VALUE fiber, struct Ruby_Profiler_State *state) {
+	struct Ruby_Profiler_Timeline_Buffer *buffer = ruby_profiler_timeline_buffer;
+	
+	if (!buffer) {
+		buffer = Ruby_Profiler_Timeline_acquire();
+		
+		if (!buffer) return;
+	}
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	// Only this thread writes the head, so a relaxed load is sufficient:
+	uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+	struct Ruby_Profiler_Transition *transition = &buffer->records[head & (RUBY_PROFILER_TIMELINE_BUFFER_CAPACITY - 1)];
+	
+	transition->timestamp = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+	transition->tid = ruby_profiler_timeline_tid;
+	transition->fiber = fiber;
+	transition->state = state;
+	
+	// Release the record:
+	atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+static VALUE Ruby_Profiler_Timeline_s_enable(VALUE klass) {
+	atomic_store_explicit(&ruby_profiler_timeline.enabled, 1, memory_order_relaxed);
+	
+	return Qtrue;
+}
+
+static VALUE Ruby_Profiler_Timeline_s_disable(VALUE klass) {
+	atomic_store_explicit(&ruby_profiler_timeline.enabled, 0, memory_order_relaxed);
+	
+	return Qfalse;
+}
+
+static VALUE Ruby_Profiler_Timeline_s_enabled_p(VALUE klass) {
+	return atomic_load_explicit(&ruby_profiler_timeline.enabled, memory_order_relaxed) ? Qtrue : Qfalse;
+}
+
+// Get the transitions recorded by the current thread which are still in its buffer, oldest first:
+static VALUE Ruby_Profiler_Timeline_s_records(VALUE klass) {
+	struct Ruby_Profiler_Timeline_Buffer *buffer = ruby_profiler_timeline_buffer;
+	VALUE records = rb_ary_new();
+	
+	if (!buffer) return records;
+	
+	uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+	uint64_t start = head > RUBY_PROFILER_TIMELINE_BUFFER_CAPACITY ? head - RUBY_PROFILER_TIMELINE_BUFFER_CAPACITY : 0;
+	
+	for (uint64_t i = start; i < head; i++) {
+		struct Ruby_Profiler_Transition *transition = &buffer->records[i & (RUBY_PROFILER_TIMELINE_BUFFER_CAPACITY - 1)];
+		
+		VALUE record = rb_hash_new();
+		rb_hash_aset(record, ID2SYM(rb_intern("timestamp")), ULL2NUM(transition->timestamp));
+		rb_hash_aset(record, ID2SYM(rb_intern("tid")), ULL2NUM(transition->tid));
+		rb_hash_aset(record, ID2SYM(rb_intern("fiber")), ULL2NUM((uint64_t)transition->fiber));
+		rb_hash_aset(record, ID2SYM(rb_intern("state")), ULL2NUM((uint64_t)(uintptr_t)transition->state));
+		
+		rb_ary_push(records, record);
+	}
+	
+	return records;
+}
+
+void Init_Ruby_Profiler_Timeline(VALUE Ruby_Profiler) {
+	VALUE Ruby_Profiler_Timeline = rb_define_module_under(Ruby_Profiler, "Timeline");
+	
+	rb_define_const(Ruby_Profiler_Timeline, "BUFFER_CAPACITY", INT2NUM(RUBY_PROFILER_TIMELINE_BUFFER_CAPACITY));
+	
+	rb_define_singleton_method(Ruby_Profiler_Timeline, "enable!", Ruby_Profiler_Timeline_s_enable, 0);
+	rb_define_singleton_method(Ruby_Profiler_Timeline, "disable!", Ruby_Profiler_Timeline_s_disable, 0);
+	rb_define_singleton_method(Ruby_Profiler_Timeline, "enabled?", Ruby_Profiler_Timeline_s_enabled_p, 0);
+	rb_define_singleton_method(Ruby_Profiler_Timeline, "records", Ruby_Profiler_Timeline_s_records, 0);
+}
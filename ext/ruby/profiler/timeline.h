@@ -0,0 +1,87 @@
+// Released under the MIT License.
+// Copyright, 2025, by Samuel Williams.
+
+#pragma once
+
+#include <ruby.h>
+#include <stdatomic.h>
+
+struct Ruby_Profiler_State;
+
+// "RPTL" in memory order on little-endian systems:
+#define RUBY_PROFILER_TIMELINE_MAGIC 0x4C545052
+
+#define RUBY_PROFILER_TIMELINE_VERSION 1
+
+// Number of records in each thread's buffer (must be a power of 2):
+#define RUBY_PROFILER_TIMELINE_BUFFER_CAPACITY 4096
+
+// Maximum number of buffers (threads which have recorded transitions at the same time):
+#define RUBY_PROFILER_TIMELINE_MAXIMUM_BUFFERS 1024
+
+struct Ruby_Profiler_Transition {
+	// CLOCK_MONOTONIC time in nanoseconds:
+	uint64_t timestamp;
+	
+	// Thread ID (as returned by gettid):
+	uint64_t tid;
+	
+	// The fiber which is now running (an opaque identifier, it may be moved or freed after the record is written):
+	VALUE fiber;
+	
+	// The state which is now published (NULL for none):
+	struct Ruby_Profiler_State *state;
+};
+
+// A single-producer ring buffer of transitions for one thread. The producer never waits for readers: it writes record `head % capacity` and then increments `head`, overwriting the oldest records once the buffer is full. A reader keeps its own position and after copying records [position, head) must re-read `head`: any record with index <= head - capacity (using the re-read head) may have been overwritten while it was being copied, and must be discarded.
+struct Ruby_Profiler_Timeline_Buffer {
+	// Whether the buffer belongs to a running thread (buffers are reused once their thread exits):
+	_Atomic uint32_t owned;
+	
+	uint32_t reserved;
+	
+	// Number of records in the buffer (RUBY_PROFILER_TIMELINE_BUFFER_CAPACITY):
+	uint64_t capacity;
+	
+	// Total number of records ever written (release), never reset:
+	_Atomic uint64_t head;
+	
+	struct Ruby_Profiler_Transition records[RUBY_PROFILER_TIMELINE_BUFFER_CAPACITY];
+};
+
+// Describes all transition buffers, so that an external reader can find and drain them without stopping the process. This is considered a public interface for BPF programs and other readers.
+struct Ruby_Profiler_Timeline {
+	// Always RUBY_PROFILER_TIMELINE_MAGIC:
+	uint32_t magic;
+	
+	// Layout version (RUBY_PROFILER_TIMELINE_VERSION):
+	uint32_t version;
+	
+	// Whether transitions are being recorded:
+	_Atomic uint32_t enabled;
+	
+	uint32_t reserved;
+	
+	// Number of entries of `buffers` in use (release, after the buffer pointer is stored):
+	_Atomic uint64_t count;
+	
+	// Number of threads which couldn't record transitions because there were too many buffers:
+	_Atomic uint64_t dropped;
+	
+	// Buffers are never freed, so these pointers remain valid:
+	struct Ruby_Profiler_Timeline_Buffer *buffers[RUBY_PROFILER_TIMELINE_MAXIMUM_BUFFERS];
+};
+
+// Process-wide timeline descriptor (public symbol for external readers)
+extern struct Ruby_Profiler_Timeline ruby_profiler_timeline;
+
+void Ruby_Profiler_Timeline_record_slow(VALUE fiber, struct Ruby_Profiler_State *state);
+
+// Record a transition on the current thread, if enabled.
+static inline void Ruby_Profiler_Timeline_record(VALUE fiber, struct Ruby_Profiler_State *state) {
+	if (RB_UNLIKELY(atomic_load_explicit(&ruby_profiler_timeline.enabled, memory_order_relaxed))) {
+		Ruby_Profiler_Timeline_record_slow(fiber, state);
+	}
+}
+
+void Init_Ruby_Profiler_Timeline(VALUE Ruby_Profiler);
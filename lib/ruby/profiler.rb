@@ -5,6 +5,3 @@
 
 require_relative "profiler/version"
 require_relative "profiler/native"
-
-# Define fiber-local accessor for profiler state:
-Fiber.attr_accessor :ruby_profiler_state
@@ -0,0 +1,222 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+require "ruby/profiler"
+require "rbconfig"
+
+describe Ruby::Profiler do
+	after do
+		subject.enable!
+		Fiber.current.ruby_profiler_state = nil
+	end
+	
+	# Load the same library and extension as this process:
+	let(:load_path) do
+		$LOADED_FEATURES.grep(%r{/(ruby/profiler\.rb|Ruby_Profiler\.\w+)$}).map do |path|
+			"-I#{path.delete_suffix("ruby/profiler.rb").delete_suffix(File.basename(path))}"
+		end
+	end
+	
+	it "installs the fiber switch hook when a state is first applied" do
+		script = <<~RUBY
+			require "ruby/profiler"
+			
+			print Ruby::Profiler.enabled?, " "
+			Ruby::Profiler::State.new(request_id: "abc").apply!
+			print Ruby::Profiler.enabled?
+		RUBY
+		
+		output = IO.popen([RbConfig.ruby, *load_path, "-e", script], &:read)
+		
+		expect(output).to be == "false true"
+	end
+	
+	it "can be disabled and enabled" do
+		subject.disable!
+		expect(subject.enabled?).to be == false
+		
+		Ruby::Profiler::State.new(request_id: "abc").apply!
+		expect(subject.enabled?).to be == false
+		
+		subject.enable!
+		expect(subject.enabled?).to be == true
+	end
+	
+	it "doesn't publish states while disabled" do
+		timeline = Ruby::Profiler::Timeline
+		timeline.enable!
+		subject.disable!
+		
+		count = timeline.records.size
+		
+		Fiber.new do
+			Ruby::Profiler::State.new(request_id: "abc").apply!
+		end.resume
+		
+		expect(timeline.records.size).to be == count
+	ensure
+		timeline.disable!
+	end
+	
+	it "publishes the states of fibers after being enabled again" do
+		fibers = 3.times.map do |index|
+			Fiber.new do
+				Ruby::Profiler::State.new(index: index).apply!
+				
+				loop{Fiber.yield(Ruby::Profiler::State.published)}
+			end
+		end
+		
+		expect(fibers.map(&:resume)).to be == [{index: 0}, {index: 1}, {index: 2}]
+		
+		# Fibers may be moved while disabled, since the cache of fiber states isn't invalidated by garbage collection until enabled again:
+		subject.disable!
+		expect(fibers.map(&:resume)).to be == [nil, nil, nil]
+		GC.respond_to?(:compact) ? GC.compact : GC.start
+		
+		subject.enable!
+		expect(fibers.map(&:resume)).to be == [{index: 0}, {index: 1}, {index: 2}]
+	end
+	
+	with "threads" do
+		let(:script) do
+			<<~RUBY
+				require "ruby/profiler"
+				
+				threads = 8.times.map do |index|
+					Thread.new do
+						Ruby::Profiler::State.new(index: index).apply!
+						errors = 0
+						
+						1000.times do |iteration|
+							Thread.pass
+							sleep(0.0001) if iteration % 10 == 0
+							
+							errors += 1 unless Ruby::Profiler::State.published == {index: index}
+						end
+						
+						errors
+					end
+				end
+				
+				print threads.sum(&:value)
+			RUBY
+		end
+		
+		it "publishes the state of each thread" do
+			output = IO.popen([RbConfig.ruby, *load_path, "-e", script], &:read)
+			
+			expect(output).to be == "0"
+		end
+		
+		it "registers threads when they start" do
+			subject.enable!
+			
+			registered = Thread.new do
+				Ruby::Profiler::State.registry.include?(Thread.current.native_thread_id)
+			end.value
+			
+			expect(registered).to be == true
+		end
+		
+		it "publishes the inherited state for new threads" do
+			subject.enable!
+			Ruby::Profiler::State.new(request_id: "abc").apply!
+			
+			expect(Thread.new{Ruby::Profiler::State.published}.value).to be == {request_id: "abc"}
+		end
+		
+		it "doesn't publish a state for new threads if inheritance is disabled" do
+			subject.enable!
+			Ruby::Profiler::State.inherit = false
+			Ruby::Profiler::State.new(request_id: "abc").apply!
+			
+			expect(Thread.new{Ruby::Profiler::State.published}.value).to be_nil
+		ensure
+			Ruby::Profiler::State.inherit = true
+		end
+		
+		it "publishes states grown while a thread was waiting" do
+			skip "Saving states requires Ruby 3.3+" if RUBY_VERSION < "3.3"
+			
+			subject.enable!
+			state = Ruby::Profiler::State.new(request_id: "abc")
+			queue = Thread::Queue.new
+			
+			thread = Thread.new do
+				state.apply!
+				queue.pop
+				Ruby::Profiler::State.published
+			end
+			
+			Thread.pass until thread.status == "sleep"
+			state.update!(a: 1, b: 2, c: 3, d: 4, e: 5, f: 6, g: 7, h: 8)
+			queue << true
+			
+			expect(thread.value).to be == state.to_h
+		end
+		
+		it "publishes states replaced while a thread was waiting" do
+			skip "Saving states requires Ruby 3.3+" if RUBY_VERSION < "3.3"
+			
+			subject.enable!
+			queue = Thread::Queue.new
+			fibers = Thread::Queue.new
+			
+			thread = Thread.new do
+				Ruby::Profiler::State.new(request_id: "abc").apply!
+				fibers << Fiber.current
+				queue.pop
+				Ruby::Profiler::State.published
+			end
+			
+			fiber = fibers.pop
+			Thread.pass until thread.status == "sleep"
+			
+			# Replace the state of the waiting thread's fiber, so that its previous state can be freed:
+			fiber.ruby_profiler_state = Ruby::Profiler::State.new(request_id: "xyz")
+			GC.start
+			queue << true
+			
+			expect(thread.value).to be == {request_id: "xyz"}
+		end
+		
+		it "publishes the inherited state for new threads under the M:N thread scheduler" do
+			skip "M:N threads require Ruby 3.3+" if RUBY_VERSION < "3.3"
+			
+			script = <<~RUBY
+				require "ruby/profiler"
+				
+				errors = 0
+				
+				threads = 8.times.map do |index|
+					Thread.new do
+						Ruby::Profiler::State.new(index: index).apply!
+						
+						20.times do
+							Thread.pass
+							errors += 1 unless Thread.new{Ruby::Profiler::State.published}.value == {index: index}
+						end
+					end
+				end
+				
+				threads.each(&:join)
+				print errors
+			RUBY
+			
+			output = IO.popen({"RUBY_MN_THREADS" => "1"}, [RbConfig.ruby, *load_path, "-e", script], &:read)
+			
+			expect(output).to be == "0"
+		end
+		
+		it "publishes the state of each thread under the M:N thread scheduler" do
+			skip "M:N threads require Ruby 3.3+" if RUBY_VERSION < "3.3"
+			
+			output = IO.popen({"RUBY_MN_THREADS" => "1"}, [RbConfig.ruby, *load_path, "-e", script], &:read)
+			
+			expect(output).to be == "0"
+		end
+	end
+end
@@ -0,0 +1,103 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+require "ruby/profiler"
+require "json"
+require "rbconfig"
+require "tmpdir"
+require "fileutils"
+
+describe "ruby-profiler-reader" do
+	let(:source) {File.expand_path("../../../ext/ruby/profiler/reader", __dir__)}
+	
+	before do
+		unless RUBY_PLATFORM.include?("linux") && system("make", "--version", out: File::NULL, err: File::NULL)
+			skip "The reader requires Linux and make!"
+		end
+		
+		@output = Dir.mktmpdir
+		
+		unless system("make", "-s", "-C", source, "OUTPUT=#{@output}", out: File::NULL)
+			skip "Could not build the reader!"
+		end
+	end
+	
+	after do
+		FileUtils.rm_rf(@output) if @output
+	end
+	
+	# Load the same library and extension as this process:
+	let(:load_path) do
+		$LOADED_FEATURES.grep(%r{/(ruby/profiler\.rb|Ruby_Profiler\.\w+)$}).map do |path|
+			"-I#{path.delete_suffix("ruby/profiler.rb").delete_suffix(File.basename(path))}"
+		end
+	end
+	
+	# Read the state of each thread of a process:
+	def read(pid)
+		output = IO.popen([File.join(@output, "ruby-profiler-reader"), pid.to_s], &:read)
+		
+		output.lines.map{|line| JSON.parse(line)}
+	end
+	
+	it "can read the state of each thread of another process" do
+		script = <<~RUBY
+			require "ruby/profiler"
+			
+			Ruby::Profiler::State.snapshot = true
+			Ruby::Profiler::State.new(request_id: "abc123", count: 42).apply!
+			
+			Thread.new do
+				Ruby::Profiler::State.new(worker: :background).derive(job: 7).apply!
+				sleep
+			end
+			
+			sleep 0.1
+			$stdout.puts "ready"
+			$stdout.flush
+			sleep
+		RUBY
+		
+		IO.popen([RbConfig.ruby, *load_path, "-e", script]) do |child|
+			expect(child.gets).to be == "ready\n"
+			
+			samples = read(child.pid)
+			pairs = samples.map{|sample| sample["pairs"]}
+			
+			expect(samples.size).to be == 2
+			expect(pairs.include?({"request_id" => "abc123", "count" => 42})).to be == true
+			expect(pairs.include?({"job" => 7, "worker" => "background"})).to be == true
+		ensure
+			Process.kill(:KILL, child.pid)
+		end
+	end
+	
+	it "doesn't read the states of other threads after the profiler is disabled" do
+		script = <<~RUBY
+			require "ruby/profiler"
+			
+			Ruby::Profiler::State.new(request_id: "abc123").apply!
+			
+			Thread.new do
+				Ruby::Profiler::State.new(worker: :background).apply!
+				sleep
+			end
+			
+			sleep 0.1
+			Ruby::Profiler.disable!
+			$stdout.puts "ready"
+			$stdout.flush
+			sleep
+		RUBY
+		
+		IO.popen([RbConfig.ruby, *load_path, "-e", script]) do |child|
+			expect(child.gets).to be == "ready\n"
+			
+			expect(read(child.pid)).to be == []
+		ensure
+			Process.kill(:KILL, child.pid)
+		end
+	end
+end
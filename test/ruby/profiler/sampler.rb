@@ -0,0 +1,228 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+require "ruby/profiler"
+
+describe Ruby::Profiler::Sampler do
+	let(:sampler) {subject.new(:endpoint, frequency: 1000)}
+	
+	before do
+		skip "Sampling requires Linux!" unless subject.supported?
+	end
+	
+	after do
+		sampler.stop
+		Fiber.current.ruby_profiler_state = nil
+		
+		Ruby::Profiler::State.fingerprint = false
+		Ruby::Profiler::State.snapshot = false
+	end
+	
+	# Use the given amount of CPU time:
+	def work(duration)
+		start = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID)
+		
+		while Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) - start < duration
+			100.times.sum
+		end
+	end
+	
+	it "has a key, frequency and capacity" do
+		expect(sampler).to have_attributes(
+			key: be == :endpoint,
+			frequency: be == 1000.0,
+			capacity: be == subject::DEFAULT_CAPACITY,
+			running?: be == false
+		)
+	end
+	
+	it "rejects keys which aren't symbols" do
+		expect{subject.new("endpoint")}.to raise_exception(TypeError)
+	end
+	
+	it "rejects invalid frequencies" do
+		expect{subject.new(:endpoint, frequency: 0)}.to raise_exception(ArgumentError)
+	end
+	
+	it "counts samples against the value of the key" do
+		sampler.start
+		expect(sampler.running?).to be == true
+		
+		Fiber.new do
+			Ruby::Profiler::State.new(endpoint: "/users").apply!
+			work(0.1)
+			
+			Ruby::Profiler::State.new(endpoint: :posts).derive(user_id: 1).apply!
+			work(0.1)
+			
+			Ruby::Profiler::State.new(endpoint: 42).apply!
+			work(0.1)
+		end.resume
+		
+		sampler.stop
+		samples = sampler.samples
+		
+		expect(samples["/users"]).to be > 0
+		expect(samples[:posts]).to be > 0
+		expect(samples[42]).to be > 0
+		expect(samples.values.sum).to be == sampler.total
+	end
+	
+	it "labels truncated symbols with strings" do
+		sampler.start
+		
+		Fiber.new do
+			Ruby::Profiler::State.new(endpoint: ("x" * 200).to_sym).apply!
+			work(0.1)
+		end.resume
+		
+		sampler.stop
+		label = sampler.samples.keys.first
+		
+		expect(label).to be == "x" * label.size
+		expect(label.frozen?).to be == true
+	end
+	
+	it "counts samples without a value against nil" do
+		sampler.start
+		
+		Fiber.new do
+			Ruby::Profiler::State.new(request_id: "abc").apply!
+			work(0.1)
+		end.resume
+		
+		sampler.stop
+		
+		expect(sampler.samples[nil]).to be > 0
+		expect(sampler.samples.keys).to be == [nil]
+	end
+	
+	it "samples other threads" do
+		sampler.start
+		
+		Thread.new do
+			Ruby::Profiler::State.new(endpoint: "/thread").apply!
+			work(0.1)
+		end.join
+		
+		sampler.stop
+		
+		expect(sampler.samples["/thread"]).to be > 0
+	end
+	
+	it "samples forked child processes" do
+		skip "Process.fork not supported" unless Process.respond_to?(:fork)
+		
+		sampler.start
+		input, output = IO.pipe
+		
+		pid = Process.fork do
+			input.close
+			
+			Fiber.new do
+				Ruby::Profiler::State.new(endpoint: "/child").apply!
+				work(0.1)
+			end.resume
+			
+			sampler.stop
+			output.write(Marshal.dump(sampler.samples["/child"]))
+			output.close
+			exit!(0)
+		end
+		
+		output.close
+		child = Marshal.load(input.read)
+		Process.wait(pid)
+		
+		# Stopping the sampler in the child doesn't affect the parent:
+		Fiber.new do
+			Ruby::Profiler::State.new(endpoint: "/parent").apply!
+			work(0.1)
+		end.resume
+		
+		sampler.stop
+		
+		expect(child).to be > 0
+		expect(sampler.samples["/parent"]).to be > 0
+		expect(sampler.samples["/child"]).to be_nil
+	end
+	
+	it "stops sampling" do
+		sampler.start
+		sampler.stop
+		expect(sampler.running?).to be == false
+		
+		total = sampler.total
+		work(0.05)
+		
+		expect(sampler.total).to be == total
+	end
+	
+	it "drops samples once the table is full" do
+		sampler = subject.new(:endpoint, frequency: 1000, capacity: 1)
+		sampler.start
+		
+		Fiber.new do
+			Ruby::Profiler::State.new(endpoint: "/users").apply!
+			work(0.05)
+			
+			Ruby::Profiler::State.new(endpoint: "/posts").apply!
+			work(0.05)
+		end.resume
+		
+		sampler.stop
+		
+		expect(sampler.samples.size).to be == 1
+		expect(sampler.dropped).to be > 0
+	ensure
+		sampler&.stop
+	end
+	
+	it "labels values without fingerprints or snapshots" do
+		sampler.start
+		
+		expect(Ruby::Profiler::State.fingerprint?).to be == false
+		expect(Ruby::Profiler::State.snapshot?).to be == false
+		
+		state = Ruby::Profiler::State.new(endpoint: "/users")
+		
+		Fiber.new do
+			state.apply!
+			work(0.1)
+		end.resume
+		
+		sampler.stop
+		
+		expect(state.fingerprint(:endpoint)).to be_nil
+		expect(state.snapshot(:endpoint)).to be_nil
+		expect(sampler.samples["/users"]).to be > 0
+	end
+	
+	it "labels values which are changed in place" do
+		sampler.start
+		
+		Fiber.new do
+			state = Ruby::Profiler::State.new(endpoint: "/users")
+			state.apply!
+			work(0.05)
+			
+			state[:endpoint] = "/posts"
+			work(0.05)
+		end.resume
+		
+		sampler.stop
+		
+		expect(sampler.samples["/users"]).to be > 0
+		expect(sampler.samples["/posts"]).to be > 0
+		expect(sampler.unknown).to be == 0
+	end
+	
+	it "only runs one sampler at a time" do
+		sampler.start
+		
+		other = subject.new(:endpoint)
+		expect{other.start}.to raise_exception(RuntimeError)
+	end
+end
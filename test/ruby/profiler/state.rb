@@ -4,8 +4,15 @@
 # Copyright, 2025, by Samuel Williams.
 
 require "ruby/profiler"
+require "weakref"
+require "objspace"
 
 describe Ruby::Profiler::State do
+	# States applied to the current fiber are inherited by the fibers of later tests:
+	after do
+		Fiber.current.ruby_profiler_state = nil
+	end
+	
 	with "#initialize" do
 		it "can create an empty state" do
 			state = subject.new
@@ -56,6 +63,338 @@ describe Ruby::Profiler::State do
 				expect(state_value).to be == state
 			end.resume
 		end
+		
+		it "can't assign other objects to a fiber" do
+			expect{Fiber.current.ruby_profiler_state = "test"}.to raise_exception(TypeError)
+		end
+		
+		with "fiber switches" do
+			let(:timeline) {Ruby::Profiler::Timeline}
+			
+			before do
+				Ruby::Profiler.enable!
+				timeline.enable!
+			end
+			
+			after do
+				timeline.disable!
+			end
+			
+			# Resume the fiber and get the state published while it was running:
+			def published(fiber)
+				fiber.resume
+				timeline.records[-2][:state]
+			end
+			
+			it "publishes the applied state of each fiber" do
+				fibers = 200.times.map do |index|
+					Fiber.new do
+						subject.new(index: index).apply! if index.odd?
+						loop{Fiber.yield}
+					end
+				end
+				
+				states = fibers.map{|fiber| published(fiber)}
+				
+				expect(states.each_slice(2).map(&:first).uniq).to be == [0]
+				expect(states.each_slice(2).map(&:last).uniq.size).to be == 100
+				expect(fibers.map{|fiber| published(fiber)}).to be == states
+				
+				GC.start
+				GC.compact if GC.respond_to?(:compact)
+				
+				expect(fibers.map{|fiber| published(fiber)}).to be == states
+			end
+			
+			it "publishes the state assigned to a fiber" do
+				fiber = Fiber.new do
+					subject.new(request_id: "test").apply!
+					loop{Fiber.yield}
+				end
+				
+				expect(published(fiber)).to be > 0
+				
+				fiber.ruby_profiler_state = nil
+				expect(published(fiber)).to be == 0
+				
+				fiber.ruby_profiler_state = subject.new(request_id: "other")
+				expect(published(fiber)).to be > 0
+			end
+		end
+	end
+	
+	with "#apply" do
+		it "applies the state while executing the block" do
+			state = subject.new(request_id: "test")
+			
+			Fiber.new do
+				result = state.apply do |applied|
+					expect(applied).to be == state
+					expect(Fiber.current.ruby_profiler_state).to be == state
+					expect(subject.published).to be == {request_id: "test"}
+					
+					:result
+				end
+				
+				expect(result).to be == :result
+				expect(Fiber.current.ruby_profiler_state).to be_nil
+				expect(subject.published).to be_nil
+			end.resume
+		end
+		
+		it "restores the previous state" do
+			outer = subject.new(request_id: "outer")
+			inner = subject.new(request_id: "inner")
+			
+			Fiber.new do
+				outer.apply!
+				
+				inner.apply do
+					expect(Fiber.current.ruby_profiler_state).to be == inner
+				end
+				
+				expect(Fiber.current.ruby_profiler_state).to be == outer
+				expect(subject.published).to be == {request_id: "outer"}
+			end.resume
+		end
+		
+		it "restores the previous state if the block raises" do
+			state = subject.new(request_id: "test")
+			
+			Fiber.new do
+				expect do
+					state.apply{raise ArgumentError}
+				end.to raise_exception(ArgumentError)
+				
+				expect(Fiber.current.ruby_profiler_state).to be_nil
+			end.resume
+		end
+		
+		it "requires a block" do
+			expect{subject.new.apply}.to raise_exception(LocalJumpError)
+		end
+		
+		with "nested scopes" do
+			before do
+				Ruby::Profiler.enable!
+			end
+			
+			it "publishes the enclosing states" do
+				Fiber.new do
+					subject.new(request_id: "r1").apply!
+					
+					subject.new(job: "j1").apply do
+						expect(subject.published_stack).to be == [{request_id: "r1"}]
+						
+						subject.new(query: "q1").apply do
+							expect(subject.published).to be == {query: "q1"}
+							expect(subject.published_stack).to be == [{request_id: "r1"}, {job: "j1"}]
+						end
+						
+						expect(subject.published_stack).to be == [{request_id: "r1"}]
+					end
+					
+					expect(subject.published).to be == {request_id: "r1"}
+					expect(subject.published_stack).to be == []
+				end.resume
+			end
+			
+			it "publishes the enclosing states of each fiber" do
+				inner = Fiber.new do
+					expect(subject.published_stack).to be == []
+					
+					subject.new(query: "q1").apply do
+						Fiber.yield
+						expect(subject.published_stack).to be == [nil]
+					end
+				end
+				
+				Fiber.new do
+					subject.new(request_id: "r1").apply do
+						inner.resume
+						expect(subject.published_stack).to be == [nil]
+						expect(subject.published).to be == {request_id: "r1"}
+						
+						inner.resume
+						expect(subject.published_stack).to be == [nil]
+					end
+				end.resume
+			end
+			
+			it "only records a limited number of enclosing states" do
+				Fiber.new do
+					nest = lambda do |depth, &block|
+						if depth == 0
+							block.call
+						else
+							subject.new(depth: depth).apply{nest.call(depth - 1, &block)}
+						end
+					end
+					
+					nest.call(12) do
+						expect(subject.published).to be == {depth: 1}
+						expect(subject.published_stack.size).to be == 8
+						expect(subject.published_stack.first).to be_nil
+						expect(subject.published_stack.last).to be == {depth: 6}
+					end
+					
+					subject.new(depth: 0).apply do
+						expect(subject.published_stack).to be == [nil]
+					end
+				end.resume
+			end
+			
+			it "publishes enclosing states which have grown" do
+				Fiber.new do
+					state = subject.new(request_id: "r1")
+					state.apply!
+					
+					subject.new(query: "q1").apply do
+						state.update!(a: 1, b: 2, c: 3, d: 4, e: 5)
+						
+						expect(subject.published_stack).to be == [state.to_h]
+					end
+				end.resume
+			end
+			
+			it "keeps publishing the enclosing states when the current state is freed" do
+				Fiber.new do
+					subject.new(request_id: "r1").apply!
+					
+					subject.new(job: "j1").apply do
+						# Replacing the state doesn't publish it, so the previous state is published until it's freed:
+						3.times{subject.new(query: "q1").apply!}
+						Fiber.current.ruby_profiler_state = nil
+						
+						# The state may be kept alive by a stale reference on the machine stack, so collect until it's freed:
+						10.times do
+							GC.start
+							break unless subject.published
+						end
+						
+						expect(subject.published).to be_nil
+						expect(subject.published_stack).to be == [{request_id: "r1"}]
+					end
+				end.resume
+			end
+		end
+	end
+	
+	with ".with" do
+		it "applies a new state if there is none" do
+			Fiber.new do
+				subject.with(request_id: "test") do |state|
+					expect(state.to_h).to be == {request_id: "test"}
+					expect(Fiber.current.ruby_profiler_state).to be == state
+				end
+				
+				expect(Fiber.current.ruby_profiler_state).to be_nil
+			end.resume
+		end
+		
+		it "updates the current state" do
+			outer = subject.new(request_id: "test", user_id: 1)
+			
+			Fiber.new do
+				outer.apply!
+				
+				subject.with(user_id: 2, action: "query") do |state|
+					expect(state.to_h).to be == {request_id: "test", user_id: 2, action: "query"}
+					expect(subject.published).to be == {request_id: "test", user_id: 2, action: "query"}
+				end
+				
+				expect(outer.to_h).to be == {request_id: "test", user_id: 1}
+				expect(Fiber.current.ruby_profiler_state).to be == outer
+			end.resume
+		end
+	end
+	
+	with ".inherit" do
+		after do
+			subject.inherit = true
+		end
+		
+		it "is enabled by default" do
+			expect(subject.inherit?).to be == true
+		end
+		
+		it "applies the state of the parent fiber to new fibers" do
+			state = subject.new(request_id: "test")
+			
+			Fiber.new do
+				state.apply!
+				
+				child = Fiber.new do
+					[Fiber.current.ruby_profiler_state, subject.published, Fiber.new{subject.published}.resume]
+				end
+				
+				expect(child.resume).to be == [state, {request_id: "test"}, {request_id: "test"}]
+			end.resume
+		end
+		
+		it "applies the state of the parent fiber to new threads" do
+			state = subject.new(request_id: "test")
+			
+			Fiber.new do
+				state.apply!
+				
+				expect(Thread.new{[Fiber.current.ruby_profiler_state, subject.published]}.value).to be == [state, {request_id: "test"}]
+			end.resume
+		end
+		
+		it "applies the state at the time the fiber was created" do
+			Fiber.new do
+				child = subject.with(request_id: "test") do
+					Fiber.new{subject.published}
+				end
+				
+				expect(subject.published).to be_nil
+				expect(child.resume).to be == {request_id: "test"}
+			end.resume
+		end
+		
+		it "applies the state restored after a block" do
+			state = subject.new(request_id: "test")
+			
+			Fiber.new do
+				state.apply!
+				state.apply!
+				subject.new(request_id: "block").apply{}
+				
+				expect(Fiber.new{subject.published}.resume).to be == {request_id: "test"}
+				
+				Fiber.new do
+					subject.new(request_id: "child").apply!
+					state.apply!
+					
+					expect(Fiber.new{subject.published}.resume).to be == {request_id: "test"}
+				end.resume
+			end.resume
+		end
+		
+		it "doesn't affect the parent fiber" do
+			state = subject.new(request_id: "test")
+			
+			Fiber.new do
+				state.apply!
+				
+				Fiber.new{subject.new(request_id: "child").apply!}.resume
+				
+				expect(subject.published).to be == {request_id: "test"}
+				expect(Fiber.new{subject.published}.resume).to be == {request_id: "test"}
+			end.resume
+		end
+		
+		it "can be disabled" do
+			subject.inherit = false
+			
+			Fiber.new do
+				subject.new(request_id: "test").apply!
+				
+				expect(Fiber.new{subject.published}.resume).to be_nil
+				expect(Thread.new{subject.published}.value).to be_nil
+			end.resume
+		end
 	end
 	
 	with "#size" do
@@ -76,6 +415,35 @@ describe Ruby::Profiler::State do
 		end
 	end
 	
+	with "#[]" do
+		it "returns the value for a key" do
+			state = subject.new(request_id: "abc123", user_id: 42)
+			
+			expect(state[:request_id]).to be == "abc123"
+			expect(state[:user_id]).to be == 42
+		end
+		
+		it "returns nil for missing keys" do
+			state = subject.new(request_id: "abc123")
+			
+			expect(state[:user_id]).to be_nil
+			expect(state[:"never_interned_#{rand}"]).to be_nil
+			expect(subject.new[:request_id]).to be_nil
+		end
+	end
+	
+	with "#to_h" do
+		it "returns all pairs" do
+			state = subject.new(request_id: "abc123", user_id: 42)
+			
+			expect(state.to_h).to be == {request_id: "abc123", user_id: 42}
+		end
+		
+		it "returns an empty hash for empty state" do
+			expect(subject.new.to_h).to be == {}
+		end
+	end
+	
 	with "hash table behavior" do
 		it "allocates capacity based on number of pairs" do
 			# 3 pairs should allocate capacity of 4 (next power of 2)
@@ -113,6 +481,522 @@ describe Ruby::Profiler::State do
 			state = subject.new(**pairs)
 			expect(state.size).to be == 33
 		end
+		
+		it "can look up keys in large states" do
+			pairs = {}
+			64.times do |i|
+				pairs[:"key_#{i}"] = i
+			end
+			
+			state = subject.new(**pairs)
+			
+			pairs.each do |key, value|
+				expect(state[key]).to be == value
+			end
+			
+			expect(state[:missing]).to be_nil
+			
+			updated = state.with(key_63: -1, extra: 64)
+			expect(updated[:key_63]).to be == -1
+			expect(updated[:extra]).to be == 64
+			expect(updated[:key_0]).to be == 0
+		end
+	end
+	
+	with "#derive" do
+		it "inherits pairs from the parent" do
+			parent = subject.new(request_id: "req1", user_id: 42)
+			state = parent.derive(user_id: 43, span_id: 1)
+			
+			expect(state[:request_id]).to be == "req1"
+			expect(state[:user_id]).to be == 43
+			expect(state[:span_id]).to be == 1
+			expect(state.size).to be == 3
+			expect(state.to_h).to be == {request_id: "req1", user_id: 43, span_id: 1}
+			
+			# The parent is unchanged:
+			expect(parent.to_h).to be == {request_id: "req1", user_id: 42}
+		end
+		
+		it "can derive from a derived state" do
+			state = subject.new(layer: 0)
+			
+			20.times do |i|
+				state = state.derive(layer: i + 1, :"key_#{i}" => i)
+			end
+			
+			expect(state[:layer]).to be == 20
+			expect(state.size).to be == 21
+			
+			20.times do |i|
+				expect(state[:"key_#{i}"]).to be == i
+			end
+		end
+		
+		it "keeps the parent alive" do
+			state = subject.new(request_id: "req1".dup).derive(span_id: 1)
+			
+			GC.start
+			GC.compact if GC.respond_to?(:compact)
+			
+			expect(state[:request_id]).to be == "req1"
+		end
+		
+		it "can be flattened using with" do
+			state = subject.new(request_id: "req1").derive(span_id: 1).with(user_id: 42)
+			
+			expect(state.to_h).to be == {request_id: "req1", span_id: 1, user_id: 42}
+		end
+		
+		it "returns self when no updates provided" do
+			original = subject.new(request_id: "req1")
+			result = original.derive
+			
+			expect(result).to be == original
+		end
+	end
+	
+	with "#update!" do
+		it "updates existing keys in place" do
+			state = subject.new(request_id: "req1", phase: :app)
+			
+			expect(state.update!(phase: :db)).to be == state
+			expect(state[:phase]).to be == :db
+			expect(state.size).to be == 2
+		end
+		
+		it "grows the table for new keys" do
+			state = subject.new(request_id: "req1")
+			
+			20.times do |i|
+				state.update!(:"key_#{i}" => i)
+			end
+			
+			expect(state.size).to be == 21
+			expect(state[:request_id]).to be == "req1"
+			expect(state[:key_19]).to be == 19
+		end
+		
+		it "updates the applied state" do
+			state = subject.new(request_id: "req1")
+			state.apply!
+			
+			state.update!(**32.times.to_h{|i| [:"key_#{i}", i]})
+			
+			expect(Fiber.current.ruby_profiler_state).to be == state
+			expect(state[:key_31]).to be == 31
+		end
+		
+		it "can update an empty state" do
+			state = subject.new
+			state.update!(request_id: "req1")
+			
+			expect(state.to_h).to be == {request_id: "req1"}
+		end
+		
+		it "shadows keys inherited from the parent" do
+			parent = subject.new(request_id: "req1", phase: :app)
+			state = parent.derive(span_id: 1)
+			
+			state.update!(phase: :db)
+			
+			expect(state[:phase]).to be == :db
+			expect(parent[:phase]).to be == :app
+		end
+		
+		it "can't update a state which has derived states" do
+			parent = subject.new(request_id: "req1")
+			parent.derive(span_id: 1)
+			
+			expect{parent.update!(request_id: "req2")}.to raise_exception(RuntimeError)
+		end
+		
+		it "can't update a frozen state" do
+			state = subject.new(request_id: "req1").freeze
+			
+			expect{state.update!(phase: :db)}.to raise_exception(FrozenError)
+			expect(state.to_h).to be == {request_id: "req1"}
+		end
+	end
+	
+	with "#[]=" do
+		it "sets a value" do
+			state = subject.new(request_id: "req1")
+			
+			state[:phase] = :db
+			state[:request_id] = "req2"
+			
+			expect(state.to_h).to be == {request_id: "req2", phase: :db}
+		end
+		
+		it "raises TypeError for non-symbol keys" do
+			state = subject.new
+			
+			expect{state["phase"] = :db}.to raise_exception(TypeError)
+		end
+		
+		it "can't set a value of a frozen state" do
+			state = subject.new(request_id: "req1").freeze
+			
+			expect{state[:request_id] = "req2"}.to raise_exception(FrozenError)
+			expect(state[:request_id]).to be == "req1"
+		end
+	end
+	
+	with "snapshots" do
+		before do
+			subject.snapshot = true
+		end
+		
+		after do
+			subject.snapshot = false
+		end
+		
+		it "renders values into snapshots" do
+			state = subject.new(request_id: "req-123", user_id: 42, phase: :db, object: Object.new)
+			
+			expect(state.snapshot(:request_id)).to be == "req-123"
+			expect(state.snapshot(:user_id)).to be == [42].pack("q")
+			expect(state.snapshot(:phase)).to be == "db"
+			expect(state.snapshot(:object)).to be_nil
+			expect(state.snapshot(:missing)).to be_nil
+		end
+		
+		it "truncates long strings" do
+			state = subject.new(request_id: "x" * 100)
+			
+			expect(state.snapshot(:request_id)).to be == "x" * 62
+		end
+		
+		it "updates snapshots for new and changed values" do
+			state = subject.new(request_id: "req-1")
+			updated = state.with(request_id: "req-2", span_id: 7)
+			
+			expect(updated.snapshot(:request_id)).to be == "req-2"
+			expect(updated.snapshot(:span_id)).to be == [7].pack("q")
+			
+			updated[:request_id] = "req-3"
+			expect(updated.snapshot(:request_id)).to be == "req-3"
+		end
+		
+		it "renders values of states created before snapshots were enabled" do
+			subject.snapshot = false
+			state = subject.new(request_id: "req-1")
+			subject.snapshot = true
+			
+			expect(state.snapshot(:request_id)).to be_nil
+			expect(state.with(span_id: 1).snapshot(:request_id)).to be == "req-1"
+		end
+	end
+	
+	with "fingerprints" do
+		def fingerprint(type, data)
+			([type] + data.bytes).reduce(0xCBF29CE484222325) do |hash, byte|
+				((hash ^ byte) * 0x100000001B3) & 0xFFFFFFFFFFFFFFFF
+			end
+		end
+		
+		before do
+			subject.fingerprint = true
+		end
+		
+		after do
+			subject.fingerprint = false
+		end
+		
+		it "computes fingerprints of values" do
+			state = subject.new(request_id: "req-123", user_id: 42, phase: :db, object: Object.new)
+			
+			expect(state.fingerprint(:request_id)).to be == fingerprint(1, "req-123")
+			expect(state.fingerprint(:user_id)).to be == fingerprint(2, [42].pack("q"))
+			expect(state.fingerprint(:phase)).to be == fingerprint(3, "db")
+			expect(state.fingerprint(:object)).to be_nil
+			expect(state.fingerprint(:missing)).to be_nil
+		end
+		
+		it "uses the complete contents of long strings" do
+			state = subject.new(a: "x" * 100, b: "x" * 101)
+			
+			expect(state.fingerprint(:a)).to be == fingerprint(1, "x" * 100)
+			expect(state.fingerprint(:a)).to be != state.fingerprint(:b)
+		end
+		
+		it "updates fingerprints for new and changed values" do
+			state = subject.new(request_id: "req-1")
+			updated = state.with(request_id: "req-2")
+			derived = updated.derive(span_id: 7)
+			
+			expect(updated.fingerprint(:request_id)).to be == fingerprint(1, "req-2")
+			expect(derived.fingerprint(:request_id)).to be == fingerprint(1, "req-2")
+			expect(derived.fingerprint(:span_id)).to be == fingerprint(2, [7].pack("q"))
+			
+			state[:request_id] = "req-3"
+			expect(state.fingerprint(:request_id)).to be == fingerprint(1, "req-3")
+		end
+		
+		it "computes fingerprints of states created before fingerprints were enabled" do
+			subject.fingerprint = false
+			state = subject.new(request_id: "req-1")
+			subject.fingerprint = true
+			
+			expect(state.fingerprint(:request_id)).to be_nil
+			expect(state.with(span_id: 1).fingerprint(:request_id)).to be == fingerprint(1, "req-1")
+		end
+	end
+	
+	with "cpu time" do
+		# Use CPU time for the current thread, measured the same way:
+		def burn(duration)
+			finish = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) + duration
+			
+			while Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) < finish
+			end
+		end
+		
+		after do
+			subject.cpu_time = false
+		end
+		
+		it "is disabled by default" do
+			expect(subject.cpu_time?).to be == false
+			
+			state = subject.new(request_id: "req-1")
+			state.apply{burn(0.01)}
+			
+			expect(state.cpu_time).to be == 0.0
+		end
+		
+		it "charges the CPU time of each fiber to its state" do
+			subject.cpu_time = true
+			expect(subject.cpu_time?).to be == true
+			
+			busy = subject.new(request_id: "busy")
+			idle = subject.new(request_id: "idle")
+			
+			fibers = {busy => 0.03, idle => 0.01}.map do |state, duration|
+				Fiber.new do
+					state.apply!
+					
+					5.times do
+						burn(duration)
+						Fiber.yield
+					end
+				end
+			end
+			
+			6.times do
+				fibers.each(&:resume)
+			end
+			
+			expect(busy.cpu_time).to be >= 0.15
+			expect(idle.cpu_time).to be >= 0.05
+			expect(idle.cpu_time).to be < 0.1
+		end
+		
+		it "excludes the CPU time of nested states" do
+			subject.cpu_time = true
+			
+			outer = subject.new(phase: :outer)
+			inner = subject.new(phase: :inner)
+			
+			outer.apply do
+				burn(0.01)
+				inner.apply{burn(0.05)}
+				burn(0.01)
+			end
+			
+			expect(outer.cpu_time).to be >= 0.02
+			expect(outer.cpu_time).to be < 0.05
+			expect(inner.cpu_time).to be >= 0.05
+		end
+		
+		it "charges the CPU time of other threads" do
+			subject.cpu_time = true
+			
+			state = subject.new(request_id: "req-1")
+			
+			2.times.map do
+				Thread.new do
+					state.apply{burn(0.02)}
+				end
+			end.each(&:join)
+			
+			expect(state.cpu_time).to be >= 0.04
+		end
+		
+		it "can free a state while another thread is charging it" do
+			subject.cpu_time = true
+			
+			other = subject.new(request_id: "other")
+			applied = Thread::Queue.new
+			resume = Thread::Queue.new
+			
+			# Otherwise the state would also be kept alive by the thread's fiber storage:
+			subject.inherit = false
+			
+			thread = Thread.new do
+				subject.new(request_id: "freed").apply!
+				applied << Fiber.current
+				resume.pop
+				
+				burn(0.01)
+				other.apply{burn(0.01)}
+			end
+			
+			fiber = applied.pop
+			reference = WeakRef.new(fiber.ruby_profiler_state)
+			fiber.ruby_profiler_state = nil
+			
+			# The state may be kept alive by a stale reference on the machine stack, so collect until it's freed:
+			10.times do
+				GC.start
+				break unless reference.weakref_alive?
+			end
+			
+			expect(reference.weakref_alive?).to be_falsey
+			
+			resume << true
+			thread.join
+			
+			expect(other.cpu_time).to be >= 0.01
+		ensure
+			subject.inherit = true
+		end
+	end
+	
+	with ".symbols" do
+		it "includes every key used in a state" do
+			state = subject.new(symbols_test_key: 1)
+			state[:symbols_test_other_key] = 2
+			
+			expect(subject.symbols.include?(:symbols_test_key)).to be == true
+			expect(subject.symbols.include?(:symbols_test_other_key)).to be == true
+		end
+		
+		it "only includes each key once" do
+			3.times{subject.new(symbols_test_key: 1)}
+			
+			expect(subject.symbols.count(:symbols_test_key)).to be == 1
+		end
+	end
+	
+	with ".registry" do
+		it "registers threads which apply a state" do
+			skip "Thread#native_thread_id not supported" unless Thread.method_defined?(:native_thread_id)
+			
+			thread = Thread.new do
+				subject.new(request_id: "req1").apply!
+				
+				subject.registry.include?(Thread.current.native_thread_id)
+			end
+			
+			expect(thread.value).to be == true
+		end
+		
+		it "registers only the forking thread in a child process" do
+			skip "Thread#native_thread_id not supported" unless Thread.method_defined?(:native_thread_id)
+			skip "Process.fork not supported" unless Process.respond_to?(:fork)
+			
+			subject.new(request_id: "req1").apply!
+			
+			# Another registered thread, which doesn't exist in the child:
+			waiting = Thread::Queue.new
+			thread = Thread.new do
+				subject.new(request_id: "req2").apply!
+				waiting.pop
+			end
+			Thread.pass until thread.status == "sleep"
+			
+			input, output = IO.pipe
+			
+			pid = Process.fork do
+				input.close
+				registry = subject.registry
+				
+				# Clearing the other threads mustn't touch the thread which no longer exists:
+				Ruby::Profiler.disable!
+				Ruby::Profiler.enable!
+				subject.new(request_id: "req3").apply!
+				
+				output.write(Marshal.dump([Process.pid, registry, subject.registry, subject.published]))
+				output.close
+				exit!(0)
+			end
+			
+			output.close
+			tid, registry, applied, published = Marshal.load(input.read)
+			Process.wait(pid)
+			
+			waiting << true
+			thread.join
+			
+			expect($?.success?).to be == true
+			expect(registry).to be == [tid]
+			expect(applied).to be == [tid]
+			expect(published).to be == {request_id: "req3"}
+			expect(subject.registry.include?(Thread.current.native_thread_id)).to be == true
+		end
+	end
+	
+	with ".slab_statistics" do
+		it "reports tables allocated from slabs" do
+			pairs = 32.times.to_h{|i| [:"key_#{i}", i]}
+			states = 10.times.map{subject.new(**pairs)}
+			
+			statistics = subject.slab_statistics
+			expect(statistics[:slabs]).to be > 0
+			expect(statistics[:allocated]).to be >= states.size
+			expect(statistics[:size]).to be > 0
+		end
+		
+		it "can allocate and free tables across threads" do
+			pairs = 8.times.to_h{|i| [:"key_#{i}", i]}
+			
+			threads = 4.times.map do
+				Thread.new do
+					100.times.map{subject.new(**pairs)}
+				end
+			end
+			
+			states = threads.flat_map(&:value)
+			expect(states.map(&:to_h).uniq).to be == [pairs]
+		end
+	end
+	
+	with "inline storage" do
+		# The address of an object, which changes if it's moved by compaction:
+		def address(object)
+			ObjectSpace.dump(object)[/"address":"(\w+)"/, 1]
+		end
+		
+		it "keeps values of small states across compaction" do
+			skip "GC compaction not supported" unless GC.respond_to?(:compact)
+			
+			state = subject.new(request_id: "req1", user_id: 42)
+			state.apply!
+			
+			GC.compact
+			
+			expect(state.to_h).to be == {request_id: "req1", user_id: 42}
+			expect(state.with(span_id: 1)[:request_id]).to be == "req1"
+		end
+		
+		it "only pins states which have been published" do
+			skip "GC compaction not supported" unless GC.respond_to?(:verify_compaction_references)
+			
+			# Objects referenced from the machine stack are pinned too, so use many states:
+			states = 100.times.map{|i| subject.new(request_id: "req1", user_id: i)}
+			applied = 100.times.map{|i| subject.new(request_id: "req2", user_id: i).tap(&:apply!)}
+			
+			addresses = (states + applied).map{|object| address(object)}
+			GC.verify_compaction_references(expand_heap: true, toward: :empty)
+			moved = (states + applied).zip(addresses).reject{|object, previous| address(object) == previous}.map(&:first)
+			
+			expect(moved.size).to be > 0
+			expect(moved & applied).to be == []
+			expect(states.map{|state| state[:user_id]}).to be == 100.times.to_a
+			expect(states.last.with(span_id: 1)[:user_id]).to be == 99
+		end
 	end
 	
 	with "#with" do
@@ -152,6 +1036,21 @@ describe Ruby::Profiler::State do
 			expect(updated.size).to be == 3
 		end
 		
+		it "updates values when all keys already exist" do
+			original = subject.new(request_id: "req1", user_id: 1, action: "read")
+			updated = original.with(user_id: 2, action: "update")
+			
+			expect(updated.to_h).to be == {request_id: "req1", user_id: 2, action: "update"}
+			expect(original.to_h).to be == {request_id: "req1", user_id: 1, action: "read"}
+		end
+		
+		it "grows the table when adding many keys" do
+			original = subject.new(a: 1, b: 2)
+			updated = original.with(c: 3, d: 4, e: 5, a: 0)
+			
+			expect(updated.to_h).to be == {a: 0, b: 2, c: 3, d: 4, e: 5}
+		end
+		
 		it "returns self when no updates provided" do
 			original = subject.new(request_id: "req1")
 			result = original.with
@@ -0,0 +1,66 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+require "ruby/profiler"
+
+describe Ruby::Profiler::State::Shape do
+	let(:shape) {subject.new(:request_id, :user_id, :endpoint, :tenant)}
+	
+	with "#initialize" do
+		it "has keys in declaration order" do
+			expect(shape).to have_attributes(
+				keys: be == [:request_id, :user_id, :endpoint, :tenant],
+				size: be == 4
+			)
+		end
+		
+		it "raises TypeError for non-symbol keys" do
+			expect{subject.new(:request_id, "user_id")}.to raise_exception(TypeError)
+		end
+		
+		it "raises ArgumentError for duplicate keys" do
+			expect{subject.new(:request_id, :request_id)}.to raise_exception(ArgumentError)
+		end
+	end
+	
+	with "#new" do
+		it "creates a state with values in key order" do
+			state = shape.new("req1", 42, "/api/users", "acme")
+			
+			expect(state).to be_a(Ruby::Profiler::State)
+			expect(state.size).to be == 4
+			expect(state.to_h).to be == {request_id: "req1", user_id: 42, endpoint: "/api/users", tenant: "acme"}
+		end
+		
+		it "raises ArgumentError for the wrong number of values" do
+			expect{shape.new("req1")}.to raise_exception(ArgumentError)
+		end
+		
+		it "can create an empty state" do
+			state = subject.new.new
+			
+			expect(state.size).to be == 0
+		end
+		
+		it "is equivalent to creating the state from a hash" do
+			keys = 33.times.map{|i| :"key_#{i}"}
+			values = 33.times.to_a
+			
+			state = subject.new(*keys).new(*values)
+			
+			expect(state.to_h).to be == Ruby::Profiler::State.new(**keys.zip(values).to_h).to_h
+		end
+		
+		it "can be updated using #with" do
+			state = shape.new("req1", 42, "/api/users", "acme")
+			updated = state.with(user_id: 43, phase: :db)
+			
+			expect(updated[:user_id]).to be == 43
+			expect(updated[:phase]).to be == :db
+			expect(updated[:request_id]).to be == "req1"
+			expect(state[:user_id]).to be == 42
+		end
+	end
+end
@@ -0,0 +1,49 @@
+# frozen_string_literal: true
+
+# Released under the MIT License.
+# Copyright, 2025, by Samuel Williams.
+
+require "ruby/profiler"
+
+describe Ruby::Profiler::Timeline do
+	before do
+		Ruby::Profiler.enable!
+	end
+	
+	after do
+		subject.disable!
+	end
+	
+	it "is disabled by default" do
+		expect(subject.enabled?).to be == false
+	end
+	
+	it "records fiber switches" do
+		subject.enable!
+		
+		state = Ruby::Profiler::State.new(request_id: "req1")
+		count = subject.records.size
+		
+		Fiber.new do
+			state.apply!
+			Fiber.yield
+		end.resume
+		
+		records = subject.records
+		
+		# Switching into the fiber, applying the state, and switching back:
+		expect(records.size).to be >= [count + 3, Ruby::Profiler::Timeline::BUFFER_CAPACITY].min
+		expect(records.map{|record| record[:state]}.any?(&:positive?)).to be == true
+		
+		timestamps = records.map{|record| record[:timestamp]}
+		expect(timestamps.sort).to be == timestamps
+	end
+	
+	it "doesn't record when disabled" do
+		count = subject.records.size
+		
+		Fiber.new{}.resume
+		
+		expect(subject.records.size).to be == count
+	end
+end